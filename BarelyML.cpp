@@ -30,714 +30,3672 @@
 */
 
 #include <JuceHeader.h>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <list>
+#include <functional>
+#include <cstring>
 #include "BarelyML.h"
 
+// the parser scans for markup characters 16 bytes at a time with SSE2 or NEON (if available,
+// define BARELYML_NO_SIMD to always use the scalar loops)
+#if !defined(BARELYML_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+ #include <emmintrin.h>
+ #define BARELYML_USE_SSE2 1
+#elif !defined(BARELYML_NO_SIMD) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+ #include <arm_neon.h>
+ #define BARELYML_USE_NEON 1
+#endif
+
 using namespace juce;
 
-//==============================================================================
+//==============================================================================
+
+// MARK: - Document
+
+static const char* findFirstOf(const char* s, const char* e, char c1, char c2, char c3) {
+  // returns the first of the bytes c1, c2 and c3 in s...e (or e), skipping 16 bytes at a time
+  // that contain none of them (which is most of them in plain text)
+#if BARELYML_USE_SSE2
+  const __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2), v3 = _mm_set1_epi8(c3);
+  while (e - s >= 16) {
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, v1), _mm_cmpeq_epi8(b, v2)), _mm_cmpeq_epi8(b, v3));
+    if (_mm_movemask_epi8(m) != 0) { break; } // (the loop below finds it)
+    s += 16;
+  }
+#elif BARELYML_USE_NEON
+  const uint8x16_t v1 = vdupq_n_u8((uint8_t)c1), v2 = vdupq_n_u8((uint8_t)c2), v3 = vdupq_n_u8((uint8_t)c3);
+  while (e - s >= 16) {
+    uint8x16_t b = vld1q_u8(reinterpret_cast<const uint8_t*>(s));
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(b, v1), vceqq_u8(b, v2)), vceqq_u8(b, v3));
+    if (vmaxvq_u8(m) != 0) { break; }
+    s += 16;
+  }
+#endif
+  while (s < e && *s != c1 && *s != c2 && *s != c3) { s++; }
+  return s;
+}
+
+static const char* findPair(const char* s, const char* e, char c) {
+  // returns the first occurrence of two c in a row in s...e (or e)
+  for (s = findFirstOf(s, e, c, c, c); s+1 < e; s = findFirstOf(s+1, e, c, c, c)) {
+    if (s[1] == c) { return s; }
+  }
+  return e;
+}
+
+static int64 hashBlockLines(int type, const StringArray& lines, int firstLine, int numLines) {
+  uint64 hash = (uint64)type;
+  for (int i=firstLine; i<firstLine+numLines; i++) {
+    hash = hash * 1099511628211ULL + (uint64)lines[i].hashCode64() + 1; // (+1, so that empty lines count too)
+  }
+  return (int64)hash;
+}
+
+static const int blockTypeOfKind[] = { // block type parseBlock gives the lines of a LineKind
+  BarelyMLDocument::listItemBlock, BarelyMLDocument::admonitionBlock, BarelyMLDocument::imageBlock,
+  BarelyMLDocument::tableBlock, BarelyMLDocument::textBlock, BarelyMLDocument::textBlock
+};
+
+static void runChunks(ThreadPool& pool, int numChunks, const std::function<void(int)>& parseChunk) {
+  // calls parseChunk for chunks 0 to numChunks-1 on the pool and on the calling thread (whichever
+  // thread is free takes the next chunk) and returns when all of them are done
+  std::atomic<int> nextChunk { 0 };
+  auto parseChunks = [&] {
+    for (int c = nextChunk++; c < numChunks; c = nextChunk++) {
+      parseChunk(c);
+    }
+  };
+  int numJobs = jmin(pool.getNumThreads(), numChunks-1);
+  std::atomic<int> runningJobs { numJobs };
+  WaitableEvent jobsDone;
+  for (int j=0; j<numJobs; j++) {
+    pool.addJob([&] {
+      parseChunks();
+      if (--runningJobs == 0) { jobsDone.signal(); }
+    });
+  }
+  parseChunks();
+  if (numJobs > 0) { jobsDone.wait(); } // (the jobs refer to our local variables)
+}
+
+BarelyMLDocument BarelyMLDocument::parse(const String& markup, ThreadPool* pool, int minParallelSize) {
+  return parse(markup, nullptr, pool, minParallelSize);
+}
+
+BarelyMLDocument BarelyMLDocument::parse(const String& markup, const BarelyMLDocument& previous, ThreadPool* pool, int minParallelSize) {
+  return parse(markup, &previous, pool, minParallelSize);
+}
+
+BarelyMLDocument BarelyMLDocument::parse(const String& markup, const BarelyMLDocument* previous, ThreadPool* pool, int minParallelSize) {
+  BarelyMLDocument doc;
+  doc.colours.push_back({ ColourRef::defaultColour, 0, -1, 0 }); // colours[0] -> default colour
+  double start = Time::getMillisecondCounterHiRes();
+  
+  StringArray lines;
+  lines.addLines(markup);
+  std::vector<LineKind> kinds((size_t)lines.size());
+  
+  // small documents (or no pool) -> parse everything right here
+  if (pool == nullptr || lines.size() < 2 || (int)markup.getNumBytesAsUTF8() < minParallelSize) {
+    for (int i=0; i<lines.size(); i++) {
+      kinds[(size_t)i] = classifyLine(lines[i]);
+    }
+    std::vector<BlockLines> found = findBlocks(lines, kinds);
+    std::vector<int> unchanged = findUnchangedBlocks(found, lines, previous);
+    double classified = Time::getMillisecondCounterHiRes();
+    for (size_t i=0; i<found.size(); i++) {
+      if (unchanged[i] >= 0) {
+        doc.appendBlock(*previous, unchanged[i]);
+      } else {
+        doc.parseBlock(found[i], lines);
+      }
+    }
+    doc.parseTimes = { classified-start, Time::getMillisecondCounterHiRes()-classified };
+    return doc;
+  }
+  
+  // otherwise classify the lines in parallel (more chunks than threads, so that threads which
+  // are done early can take over the remaining ones)...
+  int numChunks = jmin(lines.size(), 4*(pool->getNumThreads()+1));
+  runChunks(*pool, numChunks, [&](int c) {
+    int end = (int)((int64)lines.size() * (c+1) / numChunks);
+    for (int i=(int)((int64)lines.size() * c / numChunks); i<end; i++) {
+      kinds[(size_t)i] = classifyLine(lines[i]);
+    }
+  });
+  
+  // ...group them into blocks and split those into chunks of about the same number of lines...
+  std::vector<BlockLines> found = findBlocks(lines, kinds);
+  std::vector<int> unchanged = findUnchangedBlocks(found, lines, previous);
+  double classified = Time::getMillisecondCounterHiRes();
+  int numBlocks = (int)found.size();
+  numChunks = jmin(numBlocks, numChunks);
+  std::vector<int> chunkStart = { 0 };
+  for (int i=1; i<numBlocks && (int)chunkStart.size()<numChunks; i++) {
+    if ((int64)found[(size_t)i].firstLine * numChunks >= (int64)lines.size() * (int64)chunkStart.size()) {
+      chunkStart.push_back(i);
+    }
+  }
+  numChunks = (int)chunkStart.size();
+  chunkStart.push_back(numBlocks);
+  
+  // ...parse the chunks in parallel...
+  std::vector<BarelyMLDocument> parts((size_t)numChunks);
+  runChunks(*pool, numChunks, [&](int c) {
+    BarelyMLDocument& part = parts[(size_t)c];
+    part.colours.push_back({ ColourRef::defaultColour, 0, -1, 0 });
+    for (int i=chunkStart[(size_t)c]; i<chunkStart[(size_t)c+1]; i++) {
+      if (unchanged[(size_t)i] >= 0) {
+        part.appendBlock(*previous, unchanged[(size_t)i]);
+      } else {
+        part.parseBlock(found[(size_t)i], lines);
+      }
+    }
+  });
+  
+  // ...and merge them in order.
+  for (auto& part : parts) {
+    doc.append(part);
+  }
+  doc.parseTimes = { classified-start, Time::getMillisecondCounterHiRes()-classified };
+  return doc;
+}
+
+std::vector<int> BarelyMLDocument::findUnchangedBlocks(const std::vector<BlockLines>& found, const StringArray& lines, const BarelyMLDocument* previous) {
+  // for every block found, the index of the block of previous with the same hash (or -1)
+  std::vector<int> unchanged(found.size(), -1);
+  if (previous == nullptr || previous->blocks.empty()) { return unchanged; }
+  std::unordered_map<int64, int> previousBlocks;
+  for (int i=(int)previous->blocks.size()-1; i>=0; i--) {
+    previousBlocks[previous->blocks[(size_t)i].hash] = i; // (the first one, if there are several)
+  }
+  for (size_t i=0; i<found.size(); i++) {
+    auto it = previousBlocks.find(hashBlock(found[i], lines));
+    if (it != previousBlocks.end()) { unchanged[i] = it->second; }
+  }
+  return unchanged;
+}
+
+std::shared_ptr<const BarelyMLDocument> BarelyMLDocument::parseShared(const String& markup, ThreadPool* pool, int minParallelSize,
+                                                                      const BarelyMLDocument* previous) {
+  // documents which are still in use, by markup (the keys share the markup's buffer)
+  static CriticalSection lock;
+  static std::unordered_map<String, std::weak_ptr<const BarelyMLDocument>, StringHash> documents;
+  static size_t pruneSize = 64;         // forget unused documents when the map has grown this large
+  {
+    const ScopedLock sl(lock);
+    auto it = documents.find(markup);
+    if (it != documents.end()) {
+      if (auto doc = it->second.lock()) { return doc; }
+    }
+  }
+  auto doc = std::make_shared<const BarelyMLDocument>(parse(markup, previous, pool, minParallelSize));
+  const ScopedLock sl(lock);
+  documents[markup] = doc;              // (if it's been parsed twice at the same time, the last one wins)
+  if (documents.size() >= pruneSize) {
+    for (auto it = documents.begin(); it != documents.end(); ) {
+      it = it->second.expired() ? documents.erase(it) : std::next(it);
+    }
+    pruneSize = jmax((size_t)64, documents.size()*2);
+  }
+  return doc;
+}
+
+BarelyMLDocument::LineKind BarelyMLDocument::classifyLine(const String& line) {
+  // (the order matters, e.g. a list item may contain a link)
+  if (isListItem(line))       { return listItemLines; }
+  if (isAdmonitionLine(line)) { return admonitionLines; }
+  if (isImageLine(line))      { return imageLines; }
+  if (isTableLine(line))      { return tableLines; }
+  if (containsLink(line))     { return linkLines; }
+  return textLines;
+}
+
+std::vector<BarelyMLDocument::BlockLines> BarelyMLDocument::findBlocks(const StringArray& lines, const std::vector<LineKind>& kinds) {
+  std::vector<BlockLines> found;
+  int numLines = lines.size();
+  int li=0; // line index
+  while (li<numLines) {
+    BlockLines bl = { kinds[(size_t)li], li, 1 };
+    if (bl.kind == tableLines) {                    // if we find a table...
+      while (li<numLines && kinds[(size_t)li] == tableLines) { // ...while line belongs to table...
+        li++;                                       // ...go to the next line.
+      }
+    } else if (bl.kind == textLines) {              // if we find text...
+      bool blockEnd = false;
+      while (li<numLines && kinds[(size_t)li] == textLines && !blockEnd) { // ...while there's more...
+        blockEnd = lines[li].isEmpty();             // ...set up shouldEndBlock...
+        li++;                                       // ...go to the next line...
+        blockEnd &= lines[li].isNotEmpty();         // ...and finish shouldEndBlock.
+      }
+    } else {                                        // list items, admonitions, images and links...
+      li++;                                         // ...are single lines.
+    }
+    bl.numLines = li - bl.firstLine;
+    found.push_back(bl);
+  }
+  return found;
+}
+
+void BarelyMLDocument::parseBlock(const BlockLines& bl, const StringArray& lines) {
+  StringArray blines(lines.begin()+bl.firstLine, bl.numLines); // lines belonging to the block
+  BlockNode b = {};
+  b.imageWidth = -1;
+  switch (bl.kind) {
+    case listItemLines:   parseListItem(b, blines[0]);   break;
+    case admonitionLines: parseAdmonition(b, blines[0]); break;
+    case imageLines:      parseImage(b, blines[0]);      break;
+    case tableLines:      parseTable(b, blines);         break;
+    case linkLines:       parseLinkBlock(b, blines[0]);  break;
+    case textLines:       parseTextBlock(b, blines);     break;
+  }
+  b.hash = hashBlockLines(b.type, lines, bl.firstLine, bl.numLines);
+  jassert(b.hash == hashBlock(bl, lines)); // (blockTypeOfKind must match the parse functions)
+  blocks.push_back(b);
+}
+
+int64 BarelyMLDocument::hashBlock(const BlockLines& bl, const StringArray& lines) {
+  return hashBlockLines(blockTypeOfKind[bl.kind], lines, bl.firstLine, bl.numLines);
+}
+
+void BarelyMLDocument::appendBlock(const BarelyMLDocument& other, int index) {
+  // like append, but text and colours are copied as they're used (so this only costs as much
+  // as the block is large)
+  auto copyText = [&](TextRange r) {
+    if (r.isEmpty()) { return r; }
+    TextRange copy = { (int)text.size(), r.length };
+    text.insert(text.end(), other.text.begin()+r.start, other.text.begin()+r.start+r.length);
+    return copy;
+  };
+  std::function<int(int)> copyColour = [&](int colour) {
+    if (colour <= 0) { return 0; }    // (default colour)
+    const ColourRef& c = other.colours[(size_t)colour];
+    if (c.kind == ColourRef::namedColour) {
+      return addColour(c.kind, 0, other.colourNames[c.name], copyColour(c.fallback));
+    }
+    return addColour(c.kind, c.argb, String(), 0);
+  };
+  auto copyRuns = [&](int first, int num) {
+    int copy = (int)runs.size();
+    for (int i=first; i<first+num; i++) {
+      Run r = other.runs[(size_t)i];
+      r.text = copyText(r.text);
+      r.colour = copyColour(r.colour);
+      runs.push_back(r);
+    }
+    return copy;
+  };
+  BlockNode b = other.blocks[(size_t)index];
+  if (b.type == tableBlock) {
+    int firstRow = (int)rows.size();
+    for (int i=b.firstRow; i<b.firstRow+b.numRows; i++) {
+      Row r = other.rows[(size_t)i];
+      int firstCell = (int)cells.size();
+      for (int j=r.firstCell; j<r.firstCell+r.numCells; j++) {
+        Cell c = other.cells[(size_t)j];
+        c.firstRun = copyRuns(c.firstRun, c.numRuns);
+        c.link = copyText(c.link);
+        c.image = copyText(c.image);
+        cells.push_back(c);
+      }
+      r.firstCell = firstCell;
+      rows.push_back(r);
+    }
+    b.firstRow = firstRow;
+  } else if (b.type != imageBlock) {
+    b.firstRun = copyRuns(b.firstRun, b.numRuns);
+  }
+  b.link = copyText(b.link);
+  b.image = copyText(b.image);
+  b.label = copyText(b.label);
+  blocks.push_back(b);
+}
+
+void BarelyMLDocument::append(const BarelyMLDocument& part, int firstBlock, int numBlocks) {
+  int textOffset = (int)text.size();
+  int runOffset = (int)runs.size();
+  int rowOffset = (int)rows.size();
+  int cellOffset = (int)cells.size();
+  auto rebase = [textOffset](TextRange r) {
+    return r.isEmpty() ? r : TextRange { r.start+textOffset, r.length };
+  };
+  // colours are interned again (in order, so that fallbacks are mapped before they're used)
+  std::vector<int> colourMap(part.colours.size(), 0);
+  for (size_t i=1; i<part.colours.size(); i++) {
+    const ColourRef& c = part.colours[i];
+    if (c.kind == ColourRef::namedColour) {
+      colourMap[i] = addColour(c.kind, 0, part.colourNames[c.name], colourMap[(size_t)c.fallback]);
+    } else {
+      colourMap[i] = addColour(c.kind, c.argb, String(), 0);
+    }
+  }
+  text.insert(text.end(), part.text.begin(), part.text.end());
+  for (Run r : part.runs) {
+    r.text = rebase(r.text);
+    r.colour = colourMap[(size_t)r.colour];
+    runs.push_back(r);
+  }
+  for (Cell c : part.cells) {
+    c.firstRun += runOffset;
+    c.link = rebase(c.link);
+    c.image = rebase(c.image);
+    cells.push_back(c);
+  }
+  for (Row r : part.rows) {
+    r.firstCell += cellOffset;
+    rows.push_back(r);
+  }
+  if (numBlocks < 0) { numBlocks = (int)part.blocks.size() - firstBlock; }
+  for (int i=firstBlock; i<firstBlock+numBlocks; i++) {
+    BlockNode b = part.blocks[(size_t)i];
+    if (b.type == tableBlock) {
+      b.firstRow += rowOffset;
+    } else if (b.type != imageBlock) {
+      b.firstRun += runOffset;
+    }
+    b.link = rebase(b.link);
+    b.image = rebase(b.image);
+    b.label = rebase(b.label);
+    blocks.push_back(b);
+  }
+}
+
+Colour BarelyMLDocument::parseHexColour(String s, Colour defaultColour) {
+  if (s.startsWith("#")) {
+    s = s.substring(1);
+    // if we have 3 or 4 characters, expand by duplicating characters
+    if (s.length()==3 || s.length()==4) {
+      String expanded;
+      for (int i=0; i<s.length(); i++) {
+        expanded += s[i];
+        expanded += s[i];
+      }
+      s = expanded;
+    }
+    if (s.length()==6) { // also applies to duplicated 3 char string
+      s = String("FF")+s;
+    }
+  }
+  if (s.isEmpty()) {
+    return defaultColour;
+  } else {
+    return Colour::fromString(s);
+  }
+}
+
+bool BarelyMLDocument::isListItem(const String& line) {
+  // a list item starts with (optional) whitespace and "- ", or a number and ". " (possibly with
+  // whitespace around it), so we only need to look at the start of the line: the first byte that
+  // isn't whitespace or a digit has to be the "." or "-" (if it's the first ". " or "- " in the
+  // line, the line is a list item if the bytes before it are right, and otherwise it isn't)
+  const char* s = line.toRawUTF8();
+  int i = 0;
+  bool hasDigits = false, hasInnerWhitespace = false, afterDigits = false;
+  for (;; i++) {
+    char c = s[i];
+    if (c >= '0' && c <= '9') {
+      if (afterDigits) { hasInnerWhitespace = true; } // (e.g. "1 2.", which isn't a number)
+      hasDigits = true;
+    } else if (CharacterFunctions::isWhitespace(c)) {
+      afterDigits = hasDigits;
+    } else {
+      break;
+    }
+  }
+  if ((s[i] & 0x80) != 0) {
+    // non-ASCII characters may be whitespace as well, so we leave these lines to juce::String
+    return (line.indexOf(". ")>0 && line.substring(0, line.indexOf(". ")).trim().containsOnly("0123456789"))
+           || (line.indexOf("- ")>=0 && !line.substring(0, line.indexOf("- ")).containsNonWhitespaceChars());
+  }
+  if (s[i] == '.' && s[i+1] == ' ') { return i > 0 && !hasInnerWhitespace; } // "1. " (or just " . ")
+  if (s[i] == '-' && s[i+1] == ' ') { return !hasDigits; }                    // "- "
+  return false;
+}
+
+bool BarelyMLDocument::isAdmonitionLine(const String& line) {
+  return line.startsWith("INFO: ") || line.startsWith("HINT: ") || line.startsWith("IMPORTANT: ") || line.startsWith("CAUTION: ") || line.startsWith("WARNING: ");
+}
+
+bool BarelyMLDocument::isImageLine(const String& line) {
+  return (line.startsWith("{{") && line.trim().endsWith("}}")) || // either just an image...
+         (line.startsWith("[[") && line.trim().endsWith("]]") &&  // ...or a link around...
+          line.contains("{{") && line.fromFirstOccurrenceOf("{{", false, false).contains("}}")); // ...an image.
+}
+
+bool BarelyMLDocument::isTableLine(const String& line) {
+  return line.startsWith("^") || line.startsWith("|");
+}
+
+bool BarelyMLDocument::containsLink(const String& line) {
+  // "[[" followed by "]]" (not necessarily a valid link, see consumeLink)
+  const char* s = line.toRawUTF8();
+  const char* e = s + line.getNumBytesAsUTF8();
+  const char* open = findPair(s, e, '[');
+  return open < e && findPair(open+2, e, ']') < e;
+}
+
+BarelyMLDocument::TextRange BarelyMLDocument::addText(const String& s) {
+  TextRange r = { (int)text.size(), (int)s.getNumBytesAsUTF8() };
+  text.insert(text.end(), s.toRawUTF8(), s.toRawUTF8()+r.length);
+  return r;
+}
+
+BarelyMLDocument::TextRange BarelyMLDocument::addInlineText(const char* start, const char* end) {
+  // copies inline text to the arena, replacing line breaks (\\) with newline characters
+  TextRange r = { (int)text.size(), 0 };
+  while (start < end) {
+    const char* bs = static_cast<const char*>(memchr(start, '\\', (size_t)(end-start)));
+    if (bs == nullptr || bs+1 >= end) {
+      text.insert(text.end(), start, end);
+      break;
+    }
+    if (bs[1] == '\\') {                  // line break
+      text.insert(text.end(), start, bs);
+      text.push_back('\n');
+      start = bs+2;
+    } else {                               // single backslash
+      text.insert(text.end(), start, bs+1);
+      start = bs+1;
+    }
+  }
+  r.length = (int)text.size() - r.start;
+  return r;
+}
+
+int BarelyMLDocument::addColour(ColourRef::Kind kind, uint32 argb, const String& name, int fallback) {
+  int nameIndex = -1;
+  int64 key = (int64)argb;              // hex colours are identified by their value...
+  if (kind == ColourRef::namedColour) {
+    auto it = colourNameIndex.find(name);
+    if (it != colourNameIndex.end()) {
+      nameIndex = it->second;
+    } else {
+      nameIndex = colourNames.size();
+      colourNames.add(name);
+      colourNameIndex[name] = nameIndex;
+    }
+    key = ((int64)1 << 62) | ((int64)nameIndex << 31) | (int64)fallback; // ...named ones by name and fallback
+  }
+  auto it = colourIndex.find(key);
+  if (it != colourIndex.end()) {        // reuse the colour reference if it exists...
+    return it->second;
+  }
+  colours.push_back({ kind, argb, nameIndex, fallback }); // ...and add it otherwise
+  colourIndex[key] = (int)colours.size()-1;
+  return (int)colours.size()-1;
+}
+
+String BarelyMLDocument::consumeLink(String line, TextRange& link, int& linkStart, int& linkEnd) {
+  // replaces the first link in line with its (highlighted) label, linkStart and linkEnd
+  // are set to the label's byte offsets in the returned string (-1 if it's not highlighted)
+  linkStart = linkEnd = -1;
+  int idx1 = line.indexOf("[[");
+  int idx2 = line.indexOf(idx1, "]]");
+  if (idx1>=0 && idx2>idx1) {
+    String target = line.substring(idx1+2, idx2);
+    String label = target;
+    bool hasLabel = target.contains("|");
+    if (hasLabel) {
+      label = target.fromFirstOccurrenceOf("|", false, false);
+      target = target.upToFirstOccurrenceOf("|", false, false);
+    }
+    link = addText(target);
+    // if there's an image in the link...
+    if (hasLabel && label.contains("{{") && label.fromFirstOccurrenceOf("{{", false, false).contains("}}")) {
+      // ...return only the label...
+      return line.substring(0, idx1) + label + line.substring(idx2+2);
+    } else {
+      // ...otherwise, return highlighted text.
+      String highlighted = "<c:linkcolour>*" + label + "*</c>";
+      linkStart = (int)line.substring(0, idx1).getNumBytesAsUTF8();
+      linkEnd = linkStart + (int)highlighted.getNumBytesAsUTF8();
+      return line.substring(0, idx1) + highlighted + line.substring(idx2+2);
+    }
+  } else {
+    link = { 0, 0 };
+    return line;
+  }
+}
+
+void BarelyMLDocument::parseInline(const StringArray& lines, int& firstRun, int& numRuns, int linkStart, int linkEnd) {
+  // NOTE: linkStart and linkEnd are byte offsets in the (single) line
+  firstRun = (int)runs.size();
+  
+  int colour = 0; // start with default colour
+  
+  bool isBold = false;
+  bool isItalic = false;
+  
+  for (auto& line : lines)
+  {
+    const char* s = line.toRawUTF8();
+    int n = (int)line.getNumBytesAsUTF8();
+    // find heading markers ("# " to "##### ")
+    int heading = 0;
+    while (heading < 5 && heading < n && s[heading] == '#') { heading++; }
+    if (heading == 0 || heading >= n || s[heading] != ' ') { heading = 0; }
+    
+    if (heading > 0)
+    {
+      // headings have their own bold and italic state, and start with the default colour
+      bool headingBold = false;
+      bool headingItalic = false;
+      colour = 0;
+      parseInlineLine(s, heading+1, n, linkStart, linkEnd, heading, headingBold, headingItalic, colour);
+    }
+    else
+    {
+      parseInlineLine(s, 0, n, linkStart, linkEnd, 0, isBold, isItalic, colour);
+    }
+    
+    runs.push_back({ addText(" \n"), (isBold ? bold : 0) | (isItalic ? italic : 0), 0, 0 });
+  }
+  
+  numRuns = (int)runs.size() - firstRun;
+}
+
+void BarelyMLDocument::parseInlineLine(const char* s, int start, int end, int linkStart, int linkEnd, int heading, bool& isBold, bool& isItalic, int& colour) {
+  // Single forward scan over the UTF-8 bytes (all markup characters are ASCII, so
+  // we can't accidentally match a part of a multi-byte character). Text between
+  // tokens is copied to the text arena once, as one run.
+  int runStart = start;         // start of the pending run of text
+  int noTagEndFrom = end;       // there's no '>' at or after this position
+  // headings are bold up to the first '*' or '_', from there on only the toggled state counts
+  // (like in version 0.3, which replaced the bold heading font with the toggled one)
+  bool headingFont = heading > 0;
+  
+  // appends the pending run of text up to position i (empty runs are ignored)
+  auto addRun = [&](int i) {
+    if (i > runStart) {
+      int flags = (isBold || headingFont ? bold : 0) | (isItalic ? italic : 0) | (runStart >= linkStart && runStart < linkEnd ? link : 0);
+      runs.push_back({ addInlineText(s+runStart, s+i), flags, heading, colour });
+    }
+  };
+  
+  int i = start;
+  while (i < end) {
+    i = (int)(findFirstOf(s+i, s+end, '*', '_', '<') - s); // (skips plain text)
+    if (i >= end) { break; }
+    char c = s[i];
+    if (c == '*' || c == '_') {
+      // if the token is toggling the bold or italic state...
+      addRun(i);                          // ...first add everything up to the token...
+      if (c == '*') { isBold = !isBold; } // ...then toggle the status...
+      else { isItalic = !isItalic; }
+      headingFont = false;
+      runStart = ++i;                     // ...and continue after the token.
+    } else if (c == '<') {
+      // if the token is a tag, first figure out if it is a recognized tag...
+      int tagType = 0;
+      if (i+2 < end) {
+        if      (s[i+1] == 'c' && s[i+2] == '#') { tagType = 1; } // hex colour tag
+        else if (s[i+1] == 'c' && s[i+2] == ':') { tagType = 2; } // named colour tag
+        else if (s[i+1] == '/' && s[i+2] == 'c') { tagType = 3; } // end of colour tag
+      }
+      // ...and, if so, where it ends.
+      int tagEnd = -1;
+      if (tagType > 0 && i+3 < noTagEndFrom) {
+        const void* p = memchr(s+i+3, '>', (size_t)(end-i-3));
+        if (p) {
+          tagEnd = (int)(static_cast<const char*>(p) - s);
+        } else {
+          noTagEndFrom = i+3;             // don't look again for the rest of the line
+        }
+      }
+      if (tagEnd >= 0) {
+        addRun(i);                        // ...first add everything up to the tag...
+        if (tagType == 1) {
+          if (tagEnd > i+3) {
+            String hex = String::fromUTF8(s+i+2, tagEnd-i-2);
+            colour = addColour(ColourRef::hexColour, parseHexColour(hex, Colours::black).getARGB(), String(), 0);
+          } else {
+            colour = 0;
+          }
+        } else if (tagType == 2) {
+          // named colour tag (if the name is unknown, we keep the current colour)
+          colour = addColour(ColourRef::namedColour, 0, String::fromUTF8(s+i+3, tagEnd-i-3), colour);
+        } else {
+          colour = 0;
+        }
+        i = tagEnd+1;                     // ...then continue after the tag.
+        runStart = i;
+      } else {
+        i++;                              // not a tag -> '<' is part of the text
+      }
+    }
+  }
+  addRun(end);                            // add the remaining text
+}
+
+void BarelyMLDocument::parseTextBlock(BlockNode& b, const StringArray& lines) {
+  b.type = textBlock;
+  parseInline(lines, b.firstRun, b.numRuns);
+}
+
+void BarelyMLDocument::parseLinkBlock(BlockNode& b, const String& line) {
+  b.type = textBlock;
+  int linkStart, linkEnd;
+  String l = consumeLink(line, b.link, linkStart, linkEnd);
+  parseInline(l, b.firstRun, b.numRuns, linkStart, linkEnd);
+}
+
+void BarelyMLDocument::parseAdmonition(BlockNode& b, const String& line) {
+  b.type = admonitionBlock;
+  int linkStart = -1, linkEnd = -1;
+  String l = line;
+  if (containsLink(l)) {
+    l = consumeLink(l, b.link, linkStart, linkEnd);
+  }
+  if (l.startsWith("INFO: ")) { b.admonition = info; }
+  else if (l.startsWith("HINT: ")) { b.admonition = hint; }
+  else if (l.startsWith("IMPORTANT: ")) { b.admonition = important; }
+  else if (l.startsWith("CAUTION: ")) { b.admonition = caution; }
+  else if (l.startsWith("WARNING: ")) { b.admonition = warning; }
+  String text = l.fromFirstOccurrenceOf(": ", false, false);
+  int offset = (int)(l.getNumBytesAsUTF8() - text.getNumBytesAsUTF8());
+  parseInline(text, b.firstRun, b.numRuns, linkStart-offset, linkEnd-offset);
+}
+
+void BarelyMLDocument::parseImage(BlockNode& b, const String& line) {
+  b.type = imageBlock;
+  String l = line;
+  if (containsLink(l)) {
+    int linkStart, linkEnd;
+    l = consumeLink(l, b.link, linkStart, linkEnd);
+  }
+  String filename = l.fromFirstOccurrenceOf("{{", false, false).upToFirstOccurrenceOf("}}", false, false);
+  if (filename.contains("?")) {
+    b.imageWidth = filename.fromFirstOccurrenceOf("?", false, false).getIntValue();
+    filename = filename.upToFirstOccurrenceOf("?", false, false);
+  }
+  b.image = addText(filename);
+}
+
+void BarelyMLDocument::parseTable(BlockNode& b, const StringArray& lines) {
+  b.type = tableBlock;
+  b.firstRow = (int)rows.size();
+  for (auto line : lines) {
+    // find all cells in this line
+    Row row = { (int)cells.size(), 0 };
+    while (line.containsAnyOf("^|")) {
+      bool isHeader = line.startsWith("^");
+      line = line.substring(1);                     // remove left delimiter
+      int nextDelimiter = line.indexOfAnyOf("^|");  // find right delimiter
+      if (nextDelimiter>=0) {                       // no delimiter found -> we're done with this line
+        String rawString = line.substring(0, nextDelimiter);
+        // fix delimiter if we have broken apart a link
+        if (rawString.contains("[[") && !rawString.contains("]]") && line.contains("]]")) {
+          int linkEnd = line.indexOf("]]");
+          int idx1 = line.indexOf(linkEnd, "|");
+          int idx2 = line.indexOf(linkEnd, "^");
+          nextDelimiter = linkEnd;
+          if (idx1>=0 && (idx2<0 || idx1<idx2)) { nextDelimiter = idx1; }
+          if (idx2>=0 && (idx1<0 || idx2<idx1)) { nextDelimiter = idx2; }
+          rawString = line.substring(0, nextDelimiter);
+        }
+        line = line.substring(nextDelimiter);         // drop everything up to right delimiter
+        // TODO: use the number of whitespace characters on either side of rawString to determine justification
+        // TODO: implement || -> previous cell spans two columns
+        Cell cell = {};
+        cell.isHeader = isHeader;
+        cell.imageWidth = -1;
+        // check for link
+        String trimmed = rawString.trim();
+        int linkStart = -1, linkEnd = -1;
+        if (containsLink(trimmed)) {
+          trimmed = consumeLink(trimmed, cell.link, linkStart, linkEnd);
+        }
+        // check for image
+        if (trimmed.startsWith("{{") && trimmed.endsWith("}}")) {
+          String filename = trimmed.fromFirstOccurrenceOf("{{", false, false).upToFirstOccurrenceOf("}}", false, false);
+          if (filename.contains("?")) {
+            cell.imageWidth = filename.fromFirstOccurrenceOf("?", false, false).getIntValue();
+            filename = filename.upToFirstOccurrenceOf("?", false, false);
+          }
+          cell.image = addText(filename);
+        }
+        parseInline(trimmed, cell.firstRun, cell.numRuns, linkStart, linkEnd);
+        cells.push_back(cell);
+        row.numCells++;
+      }
+    }
+    rows.push_back(row);
+  }
+  b.numRows = (int)rows.size() - b.firstRow;
+}
+
+void BarelyMLDocument::parseListItem(BlockNode& b, const String& line) {
+  b.type = listItemBlock;
+  int linkStart = -1, linkEnd = -1;
+  String l = line;
+  if (containsLink(l)) {
+    l = consumeLink(l, b.link, linkStart, linkEnd);
+  }
+  int dotidx = l.indexOf(". ");                         // find dot+space in line
+  String beforedot = l.substring(0, dotidx);            // find out if before the dot...
+  String lbl = beforedot.trimStart();                   // ...there's only whitespace...
+  if (dotidx>0 && lbl.containsOnly("0123456789")) {     // ...and at least one number.
+    b.label = addText(lbl+".");                         // create label
+    // parse item text (everything after the dot)
+    String text = l.substring(dotidx+2).trimStart();
+    int offset = (int)(l.getNumBytesAsUTF8() - text.getNumBytesAsUTF8());
+    parseInline(text, b.firstRun, b.numRuns, linkStart-offset, linkEnd-offset);
+    // use number of whitespace characters to determine indent
+    b.indent = beforedot.length()-lbl.length();
+  } else {                                              // otherwise try unordered list:
+    int hyphenidx = l.indexOf("- ");                    // find hyphen+space in line
+    String beforehyphen = l.substring(0, hyphenidx);    // find out if before the hyphen...
+    if (!beforehyphen.containsNonWhitespaceChars()) {   // ...there's only whitespace.
+      // parse item text (everything after the hyphen)
+      String text = l.substring(hyphenidx+2).trimStart();
+      int offset = (int)(l.getNumBytesAsUTF8() - text.getNumBytesAsUTF8());
+      parseInline(text, b.firstRun, b.numRuns, linkStart-offset, linkEnd-offset);
+      // use number of whitespace characters to determine indent
+      b.indent = beforehyphen.length();
+      // create label TODO: have bullet character depend on indent
+      b.label = addText(CharPointer_UTF8("•"));
+    } else {  // if everything fails, interpret as regular text without label
+      b.indent = 0;
+      parseInline(l, b.firstRun, b.numRuns, linkStart, linkEnd);
+    }
+  }
+}
+
+// MARK: - Stream Parser
+
+BarelyMLDocument::StreamParser::StreamParser() {
+  doc.colours.push_back({ ColourRef::defaultColour, 0, -1, 0 }); // colours[0] -> default colour
+  minLinesToParse = 1;
+  maxLinesPerTextBlock = 0;
+  afterCR = false;
+  numBytes = 0;
+}
+
+void BarelyMLDocument::StreamParser::addData(const void* data, size_t size) {
+  double start = Time::getMillisecondCounterHiRes();
+  numBytes += (int64)size;
+  // splits the lines like StringArray::addLines does (at "\n", "\r\n" or "\r")
+  const char* s = static_cast<const char*>(data);
+  const char* e = s + size;
+  const char* lineStart = s;
+  for (const char* p = s; p < e; p++) {
+    if (*p == '\n' && afterCR) {        // (the "\n" of a "\r\n", maybe split between two pieces)
+      afterCR = false;
+      lineStart = p+1;
+    } else if (*p == '\n' || *p == '\r') {
+      tail.append(lineStart, (size_t)(p-lineStart));
+      addLine();
+      afterCR = *p == '\r';
+      lineStart = p+1;
+    } else {
+      afterCR = false;
+    }
+  }
+  tail.append(lineStart, (size_t)(e-lineStart));
+  doc.parseTimes.classify += Time::getMillisecondCounterHiRes() - start;
+  parseLines(false);
+}
+
+void BarelyMLDocument::StreamParser::finish() {
+  if (numBytes > 0) { addLine(); }      // (the last line, like addLines, even if it's empty)
+  parseLines(true);
+}
+
+void BarelyMLDocument::StreamParser::addLine() {
+  lines.add(String::fromUTF8(tail.data(), (int)tail.size()));
+  kinds.push_back(classifyLine(lines[lines.size()-1]));
+  tail.clear();
+}
+
+void BarelyMLDocument::StreamParser::parseLines(bool isLastPiece) {
+  if (lines.isEmpty() || (!isLastPiece && lines.size() < minLinesToParse)) { return; }
+  double start = Time::getMillisecondCounterHiRes();
+  // findBlocks only looks one line ahead, so all blocks but the last one are the same as if the
+  // whole markup was parsed, the last one may continue in the next piece (unless there is none)
+  std::vector<BlockLines> found = findBlocks(lines, kinds);
+  size_t numComplete = isLastPiece ? found.size() : found.size()-1;
+  for (size_t i=0; i<numComplete; i++) {
+    doc.parseBlock(found[i], lines);
+  }
+  int numParsed = numComplete < found.size() ? found[numComplete].firstLine : lines.size();
+  lines.removeRange(0, numParsed);
+  kinds.erase(kinds.begin(), kinds.begin()+numParsed);
+  // if the last block keeps growing (e.g. a long table), only look at it again when it's twice as
+  // long, so that it's not split into blocks over and over again
+  minLinesToParse = jmax(1, 2*lines.size());
+  doc.parseTimes.blocks += Time::getMillisecondCounterHiRes() - start;
+}
+
+std::vector<BarelyMLDocument::BlockLines> BarelyMLDocument::StreamParser::findBlocks(const StringArray& l, const std::vector<LineKind>& k) const {
+  std::vector<BlockLines> found = BarelyMLDocument::findBlocks(l, k);
+  if (maxLinesPerTextBlock <= 0) { return found; }
+  // the pieces of a long text block only depend on where it starts, so all but the last one are
+  // complete (even if the text block goes on)
+  std::vector<BlockLines> split;
+  for (auto& bl : found) {
+    int first = bl.firstLine;
+    while (bl.kind == textLines && bl.firstLine + bl.numLines - first > maxLinesPerTextBlock) {
+      split.push_back({ textLines, first, maxLinesPerTextBlock });
+      first += maxLinesPerTextBlock;
+    }
+    split.push_back({ bl.kind, first, bl.firstLine + bl.numLines - first });
+  }
+  return split;
+}
+
+BarelyMLDocument BarelyMLDocument::StreamParser::takeParsedBlocks() {
+  BarelyMLDocument parsed = std::move(doc);
+  doc = BarelyMLDocument();
+  doc.colours.push_back({ ColourRef::defaultColour, 0, -1, 0 });
+  return parsed;
+}
+
+BarelyMLDocument BarelyMLDocument::StreamParser::parsePending() const {
+  // parses copies of the lines which haven't been parsed yet (and of the last line), like
+  // finish() would
+  BarelyMLDocument pending;
+  pending.colours.push_back({ ColourRef::defaultColour, 0, -1, 0 });
+  StringArray l = lines;
+  std::vector<LineKind> k = kinds;
+  if (numBytes > 0) {
+    l.add(String::fromUTF8(tail.data(), (int)tail.size()));
+    k.push_back(classifyLine(l[l.size()-1]));
+  }
+  for (auto& bl : findBlocks(l, k)) {
+    pending.parseBlock(bl, l);
+  }
+  return pending;
+}
+
+// MARK: - Search
+
+String BarelyMLDocument::getPlainText(int block, Array<int>* cellStarts) const {
+  // concatenates the runs' text (as createAttributedString does), counting characters for the
+  // cell starts as we go
+  const BlockNode& b = blocks[(size_t)block];
+  std::string plain;
+  int numChars = 0;
+  auto addRuns = [&](int firstRun, int numRuns) {
+    for (int i=firstRun; i<firstRun+numRuns; i++) {
+      const TextRange& r = runs[(size_t)i].text;
+      const char* t = text.data()+r.start;
+      plain.append(t, (size_t)r.length);
+      for (int j=0; j<r.length; j++) {
+        if ((t[j] & 0xc0) != 0x80) { numChars++; } // (not a UTF-8 continuation byte)
+      }
+    }
+  };
+  if (b.type == tableBlock) {
+    for (int i=b.firstRow; i<b.firstRow+b.numRows; i++) {
+      const Row& row = rows[(size_t)i];
+      for (int j=row.firstCell; j<row.firstCell+row.numCells; j++) {
+        if (cellStarts) { cellStarts->add(numChars); }
+        addRuns(cells[(size_t)j].firstRun, cells[(size_t)j].numRuns);
+      }
+    }
+    if (cellStarts) { cellStarts->add(numChars); }
+  } else if (b.type != imageBlock) {
+    addRuns(b.firstRun, b.numRuns);
+  }
+  return String::fromUTF8(plain.data(), (int)plain.size());
+}
+
+void BarelyMLDocument::SearchIndex::update(const BarelyMLDocument& doc) {
+  std::unordered_map<int64, std::shared_ptr<const Entry>> newEntriesByHash;
+  entries.clear();
+  entries.reserve(doc.blocks.size());
+  for (size_t i=0; i<doc.blocks.size(); i++) {
+    int64 hash = doc.blocks[i].hash;
+    std::shared_ptr<const Entry> e;
+    auto it = entriesByHash.find(hash);
+    if (it != entriesByHash.end()) {
+      e = it->second;                   // unchanged block (same markup, same text)...
+    } else {
+      auto ne = std::make_shared<Entry>();  // ...or a new one
+      ne->text = doc.getPlainText((int)i, &ne->cellStarts).toLowerCase(); // (keeps character indices)
+      e = ne;
+    }
+    newEntriesByHash[hash] = e;
+    entries.push_back(e);
+  }
+  entriesByHash.swap(newEntriesByHash); // (forgets the blocks which have been removed)
+}
+
+Array<BarelyMLDocument::SearchMatch> BarelyMLDocument::SearchIndex::findAll(const String& text, int maxMatches) const {
+  Array<SearchMatch> matches;
+  String needle = text.toLowerCase();
+  int length = needle.length();
+  if (length == 0) { return matches; }
+  for (int b=0; b<(int)entries.size(); b++) {
+    const Entry& e = *entries[(size_t)b];
+    auto p = e.text.getCharPointer();
+    int offset = 0;                     // character index of p
+    for (;;) {
+      int i = CharacterFunctions::indexOf(p, needle.getCharPointer());
+      if (i < 0) { break; }
+      p += i + length;                  // (matches don't overlap)
+      Range<int> range(offset + i, offset + i + length);
+      offset += i + length;
+      int cell = -1;
+      if (!e.cellStarts.isEmpty()) {    // find the cell, and skip matches across cells
+        auto it = std::upper_bound(e.cellStarts.begin(), e.cellStarts.end(), range.getStart());
+        cell = (int)(it - e.cellStarts.begin()) - 1;
+        if (cell < 0 || cell+1 >= e.cellStarts.size() || range.getEnd() > e.cellStarts[cell+1]) { continue; }
+        range -= e.cellStarts[cell];
+      }
+      matches.add({ b, cell, range });
+      if (maxMatches >= 0 && matches.size() >= maxMatches) { return matches; }
+    }
+  }
+  return matches;
+}
+
+// MARK: - Binary Format
+
+// NOTE: The format is a header (magic, version and the number of elements in each section)
+//       followed by the blocks, runs, rows, cells, colours, colour names and the text arena.
+//       All fields are written as 32 bit integers (block hashes as 64 bit), little endian, so
+//       the size of every section except the colour names follows from the header.
+static constexpr int binaryMagic = 0x644c4d42; // "BMLd"
+static constexpr int binaryHeaderSize = 9 * 4;
+static constexpr int binaryBlockSize = 14 * 4 + 8;
+static constexpr int binaryRunSize = 5 * 4;
+static constexpr int binaryRowSize = 2 * 4;
+static constexpr int binaryCellSize = 8 * 4;
+static constexpr int binaryColourSize = 4 * 4;
+
+MemoryBlock BarelyMLDocument::toBinary() const {
+  MemoryBlock data;
+  MemoryOutputStream out(data, false);
+  out.preallocate((size_t)binaryHeaderSize + blocks.size()*binaryBlockSize + runs.size()*binaryRunSize
+                  + rows.size()*binaryRowSize + cells.size()*binaryCellSize
+                  + colours.size()*binaryColourSize + text.size() + (size_t)colourNames.size()*16);
+  auto writeRange = [&](TextRange r) { out.writeInt(r.start); out.writeInt(r.length); };
+  out.writeInt(binaryMagic);
+  out.writeInt(binaryFormatVersion);
+  out.writeInt((int)blocks.size());
+  out.writeInt((int)runs.size());
+  out.writeInt((int)rows.size());
+  out.writeInt((int)cells.size());
+  out.writeInt((int)colours.size());
+  out.writeInt(colourNames.size());
+  out.writeInt((int)text.size());
+  for (auto& b : blocks) {
+    out.writeInt((int)b.type);
+    out.writeInt64(b.hash);
+    out.writeInt(b.firstRun); out.writeInt(b.numRuns);
+    out.writeInt(b.firstRow); out.writeInt(b.numRows);
+    writeRange(b.link);
+    writeRange(b.image);
+    out.writeInt(b.imageWidth);
+    out.writeInt((int)b.admonition);
+    writeRange(b.label);
+    out.writeInt(b.indent);
+  }
+  for (auto& r : runs) {
+    writeRange(r.text);
+    out.writeInt(r.flags); out.writeInt(r.heading); out.writeInt(r.colour);
+  }
+  for (auto& r : rows) {
+    out.writeInt(r.firstCell); out.writeInt(r.numCells);
+  }
+  for (auto& c : cells) {
+    out.writeInt(c.firstRun); out.writeInt(c.numRuns);
+    writeRange(c.link);
+    writeRange(c.image);
+    out.writeInt(c.imageWidth);
+    out.writeInt(c.isHeader ? 1 : 0);
+  }
+  for (auto& c : colours) {
+    out.writeInt((int)c.kind); out.writeInt((int)c.argb); out.writeInt(c.name); out.writeInt(c.fallback);
+  }
+  out.write(text.data(), text.size());  // (before the colour names, at a fixed offset)
+  for (auto& name : colourNames) {
+    out.writeInt((int)name.getNumBytesAsUTF8());
+    out.write(name.toRawUTF8(), name.getNumBytesAsUTF8());
+  }
+  out.flush();
+  return data;
+}
+
+bool BarelyMLDocument::isBinary(const void* data, size_t numBytes) {
+  if (data == nullptr || numBytes < (size_t)binaryHeaderSize) { return false; }
+  MemoryInputStream in(data, numBytes, false);
+  return in.readInt() == binaryMagic && in.readInt() == binaryFormatVersion;
+}
+
+std::shared_ptr<const BarelyMLDocument> BarelyMLDocument::fromBinary(const void* data, size_t numBytes) {
+  if (!isBinary(data, numBytes)) { return nullptr; }
+  MemoryInputStream in(data, numBytes, false);
+  in.setPosition(8);
+  int numBlocks = in.readInt(), numRuns = in.readInt(), numRows = in.readInt(), numCells = in.readInt();
+  int numColours = in.readInt(), numColourNames = in.readInt(), textSize = in.readInt();
+  if (numBlocks < 0 || numRuns < 0 || numRows < 0 || numCells < 0 || numColours < 1
+      || numColourNames < 0 || textSize < 0) { return nullptr; }
+  int64 fixedSize = (int64)binaryHeaderSize + (int64)numBlocks*binaryBlockSize + (int64)numRuns*binaryRunSize
+                    + (int64)numRows*binaryRowSize + (int64)numCells*binaryCellSize
+                    + (int64)numColours*binaryColourSize + textSize + (int64)numColourNames*4;
+  if (fixedSize > (int64)numBytes) { return nullptr; } // (truncated, or the counts are garbage)
+  
+  // every index is checked while reading (one out of range means the data is corrupt), the
+  // counts are known from the header, so the order of the sections doesn't matter for that
+  auto doc = std::make_shared<BarelyMLDocument>();
+  auto isRange = [](int first, int num, int size) { return first >= 0 && num >= 0 && first <= size - num; };
+  bool isValid = true;
+  auto readRange = [&]() {
+    TextRange r;
+    r.start = in.readInt();
+    r.length = in.readInt();
+    isValid = isValid && isRange(r.start, r.length, textSize);
+    return r;
+  };
+  auto readEnum = [&](int max) {        // (checked before it's cast to the enum type)
+    int v = in.readInt();
+    isValid = isValid && v >= 0 && v <= max;
+    return isValid ? v : 0;
+  };
+  doc->blocks.resize((size_t)numBlocks);
+  for (auto& b : doc->blocks) {
+    b.type = (BlockType)readEnum(listItemBlock);
+    b.hash = in.readInt64();
+    b.firstRun = in.readInt(); b.numRuns = in.readInt();
+    b.firstRow = in.readInt(); b.numRows = in.readInt();
+    b.link = readRange();
+    b.image = readRange();
+    b.imageWidth = in.readInt();
+    b.admonition = (AdmonitionType)readEnum(warning);
+    b.label = readRange();
+    b.indent = in.readInt();
+    isValid = isValid && isRange(b.firstRun, b.numRuns, numRuns) && isRange(b.firstRow, b.numRows, numRows);
+  }
+  doc->runs.resize((size_t)numRuns);
+  for (auto& r : doc->runs) {
+    r.text = readRange();
+    r.flags = in.readInt(); r.heading = readEnum(5); r.colour = in.readInt();
+    isValid = isValid && r.colour >= 0 && r.colour < numColours;
+  }
+  doc->rows.resize((size_t)numRows);
+  for (auto& r : doc->rows) {
+    r.firstCell = in.readInt(); r.numCells = in.readInt();
+    isValid = isValid && isRange(r.firstCell, r.numCells, numCells);
+  }
+  doc->cells.resize((size_t)numCells);
+  for (auto& c : doc->cells) {
+    c.firstRun = in.readInt(); c.numRuns = in.readInt();
+    c.link = readRange();
+    c.image = readRange();
+    c.imageWidth = in.readInt();
+    c.isHeader = in.readInt() != 0;
+    isValid = isValid && isRange(c.firstRun, c.numRuns, numRuns);
+  }
+  doc->colours.resize((size_t)numColours);
+  for (int i=0; i<numColours; i++) {
+    ColourRef& c = doc->colours[(size_t)i];
+    c.kind = (ColourRef::Kind)readEnum(ColourRef::namedColour);
+    c.argb = (uint32)in.readInt(); c.name = in.readInt(); c.fallback = in.readInt();
+    // colours[0] is the default colour, and fallbacks always point to earlier colours (so
+    // resolving a colour always ends)
+    isValid = isValid && (i == 0 ? c.kind == ColourRef::defaultColour
+                                 : (c.kind == ColourRef::hexColour
+                                    || (c.kind == ColourRef::namedColour && c.name >= 0 && c.name < numColourNames
+                                        && c.fallback >= 0 && c.fallback < i)));
+  }
+  if (!isValid) { return nullptr; }
+  doc->text.resize((size_t)textSize);
+  in.read(doc->text.data(), textSize);
+  // the text mustn't contain anything String::fromUTF8 can't read: it must be valid UTF-8
+  // (without nul characters, which the parser never writes), and every range must start and
+  // end between characters (not in the middle of a multi-byte sequence)
+  auto isValidText = [](const char* s, int length) {
+    return std::memchr(s, 0, (size_t)length) == nullptr && CharPointer_UTF8::isValidString(s, length);
+  };
+  if (!isValidText(doc->text.data(), textSize)) { return nullptr; }
+  auto isCharStart = [&](int i) { return i == textSize || (doc->text[(size_t)i] & 0xC0) != 0x80; };
+  auto isWhole = [&](TextRange r) { return r.isEmpty() || (isCharStart(r.start) && isCharStart(r.start+r.length)); };
+  for (auto& b : doc->blocks) {
+    isValid = isValid && isWhole(b.link) && isWhole(b.image) && isWhole(b.label);
+  }
+  for (auto& r : doc->runs) {
+    isValid = isValid && isWhole(r.text);
+  }
+  for (auto& c : doc->cells) {
+    isValid = isValid && isWhole(c.link) && isWhole(c.image);
+  }
+  if (!isValid) { return nullptr; }
+  for (int i=0; i<numColourNames; i++) {
+    int length = in.getNumBytesRemaining() >= 4 ? in.readInt() : -1;
+    if (length < 0 || length > in.getNumBytesRemaining()) { return nullptr; } // (truncated)
+    const char* name = (const char*)data + in.getPosition();
+    if (!isValidText(name, length)) { return nullptr; }
+    doc->colourNames.add(String::fromUTF8(name, length));
+    in.skipNextBytes(length);
+  }
+  return doc;
+}
+
+//==============================================================================
+
+// MARK: - Display
+
+BarelyMLDisplay::BarelyMLDisplay() : parsePool(1), updateTimer(*this)
+{
+  style = getDefaultStyle();
+  
+  // default file source (none), drawables are shared with other displays
+  fileSource = nullptr;
+  drawableCache = DrawableCache::getDefault();
+  
+  // no blocks created yet and no updates pending
+  blockGeneration = 0;
+  styleGeneration = 0;
+  updateDepth = 0;
+  stylePending = false;
+  documentPending = false;
+  contentGeneration = 0;
+  keepScrollPosition = false;
+  documentOutdated = false;
+  
+  // no log yet, no history limit
+  logPendingBlocks = 0;
+  logMaxBlocks = 0;
+  logMaxBytes = logBytes = 0;
+  logAutoScroll = true;
+  
+  // coalesced updates: at most 20 rebuilds per second, no debounce
+  coalescePending = false;
+  coalesceInterval = 50;
+  coalesceDebounce = 0;
+  lastCoalescedRequest = lastCoalescedUpdate = 0;
+  updateCounters = { 0, 0, 0 };
+  
+  // no timing
+  statsEnabled = false;
+  paintStart = 0.0;
+  stats = {};
+  drawableCacheHits0 = drawableCache->getNumHits();   // (the cache may have been used before)
+  drawableCacheMisses0 = drawableCache->getNumMisses();
+  textLayoutsCreated0 = 0;
+  sharedLayoutHits0 = SharedLayout::numHits;
+  sharedLayoutMisses0 = SharedLayout::numMisses;
+  
+  // paint blocks into cached tiles
+  paintCaching = true;
+  
+  // nothing to search yet
+  searchIndexOutdated = true;
+  
+  // parse on a single thread
+  minParallelParseSize = BarelyMLDocument::defaultMinParallelSize;
+  
+  // only attach the blocks in view
+  virtualized = true;
+  overscan = 200;
+
+  addAndMakeVisible(viewport);
+  viewport.setBMLDisplay(this);
+  viewport.setViewedComponent(&content, false); // we manage the content component
+  viewport.setScrollBarsShown(false, false, true, false);
+  viewport.setScrollOnDragMode(Viewport::ScrollOnDragMode::nonHover);
+}
+
+BarelyMLDisplay::~BarelyMLDisplay() {
+  parsePool.removeAllJobs(true, -1);    // stop parsing in the background (and wait for it)
+}
+
+void BarelyMLDisplay::paint (Graphics& g)
+{
+  if (statsEnabled) { paintStart = Time::getMillisecondCounterHiRes(); }
+  g.fillAll(style.bg);   // clear the background
+}
+
+void BarelyMLDisplay::paintOverChildren (Graphics&)
+{
+  // (the blocks in view have been painted in between)
+  if (statsEnabled && paintStart > 0.0) {
+    stats.paint.add(Time::getMillisecondCounterHiRes() - paintStart);
+    paintStart = 0.0;
+  }
+}
+
+void BarelyMLDisplay::resized()
+{
+  int margin = style.margin;
+  // let's keep the relative vertical position (or the absolute one, while a stream is loading)
+  int scrollY = viewport.getViewPositionY();
+  double relativeScrollPosition = static_cast<double>(scrollY) / content.getHeight();
+  // compute block layout and content height (if virtualized, blocks which haven't been measured
+  // at this width yet are only estimated...)
+  double start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+  Layout l = computeLayout(blocks, getWidth(), margin, &stats, virtualized ? &estimatedHeights : nullptr);
+  if (!virtualized) { estimatedHeights.clear(); }
+  blockBounds.swapWith(l.blockBounds);
+  // ...except for the ones at the new scroll position (blocks above the view which change height
+  // move the scroll position with them, so the content in view stays put, and as more blocks may
+  // come into view, we look again until all blocks in view have been measured)
+  int height = l.height;
+  int newScrollY = keepScrollPosition ? scrollY : static_cast<int>(relativeScrollPosition * height);
+  for (int i=0; i<3; i++) {
+    if (!measureEstimatedBlocks(newScrollY-overscan, newScrollY+getHeight()+overscan, newScrollY, height)) {
+      break;
+    }
+  }
+  if (statsEnabled) { stats.measure.add(Time::getMillisecondCounterHiRes() - start); }
+  // set new bounds
+  viewport.setBounds(getLocalBounds());
+  content.setBounds(0,0,getWidth(), height);
+  // set vertical scroll position
+  viewport.setViewPosition(0, newScrollY);
+  // attach and position the blocks in view (all blocks, if not virtualized)
+  updateVisibleBlocks();
+}
+
+void BarelyMLDisplay::blockHeightChanged() {
+  resized();                            // (only the changed block is measured again)
+  repaint();
+}
+
+void BarelyMLDisplay::updateVisibleBlocks() {
+  if (blockBounds.size() != blocks.size()) { return; } // layout isn't up to date (yet)
+  int first = 0;
+  int last = blocks.size();
+  if (virtualized) {
+    // measure the estimated blocks coming into view (the content in view stays where it is)...
+    Rectangle<int> area = viewport.getViewArea().expanded(0, overscan);
+    int scrollY = viewport.getViewPositionY();
+    int height = content.getHeight();
+    if (measureEstimatedBlocks(area.getY(), area.getBottom(), scrollY, height)) {
+      content.setSize(getWidth(), height);
+      viewport.setViewPosition(0, scrollY); // (calls us again, which is harmless)
+      area = viewport.getViewArea().expanded(0, overscan);
+    }
+    // ...find the first block in view (block tops are sorted)...
+    auto it = std::upper_bound(blockBounds.begin(), blockBounds.end(), area.getY(),
+                               [](int y, const Rectangle<int>& r) { return y < r.getY(); });
+    first = jmax(0, (int)(it - blockBounds.begin()) - 1);
+    // ...and the first one below the visible area
+    last = first;
+    while (last < blocks.size() && blockBounds.getReference(last).getY() < area.getBottom()) {
+      last++;
+    }
+  }
+  // detach the blocks which went out of view (content only contains blocks, and they may come
+  // from different documents in log mode, so they're flagged instead of checking their index)...
+  for (int i=first; i<last; i++) {
+    blocks[i]->isInViewRange = true;
+  }
+  for (int i=content.getNumChildComponents()-1; i>=0; i--) {
+    if (!static_cast<Block*>(content.getChildComponent(i))->isInViewRange) {
+      content.removeChildComponent(i);
+    }
+  }
+  // ...then position the blocks in view and attach new ones (keeping the document order)
+  int z = 0;
+  for (int i=first; i<last; i++) {
+    Block* b = blocks[i];
+    b->isInViewRange = false;
+    b->setBounds(blockBounds.getReference(i));
+    if (b->getParentComponent() != &content) {
+      content.addAndMakeVisible(b, z);
+    }
+    z++;
+  }
+}
+
+bool BarelyMLDisplay::measureEstimatedBlocks(int top, int bottom, int& scrollY, int& height) {
+  // measures the blocks between top and bottom (in content coordinates) whose height is only
+  // estimated, and moves the blocks below them. scrollY moves with the blocks above it, and height
+  // (the content height) with all of them. returns false if there was nothing to measure.
+  if (estimatedHeights.size() != blocks.size() || blockBounds.size() != blocks.size()) { return false; }
+  auto it = std::upper_bound(blockBounds.begin(), blockBounds.end(), top,
+                             [](int y, const Rectangle<int>& r) { return y < r.getY(); });
+  int first = jmax(0, (int)(it - blockBounds.begin()) - 1);
+  int width = getWidth();
+  int margin = style.margin;
+  bool measured = false;
+  int shift = 0;                        // height change of all blocks measured so far
+  for (int i=first; i<blocks.size(); i++) {
+    Rectangle<int>& r = blockBounds.getReference(i);
+    bool inRange = r.getY() < bottom;   // (before moving it)
+    if (!inRange && shift == 0) { break; }  // nothing has changed, so nothing moves
+    int y = r.getY() + shift;
+    if (inRange && estimatedHeights[i]) {
+      Block* b = blocks[i];
+      int estimatedHeight = b->canExtendBeyondMargin() ? r.getHeight() : r.getHeight()-10; // (see getBlockBounds)
+      int bh = (int)b->getCachedHeightRequired(width-2*margin)+5;
+      r = getBlockBounds(b, y, bh, width, margin);
+      estimatedHeights.set(i, false);
+      stats.heightCacheMisses++;
+      measured = true;
+      if (y < scrollY) { scrollY += bh-estimatedHeight; } // keep the content in view where it is
+      shift += bh-estimatedHeight;
+    } else {
+      r.setY(y);
+    }
+  }
+  height += shift;
+  return measured;
+}
+
+// MARK: - Search
+
+Array<BarelyMLDisplay::SearchMatch> BarelyMLDisplay::findAll(const String& text, int maxMatches) {
+  if (searchIndexOutdated && getDocument()) {
+    searchIndex.update(*getDocument()); // (only extracts the text of new blocks)
+    searchIndexOutdated = false;
+  }
+  return searchIndex.findAll(text, maxMatches);
+}
+
+void BarelyMLDisplay::setHighlightedMatches(const Array<SearchMatch>& matches, int current) {
+  clearHighlights();
+  // group the matches by block (they're usually sorted, but don't need to be)
+  std::map<int, Array<SearchMatch>> matchesByBlock;
+  std::map<int, int> currentByBlock;
+  for (int i=0; i<matches.size(); i++) {
+    const SearchMatch& m = matches.getReference(i);
+    if (m.block < 0 || m.block >= blocks.size()) { continue; }
+    Array<SearchMatch>& bm = matchesByBlock[m.block];
+    if (i == current) { currentByBlock[m.block] = bm.size(); }
+    bm.add(m);
+  }
+  for (auto& it : matchesByBlock) {
+    auto c = currentByBlock.find(it.first);
+    blocks[it.first]->setHighlights(it.second, c != currentByBlock.end() ? c->second : -1);
+    highlightedBlocks.add(it.first);
+  }
+}
+
+void BarelyMLDisplay::clearHighlights() {
+  for (int i : highlightedBlocks) {
+    if (i < blocks.size()) { blocks[i]->setHighlights({}, -1); }
+  }
+  highlightedBlocks.clear();
+}
+
+void BarelyMLDisplay::scrollToMatch(const SearchMatch& match) {
+  if (match.block < 0 || match.block >= blocks.size() || blockBounds.size() != blocks.size()) { return; }
+  // scroll to the block first (which measures the blocks around it, if they've only been
+  // estimated, and may move it a little)...
+  viewport.setViewPosition(0, blockBounds.getReference(match.block).getY());
+  // ...then put the match in the middle
+  Rectangle<int> r = blockBounds.getReference(match.block);
+  float y = 0.f;
+  Array<Rectangle<float>> bounds = blocks[match.block]->getMatchBounds(match, r.getWidth());
+  if (!bounds.isEmpty()) { y = bounds.getReference(0).getCentreY(); }
+  viewport.setViewPosition(0, r.getY() + roundToInt(y) - viewport.getHeight()/2); // (limited by the viewport)
+}
+
+void BarelyMLDisplay::endUpdate() {
+  jassert(updateDepth > 0);             // endUpdate() without beginUpdate()?
+  if (--updateDepth > 0) { return; }    // only the outermost endUpdate() applies changes
+  if (documentPending) {                // if a document has been set...
+    documentPending = false;
+    setDocument(pendingDocument);       // ...show it (new blocks get the current style)...
+    pendingDocument.reset();
+  }
+  if (stylePending) {                   // ...and if the style has changed...
+    stylePending = false;
+    applyStyleToBlocks();               // ...update the blocks that haven't got it yet.
+  }
+}
+
+void BarelyMLDisplay::styleChanged() {
+  styleGeneration++;                    // (setFont and setColours have updated style.textHash)
+  if (updateDepth > 0) {
+    stylePending = true;                // defer until endUpdate()
+  } else {
+    applyStyleToBlocks();
+  }
+}
+
+void BarelyMLDisplay::applyStyleToBlocks() {
+  for (auto b : blocks) {
+    b->setStyle(&style, styleGeneration); // only blocks with an outdated style are updated
+  }
+  resized();
+  repaint();
+}
+
+void BarelyMLDisplay::setMarkupString(String s) {
+  // only the blocks which aren't in the current document are parsed (in log mode, the blocks
+  // haven't been merged into a document, so everything is parsed again)
+  const BarelyMLDocument* previous = documentOutdated ? nullptr : document.get();
+  setDocument(BarelyMLDocument::parseShared(s, parallelParsePool.get(), minParallelParseSize, previous));
+}
+
+bool BarelyMLDisplay::setCompiledDocument(const void* data, size_t numBytes) {
+  auto doc = BarelyMLDocument::fromBinary(data, numBytes);
+  if (doc == nullptr) { return false; }
+  setDocument(doc);
+  return true;
+}
+
+void BarelyMLDisplay::setDocument(std::shared_ptr<const BarelyMLDocument> doc) {
+  contentGeneration++;                  // supersedes pending setMarkupStringAsync calls...
+  parsePool.removeAllJobs(true, 0);     // ...stops a running setMarkupStream...
+  cancelCoalescedUpdate();              // ...and coalesced updates
+  if (updateDepth > 0) {                // inside beginUpdate()/endUpdate()...
+    pendingDocument = doc;              // ...just keep the latest document for later
+    documentPending = true;
+    return;
+  }
+  showDocument(doc, nullptr);
+}
+
+std::shared_ptr<const BarelyMLDocument> BarelyMLDisplay::getDocument() const {
+  if (documentOutdated) {
+    // merge the documents of the blocks (in log mode, each append has its own), consecutive
+    // blocks of the same document at once
+    auto merged = std::make_shared<BarelyMLDocument>();
+    merged->colours.push_back({ BarelyMLDocument::ColourRef::defaultColour, 0, -1, 0 });
+    for (int i=0; i<blocks.size(); ) {
+      const BarelyMLDocument* doc = blocks[i]->getDocument().get();
+      int first = blocks[i]->getNodeIndex();
+      int n = 1;
+      while (i+n < blocks.size() && blocks[i+n]->getDocument().get() == doc && blocks[i+n]->getNodeIndex() == first+n) {
+        n++;
+      }
+      merged->append(*doc, first, n);
+      i += n;
+    }
+    document = merged;
+    documentOutdated = false;
+  }
+  return document;
+}
+
+void BarelyMLDisplay::setMarkupStringAsync(String s, std::function<void()> onReady) {
+  contentGeneration++;                  // supersedes pending requests...
+  parsePool.removeAllJobs(true, 0);     // ...and cancels them (without waiting)
+  cancelCoalescedUpdate();
+  parsePool.addJob(new ParseJob(*this, s, onReady), true);
+}
+
+void BarelyMLDisplay::setMarkupStream(std::unique_ptr<InputStream> stream, std::function<void()> onReady) {
+  contentGeneration++;                  // supersedes pending requests...
+  parsePool.removeAllJobs(true, 0);     // ...and cancels them (without waiting)
+  cancelCoalescedUpdate();
+  parsePool.addJob(new StreamJob(*this, std::move(stream), onReady), true);
+}
+
+void BarelyMLDisplay::setParallelParsing(bool shouldParseInParallel, int minSize) {
+  minParallelParseSize = minSize;
+  if (shouldParseInParallel && parallelParsePool == nullptr) {
+    // the parsing thread works on chunks as well, so we need one thread less than cores
+    parallelParsePool = std::make_shared<ThreadPool>(jmax(1, SystemStats::getNumCpus()-1));
+  } else if (!shouldParseInParallel) {
+    parallelParsePool.reset();          // (a running ParseJob keeps the pool until it's done)
+  }
+}
+
+void BarelyMLDisplay::showDocument(std::shared_ptr<const BarelyMLDocument> doc, PreparedContent* prepared) {
+  clearHighlights();                    // (matches refer to the old document)
+  resetLog();
+  document = doc;
+  documentOutdated = false;
+  searchIndexOutdated = true;
+  double loadImagesMs = prepared ? prepared->loadImagesMs : 0.0;
+  double measureMs = prepared ? prepared->measureMs : 0.0;
+  float width = (float)(getWidth()-2*style.margin);
+  
+  // index the current blocks by their source hash, so that unchanged blocks can be reused
+  std::unordered_map<int64, Array<int>> reusableBlocks;
+  for (int i=blocks.size()-1; i>=0; i--) {
+    reusableBlocks[blocks[i]->getSourceHash()].add(i); // reversed, so we can take from the end
+  }
+  
+  AsyncFileSource* asyncFileSource = dynamic_cast<AsyncFileSource*>(fileSource);
+  OwnedArray<Block> newBlocks;
+  for (int i=0; i<(int)document->blocks.size(); i++) {
+    int64 key = getReuseKey(document->blocks[(size_t)i], blockGeneration);
+    Block* b = nullptr;
+    bool isNew = false;
+    auto it = reusableBlocks.find(key);
+    if (it != reusableBlocks.end() && !it->second.isEmpty()) { // if an identical block exists...
+      int bi = it->second.getLast();                // ...take it...
+      it->second.removeLast();
+      b = blocks[bi];
+      blocks.set(bi, nullptr, false);               // ...without deleting it...
+      b->setNode(document, i);                      // ...and move it to the new document.
+    } else {                                        // otherwise...
+      b = createBlock(document, i);                 // ...create a new block...
+      double start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+      b->loadImages(fileSource, *drawableCache);    // ...load its images, if any...
+      if (statsEnabled) { loadImagesMs += Time::getMillisecondCounterHiRes() - start; }
+      b->setSourceHash(key);                        // ...and remember where it came from.
+      isNew = true;
+    }                                               // (resized() attaches the blocks in view)
+    b->setStyle(&style, styleGeneration);           // (re)style blocks if necessary
+    if (isNew && prepared) {                        // measure blocks prepared in the background
+      double start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+      b->getCachedHeightRequired(width);            // (their text is laid out already)
+      if (statsEnabled) { measureMs += Time::getMillisecondCounterHiRes() - start; }
+    }
+    b->requestPendingImages(asyncFileSource, *drawableCache); // (new blocks with async images)
+    newBlocks.add(b);
+  }
+  
+  blocks.swapWith(newBlocks);                       // blocks which weren't reused get deleted here
+  
+  if (statsEnabled) {
+    stats.classify.add(document->parseTimes.classify);
+    stats.parse.add(document->parseTimes.blocks);
+    stats.loadImages.add(loadImagesMs);
+    if (prepared) { stats.measure.add(measureMs); } // (mostly laid out in the background)
+  }
+  resized();
+}
+
+// MARK: - Style
+
+BarelyMLDisplay::Style BarelyMLDisplay::getDefaultStyle() {
+  Style style;
+  // default colour palette (CGA 16 colours with some extensions)
+  StringPairArray colours;
+  colours.set("black",        "#000");
+  colours.set("blue",         "#00A");
+  colours.set("green",        "#0A0");
+  colours.set("cyan",         "#0AA");
+  colours.set("red",          "#A00");
+  colours.set("magenta",      "#A0A");
+  colours.set("brown",        "#A50");
+  colours.set("lightgray",    "#AAA");
+  colours.set("darkgray",     "#555");
+  colours.set("lightblue",    "#55F");
+  colours.set("lightgreen",   "#5F5");
+  colours.set("lightcyan",    "#5FF");
+  colours.set("lightred",     "#F55");
+  colours.set("lightmagenta", "#F5F");
+  colours.set("yellow",       "#FF5");
+  colours.set("white",        "#FFF");
+  colours.set("orange",       "#FA5");
+  colours.set("pink",         "#F5F");
+  colours.set("darkyellow",   "#AA0");
+  colours.set("purple",       "#A0F");
+  colours.set("gray",         "#777");
+  colours.set("linkcolour",   "#00A");
+  style.palette.compile(colours);
+  
+  // default font
+  style.font = Font(15);
+  
+  // default background
+  style.bg = Colours::white;
+
+  // default table backgrounds
+  style.tableBGHeader = style.palette.getColour("lightcyan", Colours::black);
+  style.tableBG = style.palette.getColour("lightgray", Colours::black);
+
+  // default table margins
+  style.tableMargin = 10;
+  style.tableGap = 2;
+  
+  // default list indents
+  style.indentPerSpace = 15;
+  style.labelGap = 30;
+  
+  // default content margin
+  style.margin = 20;
+  
+  // default admonition margin and sizes
+  style.iconsize = 20;
+  style.admargin = 10;
+  style.adlinewidth = 2;
+  
+  // draw drawables directly by default
+  style.rasterizeImages = false;
+  
+  // search matches
+  style.highlight = Colours::yellow.withAlpha(0.5f);
+  style.currentHighlight = Colours::orange.withAlpha(0.8f);
+  
+  style.updateTextHash();
+  
+  return style;
+}
+
+void BarelyMLDisplay::Style::updateTextHash() {
+  // everything createAttributedString depends on, apart from the markup
+  String f = font.toString() + ";" + String(font.getHorizontalScale()) + ";" + String(font.getExtraKerningFactor());
+  textHash = (int64)((uint64)f.hashCode64() * 31ULL + (uint64)palette.getHash());
+}
+
+// MARK: - Shared Text
+
+int64 BarelyMLDisplay::SharedText::Key::hash() const {
+  uint64 h = (uint64)blockHash;
+  h = h * 31ULL + (uint64)firstRun;
+  h = h * 31ULL + (uint64)numRuns;
+  h = h * 31ULL + (bold ? 1ULL : 0ULL);
+  return (int64)(h * 31ULL + (uint64)textHash);
+}
+
+std::shared_ptr<const AttributedString> BarelyMLDisplay::SharedText::get(const Key& key, const std::function<bool(const AttributedString&)>& isSame,
+                                                                         const std::function<AttributedString()>& create) {
+  struct Entry {
+    Key key;
+    std::weak_ptr<const AttributedString> string;
+  };
+  static CriticalSection lock;
+  static std::unordered_map<int64, Entry> strings;
+  static size_t pruneSize = 1024;       // forget unused strings when the map has grown this large
+  int64 h = key.hash();
+  {
+    const ScopedLock sl(lock);
+    auto it = strings.find(h);
+    if (it != strings.end() && it->second.key == key) {
+      if (auto s = it->second.string.lock()) {
+        if (isSame(*s)) { return s; }
+      }
+    }
+  }
+  auto s = std::make_shared<const AttributedString>(create()); // (not holding the lock)
+  const ScopedLock sl(lock);
+  auto it = strings.find(h);
+  if (it != strings.end()) {
+    auto existing = it->second.string.lock();
+    if (existing && it->second.key == key && isSame(*existing)) {
+      return existing;                  // (created on another thread meanwhile)
+    }
+    if (existing) { return s; }         // (a different string with the same hash, keep it)
+  }
+  strings[h] = { key, s };
+  if (strings.size() >= pruneSize) {
+    for (auto e = strings.begin(); e != strings.end(); ) {
+      e = e->second.string.expired() ? strings.erase(e) : std::next(e);
+    }
+    pruneSize = jmax((size_t)1024, strings.size()*2);
+  }
+  return s;
+}
+
+// MARK: - Shared Layouts
+
+std::atomic<int> BarelyMLDisplay::SharedLayout::numHits { 0 };
+std::atomic<int> BarelyMLDisplay::SharedLayout::numMisses { 0 };
+
+std::shared_ptr<const TextLayout> BarelyMLDisplay::SharedLayout::get(int64 key, float width, const std::shared_ptr<const AttributedString>& text) {
+  struct Shaped {                       // a layout with the text and width it was created for
+    std::shared_ptr<const AttributedString> text;
+    float width;
+    TextLayout layout;
+  };
+  static CriticalSection lock;
+  static std::unordered_map<int64, std::weak_ptr<const Shaped>> layouts;
+  static size_t pruneSize = 1024;       // forget unused layouts when the map has grown this large
+  uint32 widthBits;
+  std::memcpy(&widthBits, &width, sizeof(widthBits));
+  key = (int64)((uint64)key * 31ULL + (uint64)widthBits);
+  auto isFor = [&](const Shaped& s) { return s.width == width && isSameText(*s.text, *text); };
+  {
+    const ScopedLock sl(lock);
+    auto it = layouts.find(key);
+    if (it != layouts.end()) {
+      auto l = it->second.lock();
+      if (l && isFor(*l)) {
+        numHits++;
+        return std::shared_ptr<const TextLayout>(l, &l->layout);
+      }
+    }
+  }
+  auto shaped = std::make_shared<Shaped>(); // (shaped without holding the lock)
+  shaped->text = text;
+  shaped->width = width;
+  shaped->layout.createLayout(*text, width);
+  CachedTextLayout::numLayoutsCreated++;
+  numMisses++;
+  const ScopedLock sl(lock);
+  auto& entry = layouts[key];
+  if (auto existing = entry.lock()) {
+    if (isFor(*existing)) {             // (created on another thread meanwhile)
+      return std::shared_ptr<const TextLayout>(existing, &existing->layout);
+    }
+    return std::shared_ptr<const TextLayout>(shaped, &shaped->layout); // (colliding, not shared)
+  }
+  entry = shaped;
+  if (layouts.size() >= pruneSize) {
+    for (auto it = layouts.begin(); it != layouts.end(); ) {
+      it = it->second.expired() ? layouts.erase(it) : std::next(it);
+    }
+    pruneSize = jmax((size_t)1024, layouts.size()*2);
+  }
+  return std::shared_ptr<const TextLayout>(shaped, &shaped->layout);
+}
+
+Point<float> BarelyMLDisplay::SharedLayout::getNaturalSize(int64 key, const std::shared_ptr<const AttributedString>& text,
+                                                           const std::function<Point<float>()>& measure) {
+  // sizes are small, so they're kept (least recently used first out) instead of being shared
+  // while in use
+  struct Entry {
+    int64 key;
+    std::shared_ptr<const AttributedString> text;
+    Point<float> size;
+  };
+  static CriticalSection lock;
+  static std::list<Entry> sizes;        // most recently used first
+  static std::unordered_map<int64, std::list<Entry>::iterator> index;
+  {
+    const ScopedLock sl(lock);
+    auto it = index.find(key);
+    if (it != index.end() && isSameText(*it->second->text, *text)) {
+      sizes.splice(sizes.begin(), sizes, it->second);
+      numHits++;
+      return it->second->size;
+    }
+  }
+  Point<float> size = measure();        // (not holding the lock)
+  numMisses++;
+  const ScopedLock sl(lock);
+  auto it = index.find(key);
+  if (it != index.end()) {              // (replaces a colliding text, or one measured meanwhile)
+    it->second->text = text;
+    it->second->size = size;
+    sizes.splice(sizes.begin(), sizes, it->second);
+    return size;
+  }
+  sizes.push_front({ key, text, size });
+  index[key] = sizes.begin();
+  while (sizes.size() > maxNaturalSizes) {
+    index.erase(sizes.back().key);
+    sizes.pop_back();
+  }
+  return size;
+}
+
+bool BarelyMLDisplay::SharedLayout::isSameText(const AttributedString& a, const AttributedString& b) {
+  if (&a == &b) { return true; }        // (e.g. when both come from SharedText)
+  if (a.getText() != b.getText() || a.getNumAttributes() != b.getNumAttributes() ||
+      a.getJustification() != b.getJustification() || a.getWordWrap() != b.getWordWrap() ||
+      a.getReadingDirection() != b.getReadingDirection() || a.getLineSpacing() != b.getLineSpacing()) {
+    return false;
+  }
+  for (int i=0; i<a.getNumAttributes(); i++) {
+    const AttributedString::Attribute& x = a.getAttribute(i);
+    const AttributedString::Attribute& y = b.getAttribute(i);
+    if (x.range != y.range || x.font != y.font || x.colour != y.colour) { return false; }
+  }
+  return true;
+}
+
+int64 BarelyMLDisplay::SharedLayout::getKey(const AttributedString& text) {
+  auto hashFont = [](const Font& f) {
+    uint64 h = (uint64)f.getTypefaceName().hashCode64();
+    h = h * 31ULL + (uint64)f.getTypefaceStyle().hashCode64();
+    h = h * 31ULL + (uint64)roundToInt(f.getHeight() * 1024.f);
+    h = h * 31ULL + (uint64)roundToInt(f.getHorizontalScale() * 1024.f);
+    h = h * 31ULL + (uint64)roundToInt(f.getExtraKerningFactor() * 1024.f);
+    return h * 31ULL + (uint64)f.getStyleFlags();
+  };
+  uint64 key = (uint64)text.getText().hashCode64();
+  key = key * 31ULL + (uint64)text.getJustification().getFlags();
+  key = key * 31ULL + (uint64)text.getWordWrap();
+  key = key * 31ULL + (uint64)text.getReadingDirection();
+  key = key * 31ULL + (uint64)roundToInt(text.getLineSpacing() * 1024.f);
+  for (int i=0; i<text.getNumAttributes(); i++) {
+    const AttributedString::Attribute& a = text.getAttribute(i);
+    key = key * 31ULL + (uint64)a.range.getStart();
+    key = key * 31ULL + (uint64)a.range.getLength();
+    key = key * 31ULL + hashFont(a.font);
+    key = key * 31ULL + (uint64)a.colour.getARGB(); // (layouts have the colours of their runs)
+  }
+  return (int64)key;
+}
+
+// MARK: - Layout
+
+BarelyMLDisplay::Layout BarelyMLDisplay::computeLayout(const OwnedArray<Block>& blocks, int width, int margin, Stats* stats, Array<bool>* estimated) {
+  // stacks the blocks vertically (only blocks which haven't been measured at this width before
+  // are measured, or just estimated)
+  Layout l;
+  l.blockBounds.ensureStorageAllocated(blocks.size());
+  if (estimated) { estimated->clearQuick(); }
+  l.height = layoutBlocks(blocks, 0, margin, width, margin, stats, l.blockBounds, estimated) + margin;
+  return l;
+}
+
+int BarelyMLDisplay::layoutBlocks(const OwnedArray<Block>& blocks, int first, int y, int width, int margin,
+                                  Stats* stats, Array<Rectangle<int>>& bounds, Array<bool>* estimated) {
+  int h = y;
+  for (int i=first; i<blocks.size(); i++) {
+    Block* b = blocks[i];
+    bool cached = b->isHeightCached(width-2*margin);
+    bool estimate = estimated != nullptr && !cached;
+    float bh = estimate ? b->estimateHeightRequired(width-2*margin) : b->getCachedHeightRequired(width-2*margin);
+    if (estimate && b->isHeightCached(width-2*margin)) {
+      estimate = false;                 // (the block has been measured after all, it's cheap)
+    }
+    if (stats) {
+      if (cached) { stats->heightCacheHits++; } else if (estimate) { stats->heightsEstimated++; } else { stats->heightCacheMisses++; }
+    }
+    int ibh = (int)bh+5;                // just to be on the safe side
+    bounds.add(getBlockBounds(b, h, ibh, width, margin));
+    if (estimated) { estimated->add(estimate); }
+    h += ibh;
+  }
+  return h;
+}
+
+Rectangle<int> BarelyMLDisplay::getBlockBounds(Block* b, int y, int height, int width, int margin) {
+  if (b->canExtendBeyondMargin()) {
+    return Rectangle<int>(0,y,width,height);              // (tables scroll within the full width)
+  }
+  return Rectangle<int>(margin,y,width-2*margin,height+10);
+}
+
+// MARK: - Drawable Cache
+
+std::shared_ptr<BarelyMLDisplay::DrawableCache> BarelyMLDisplay::DrawableCache::getDefault() {
+  static CriticalSection lock;
+  static std::weak_ptr<DrawableCache> defaultCache; // (deleted when no display uses it anymore)
+  const ScopedLock sl(lock);
+  std::shared_ptr<DrawableCache> cache = defaultCache.lock();
+  if (!cache) {
+    cache = std::make_shared<DrawableCache>();
+    defaultCache = cache;
+  }
+  return cache;
+}
+
+String BarelyMLDisplay::DrawableCache::getKey(FileSource* fs, const String& filename) {
+  // the key identifies the file source, the file and its version
+  String source = fs->getIdentifier();
+  if (source.isEmpty()) { source = String::toHexString((pointer_sized_int)fs); }
+  return source + ":" + filename + "@" + fs->getVersionForFilename(filename);
+}
+
+std::shared_ptr<const Drawable> BarelyMLDisplay::DrawableCache::find(const String& key) {
+  auto it = index.find(key);
+  if (it == index.end()) { return nullptr; }
+  entries.splice(entries.begin(), entries, it->second); // mark it as most recently used
+  return it->second->drawable;
+}
+
+std::shared_ptr<const Drawable> BarelyMLDisplay::DrawableCache::add(const String& key, std::shared_ptr<const Drawable> d) {
+  if (auto existing = find(key)) { return existing; } // another thread was faster -> use its drawable
+  size_t bytes = estimateNumBytes(*d);
+  entries.push_front({ key, d, bytes });
+  index[key] = entries.begin();
+  numBytes += bytes;
+  removeLeastRecentlyUsed();
+  return d;
+}
+
+std::shared_ptr<const Drawable> BarelyMLDisplay::DrawableCache::getDrawable(FileSource* fs, const String& filename) {
+  if (fs == nullptr) { return nullptr; }
+  String key = getKey(fs, filename);
+  {
+    const ScopedLock sl(lock);
+    if (auto d = find(key)) { numHits++; return d; } // if it's cached, return it...
+  }
+  numMisses++;
+  // ...otherwise load it (without holding the lock, files may be slow to load)...
+  std::shared_ptr<const Drawable> drawable(fs->getDrawableForFilename(filename));
+  if (drawable == nullptr) { return nullptr; } // (missing files aren't cached, they may appear later)
+  // ...and add it to the cache.
+  const ScopedLock sl(lock);
+  return add(key, drawable);
+}
+
+std::shared_ptr<const Drawable> BarelyMLDisplay::DrawableCache::findDrawable(FileSource* fs, const String& filename) {
+  if (fs == nullptr) { return nullptr; }
+  String key = getKey(fs, filename);
+  const ScopedLock sl(lock);
+  auto d = find(key);
+  if (d) { numHits++; } else { numMisses++; }
+  return d;
+}
+
+void BarelyMLDisplay::DrawableCache::loadDrawableAsync(AsyncFileSource* fs, const String& filename, std::function<void(std::shared_ptr<const Drawable>)> onLoaded) {
+  String key = getKey(fs, filename);
+  {
+    const ScopedLock sl(lock);
+    if (auto d = find(key)) {           // if it's cached, we're done...
+      numHits++;
+      MessageManager::callAsync([onLoaded, d] { onLoaded(d); });
+      return;
+    }
+    numMisses++;
+    auto& waiting = pendingLoads[key];  // ...otherwise wait for it...
+    waiting.push_back(onLoaded);
+    if (waiting.size() > 1) { return; } // ...and request it, unless it's already been requested.
+  }
+  std::weak_ptr<DrawableCache> weakCache = weak_from_this();
+  fs->loadDrawableForFilename(filename, [weakCache, key] (std::unique_ptr<Drawable> loaded) {
+    auto cache = weakCache.lock();
+    if (cache == nullptr) { return; }   // cache has been deleted in the meantime
+    std::shared_ptr<const Drawable> d(std::move(loaded));
+    std::vector<std::function<void(std::shared_ptr<const Drawable>)>> waiting;
+    {
+      const ScopedLock sl(cache->lock);
+      if (d) { d = cache->add(key, d); }
+      waiting.swap(cache->pendingLoads[key]);
+      cache->pendingLoads.erase(key);
+    }
+    MessageManager::callAsync([waiting, d] {
+      for (auto& f : waiting) { f(d); }
+    });
+  });
+}
+
+void BarelyMLDisplay::DrawableCache::setMaxNumBytes(size_t maxBytes) {
+  const ScopedLock sl(lock);
+  maxNumBytes = maxBytes;
+  removeLeastRecentlyUsed();
+}
+
+size_t BarelyMLDisplay::DrawableCache::getNumBytes() const {
+  const ScopedLock sl(lock);
+  return numBytes;
+}
+
+int BarelyMLDisplay::DrawableCache::getNumDrawables() const {
+  const ScopedLock sl(lock);
+  return (int)entries.size();
+}
+
+void BarelyMLDisplay::DrawableCache::clear() {
+  const ScopedLock sl(lock);
+  entries.clear();
+  index.clear();
+  numBytes = 0;                         // (pending loads are still delivered)
+}
+
+void BarelyMLDisplay::DrawableCache::removeLeastRecentlyUsed() {
+  // NOTE: lock must be held, the most recently used drawable is always kept
+  while (numBytes > maxNumBytes && entries.size() > 1) {
+    numBytes -= entries.back().numBytes;
+    index.erase(entries.back().key);
+    entries.pop_back();
+  }
+}
+
+size_t BarelyMLDisplay::DrawableCache::estimateNumBytes(const Drawable& d) {
+  // images count with their pixel data, everything else with a rough size per component
+  size_t bytes = 256;
+  if (auto di = dynamic_cast<const DrawableImage*>(&d)) {
+    const Image& image = di->getImage();
+    bytes += (size_t)image.getWidth() * (size_t)image.getHeight() * 4;
+  }
+  for (int i=0; i<d.getNumChildComponents(); i++) {
+    if (auto child = dynamic_cast<const Drawable*>(d.getChildComponent(i))) {
+      bytes += estimateNumBytes(*child);
+    }
+  }
+  return bytes;
+}
+
+// MARK: - Coalesced Updates
+
+void BarelyMLDisplay::setMarkupStringCoalesced(String s) {
+  updateCounters.requested++;
+  if (coalescePending) {                // the previous text hasn't been shown yet...
+    updateCounters.coalesced++;         // ...and won't be
+  }
+  coalescedMarkup = s;
+  coalescePending = true;
+  lastCoalescedRequest = Time::getMillisecondCounter();
+  coalescedUpdateTimerCallback();       // apply right away if possible, otherwise wait
+}
+
+uint32 BarelyMLDisplay::getCoalescedUpdateDueTime() const {
+  // not before the text has settled and not before the minimum interval has passed
+  return jmax(lastCoalescedRequest + (uint32)jmax(0, coalesceDebounce),
+              lastCoalescedUpdate + (uint32)jmax(0, coalesceInterval));
+}
+
+void BarelyMLDisplay::coalescedUpdateTimerCallback() {
+  if (!coalescePending) {
+    updateTimer.stopTimer();
+    return;
+  }
+  int wait = (int)(getCoalescedUpdateDueTime() - Time::getMillisecondCounter()); // (wraps correctly)
+  if (wait <= 0) {
+    updateTimer.stopTimer();
+    applyCoalescedUpdate();
+  } else {
+    updateTimer.startTimer(wait);       // check again when it's due
+  }
+}
+
+void BarelyMLDisplay::applyCoalescedUpdate() {
+  String markup = coalescedMarkup;
+  coalescedMarkup.clear();
+  updateCounters.applied++;
+  setMarkupString(markup);              // (clears coalescePending, re-parses only changed blocks)
+  lastCoalescedUpdate = Time::getMillisecondCounter(); // measured after the rebuild
+}
+
+void BarelyMLDisplay::cancelCoalescedUpdate() {
+  coalescePending = false;
+  updateTimer.stopTimer();
+}
+
+// MARK: - Log Mode
+
+void BarelyMLDisplay::appendMarkup(const String& markup) {
+  contentGeneration++;                  // supersedes pending asynchronous updates...
+  parsePool.removeAllJobs(true, 0);     // ...stops a running setMarkupStream...
+  cancelCoalescedUpdate();              // ...and coalesced updates
+  if (logParser == nullptr) {           // the first append starts a log below the current content
+    logParser = std::make_unique<BarelyMLDocument::StreamParser>();
+    logParser->setMaxLinesPerTextBlock(logLinesPerTextBlock);
+    logPendingBlocks = 0;
+    logBytes = 0;
+    for (auto b : blocks) { logBytes += getTextSize(b); }
+  }
+  bool layoutValid = blockBounds.size() == blocks.size() && getWidth() > 0;
+  bool atEnd = viewport.getViewArea().getBottom() >= content.getHeight() - 1; // (before it grows)
+  
+  // parse the new lines: the blocks which are complete now, and the ones at the end which the
+  // next append may still continue (they replace the ones of the last append)
+  double start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+  logParser->addData(markup.toRawUTF8(), markup.getNumBytesAsUTF8());
+  auto parsed = std::make_shared<const BarelyMLDocument>(logParser->takeParsedBlocks());
+  auto pending = std::make_shared<const BarelyMLDocument>(logParser->parsePending());
+  if (statsEnabled) { stats.parse.add(Time::getMillisecondCounterHiRes() - start); }
+  
+  // take the blocks of the last append which weren't complete (without deleting them)...
+  int firstChanged = blocks.size() - logPendingBlocks;
+  OwnedArray<Block> oldPending;
+  while (blocks.size() > firstChanged) {
+    Block* b = blocks.removeAndReturn(blocks.size()-1);
+    logBytes -= getTextSize(b);
+    oldPending.insert(0, b);
+  }
+  if (layoutValid) {
+    blockBounds.removeRange(firstChanged, blockBounds.size() - firstChanged);
+    if (virtualized) { estimatedHeights.removeRange(firstChanged, estimatedHeights.size() - firstChanged); }
+  }
+  // ...and add the new blocks, reusing the old ones which haven't changed
+  AsyncFileSource* asyncFileSource = dynamic_cast<AsyncFileSource*>(fileSource);
+  double loadImagesMs = 0.0;
+  auto addBlocks = [&](const std::shared_ptr<const BarelyMLDocument>& doc) {
+    for (int i=0; i<(int)doc->blocks.size(); i++) {
+      int64 key = getReuseKey(doc->blocks[(size_t)i], blockGeneration);
+      Block* b = nullptr;
+      for (int j=0; j<oldPending.size() && b == nullptr; j++) { // (there are only a few)
+        if (oldPending[j]->getSourceHash() == key) {
+          b = oldPending.removeAndReturn(j);
+          b->setNode(doc, i);
+        }
+      }
+      if (b == nullptr) {
+        b = createBlock(doc, i);
+        double t = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+        b->loadImages(fileSource, *drawableCache);
+        if (statsEnabled) { loadImagesMs += Time::getMillisecondCounterHiRes() - t; }
+        b->setSourceHash(key);
+      }
+      b->setStyle(&style, styleGeneration);
+      b->requestPendingImages(asyncFileSource, *drawableCache);
+      logBytes += getTextSize(b);
+      blocks.add(b);
+    }
+  };
+  addBlocks(parsed);
+  addBlocks(pending);
+  logPendingBlocks = (int)pending->blocks.size();
+  documentOutdated = true;
+  searchIndexOutdated = true;
+  if (statsEnabled) {
+    stats.classify.add(parsed->parseTimes.classify);
+    stats.loadImages.add(loadImagesMs);
+  }
+  
+  if (!layoutValid) {                   // not laid out yet, so everything is new anyway
+    trimLog();
+    resized();
+    repaint();
+    return;
+  }
+  // lay out the new blocks below the ones which stay where they are
+  start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+  int margin = style.margin;
+  int y = margin;
+  if (firstChanged > 0) {
+    const Rectangle<int>& r = blockBounds.getReference(firstChanged-1);
+    y = blocks[firstChanged-1]->canExtendBeyondMargin() ? r.getBottom() : r.getBottom()-10; // (see getBlockBounds)
+  }
+  int height = layoutBlocks(blocks, firstChanged, y, getWidth(), margin, &stats,
+                            blockBounds, virtualized ? &estimatedHeights : nullptr) + margin;
+  content.setSize(getWidth(), height);
+  trimLog();
+  if (logAutoScroll && atEnd) {
+    // stay at the end (measuring the blocks coming into view changes the height, so look again)
+    for (int i=0; i<3; i++) {
+      height = content.getHeight();
+      int scrollY = jmax(0, height - viewport.getHeight());
+      if (!measureEstimatedBlocks(scrollY-overscan, height, scrollY, height)) { break; }
+      content.setSize(getWidth(), height);
+    }
+    viewport.setViewPosition(0, jmax(0, content.getHeight() - viewport.getHeight()));
+  }
+  if (statsEnabled) { stats.measure.add(Time::getMillisecondCounterHiRes() - start); }
+  updateVisibleBlocks();
+  repaint();
+}
+
+void BarelyMLDisplay::trimLog() {
+  if (logParser == nullptr) { return; } // (no log)
+  int removable = blocks.size() - logPendingBlocks; // (the last blocks may still change)
+  int numRemoved = 0;
+  if (logMaxBlocks > 0 && blocks.size() > logMaxBlocks + logMaxBlocks/8) {
+    numRemoved = blocks.size() - logMaxBlocks;
+  }
+  if (logMaxBytes > 0 && logBytes > logMaxBytes + logMaxBytes/8) {
+    int64 bytes = logBytes;
+    int n = 0;
+    while (n < removable && bytes > logMaxBytes) { bytes -= getTextSize(blocks[n++]); }
+    numRemoved = jmax(numRemoved, n);
+  }
+  numRemoved = jmin(numRemoved, removable);
+  if (numRemoved <= 0) { return; }
+  
+  clearHighlights();                    // (matches refer to block indices)
+  for (int i=0; i<numRemoved; i++) { logBytes -= getTextSize(blocks[i]); }
+  bool layoutValid = blockBounds.size() == blocks.size();
+  blocks.removeRange(0, numRemoved);    // (deleting them detaches them as well)
+  documentOutdated = true;
+  searchIndexOutdated = true;
+  if (!layoutValid) {                   // (resized() lays out everything)
+    blockBounds.clear();
+    estimatedHeights.clear();
+    return;
+  }
+  // move the remaining blocks up (and the view with them, so the content in view stays there)
+  int shift = numRemoved < blockBounds.size() ? blockBounds.getReference(numRemoved).getY() - style.margin : 0;
+  blockBounds.removeRange(0, numRemoved);
+  if (estimatedHeights.size() >= numRemoved) { estimatedHeights.removeRange(0, numRemoved); }
+  for (auto& r : blockBounds) { r.translate(0, -shift); }
+  int scrollY = jmax(0, viewport.getViewPositionY() - shift);
+  content.setSize(getWidth(), jmax(0, content.getHeight() - shift));
+  viewport.setViewPosition(0, scrollY);
+  updateVisibleBlocks();
+}
+
+void BarelyMLDisplay::resetLog() {
+  logParser.reset();
+  logPendingBlocks = 0;
+  logBytes = 0;
+}
+
+int BarelyMLDisplay::getTextSize(const Block* b) {
+  const BarelyMLDocument& doc = *b->getDocument();
+  const BarelyMLDocument::BlockNode& node = b->getNode();
+  int size = node.link.length + node.image.length + node.label.length;
+  auto addRuns = [&](int firstRun, int numRuns) {
+    for (int i=firstRun; i<firstRun+numRuns; i++) { size += doc.runs[(size_t)i].text.length; }
+  };
+  if (node.type == BarelyMLDocument::tableBlock) {
+    for (int r=node.firstRow; r<node.firstRow+node.numRows; r++) {
+      const BarelyMLDocument::Row& row = doc.rows[(size_t)r];
+      for (int c=row.firstCell; c<row.firstCell+row.numCells; c++) {
+        const BarelyMLDocument::Cell& cell = doc.cells[(size_t)c];
+        addRuns(cell.firstRun, cell.numRuns);
+        size += cell.link.length + cell.image.length;
+      }
+    }
+  } else if (node.type != BarelyMLDocument::imageBlock) {
+    addRuns(node.firstRun, node.numRuns);
+  }
+  return size;
+}
+
+// MARK: - Statistics
+
+BarelyMLDisplay::Stats BarelyMLDisplay::getStats() const {
+  Stats s = stats;
+  for (auto& n : s.numBlocks) { n = 0; }
+  s.numTableCells = 0;
+  for (auto b : blocks) {                // (blocks may come from several documents in log mode)
+    const BarelyMLDocument::BlockNode& node = b->getNode();
+    s.numBlocks[node.type]++;
+    for (int i=node.firstRow; node.type == BarelyMLDocument::tableBlock && i<node.firstRow+node.numRows; i++) {
+      s.numTableCells += b->getDocument()->rows[(size_t)i].numCells;
+    }
+  }
+  s.drawableCacheHits = drawableCache->getNumHits() - drawableCacheHits0;
+  s.drawableCacheMisses = drawableCache->getNumMisses() - drawableCacheMisses0;
+  s.textLayoutsCreated = CachedTextLayout::numLayoutsCreated - textLayoutsCreated0;
+  s.sharedLayoutHits = SharedLayout::numHits - sharedLayoutHits0;
+  s.sharedLayoutMisses = SharedLayout::numMisses - sharedLayoutMisses0;
+  s.paintCacheHits = paintCache.getNumHits();
+  s.paintCacheMisses = paintCache.getNumMisses();
+  return s;
+}
+
+void BarelyMLDisplay::resetStats() {
+  stats = {};
+  drawableCacheHits0 = drawableCache->getNumHits();
+  drawableCacheMisses0 = drawableCache->getNumMisses();
+  textLayoutsCreated0 = CachedTextLayout::numLayoutsCreated;
+  sharedLayoutHits0 = SharedLayout::numHits;
+  sharedLayoutMisses0 = SharedLayout::numMisses;
+  paintCache.resetCounters();
+}
+
+// MARK: - Parse Job
+
+BarelyMLDisplay::ParseJob::ParseJob(BarelyMLDisplay& d, const String& s, std::function<void()> ready)
+  : ThreadPoolJob("BarelyML Parser"), markup(s), display(&d), onReady(ready)
+{
+  // snapshot everything the background thread needs from the display
+  prepared = std::make_shared<PreparedContent>();
+  prepared->style = d.style;
+  prepared->styleGeneration = d.styleGeneration;
+  prepared->blockGeneration = d.blockGeneration;
+  for (auto b : d.blocks) {
+    reusableKeys[b->getSourceHash()]++;
+  }
+  fileSource = d.fileSource;
+  drawableCache = d.drawableCache;
+  if (!d.documentOutdated) { previous = d.document; } // (unchanged blocks are copied from it)
+  parallelParsePool = d.parallelParsePool;
+  minParallelParseSize = d.minParallelParseSize;
+  statsEnabled = d.statsEnabled;
+  prepared->loadImagesMs = prepared->measureMs = 0.0;
+  width = (float)(d.getWidth()-2*d.style.margin);
+  generation = d.contentGeneration;
+}
+
+ThreadPoolJob::JobStatus BarelyMLDisplay::ParseJob::runJob() {
+  auto doc = BarelyMLDocument::parseShared(markup, parallelParsePool.get(), minParallelParseSize, previous.get());
+  prepared->document = doc;
+  // load the images and lay out the text of the nodes whose blocks can't be reused (Components
+  // aren't thread safe, so showDocument creates the blocks on the message thread, where they find
+  // all of this in the caches, as long as prepared holds on to it)
+  const Style& style = prepared->style;
+  bool canLoadImages = fileSource && !dynamic_cast<AsyncFileSource*>(fileSource); // (async ones are requested by the blocks)
+  auto loadImage = [&](const BarelyMLDocument::TextRange& filename) {
+    if (auto drawable = drawableCache->getDrawable(fileSource, doc->getText(filename))) {
+      prepared->drawables.push_back(drawable);
+    }
+  };
+  auto layOut = [&](int index, float textWidth) {
+    const BarelyMLDocument::BlockNode& node = doc->blocks[(size_t)index];
+    auto text = Block::getSharedAttributedString(*doc, index, style, node.firstRun, node.numRuns);
+    prepared->texts.push_back(text);
+    prepared->layouts.push_back(SharedLayout::get(SharedLayout::getKey(*text), textWidth, text));
+  };
+  for (int i=0; i<(int)doc->blocks.size(); i++) {
+    if (shouldExit()) { return jobHasFinished; }  // (superseded)
+    const BarelyMLDocument::BlockNode& node = doc->blocks[(size_t)i];
+    int64 key = getReuseKey(node, prepared->blockGeneration);
+    auto it = reusableKeys.find(key);
+    if (it != reusableKeys.end() && it->second > 0) {
+      it->second--;                     // an existing block will be reused
+      continue;
+    }
+    double start = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+    if (canLoadImages && node.type == BarelyMLDocument::imageBlock) {
+      loadImage(node.image);
+    } else if (canLoadImages && node.type == BarelyMLDocument::tableBlock) {
+      for (int r=node.firstRow; r<node.firstRow+node.numRows; r++) {
+        const BarelyMLDocument::Row& row = doc->rows[(size_t)r];
+        for (int c=row.firstCell; c<row.firstCell+row.numCells; c++) {
+          if (!doc->cells[(size_t)c].image.isEmpty()) { loadImage(doc->cells[(size_t)c].image); }
+        }
+      }
+    }
+    double loaded = statsEnabled ? Time::getMillisecondCounterHiRes() : 0.0;
+    // (with the text widths of the blocks' getHeightRequired)
+    switch (node.type) {
+      case BarelyMLDocument::imageBlock:
+        break;
+      case BarelyMLDocument::tableBlock:
+        for (int r=node.firstRow; r<node.firstRow+node.numRows; r++) {
+          const BarelyMLDocument::Row& row = doc->rows[(size_t)r];
+          for (int c=row.firstCell; c<row.firstCell+row.numCells; c++) {
+            const BarelyMLDocument::Cell& cell = doc->cells[(size_t)c];
+            if (!cell.image.isEmpty()) { continue; }
+            auto text = Block::getSharedAttributedString(*doc, i, style, cell.firstRun, cell.numRuns, cell.isHeader);
+            prepared->texts.push_back(text);
+            SharedLayout::getNaturalSize(SharedLayout::getKey(*text), text, [&] {
+              Point<float> p;
+              TableBlock::measureText(*text, p.x, p.y);
+              return p;
+            });
+          }
+        }
+        break;
+      case BarelyMLDocument::admonitionBlock:
+        layOut(i, width-style.iconsize-2*(style.admargin+style.adlinewidth));
+        break;
+      case BarelyMLDocument::listItemBlock:
+        layOut(i, width-style.indentPerSpace*node.indent-style.labelGap);
+        break;
+      default:
+        layOut(i, width);
+        break;
+    }
+    if (statsEnabled) {
+      prepared->loadImagesMs += loaded - start;
+      prepared->measureMs += Time::getMillisecondCounterHiRes() - loaded;
+    }
+  }
+  if (shouldExit()) { return jobHasFinished; }
+  // swap the new content in on the message thread (unless a newer request came in)
+  auto p = prepared;
+  auto target = display;
+  int g = generation;
+  auto ready = onReady;
+  MessageManager::callAsync([p, target, g, ready] {
+    if (target == nullptr || target->contentGeneration != g) { return; }
+    if (target->blockGeneration != p->blockGeneration || target->updateDepth > 0) {
+      // file source has changed (-> load images again) or we're inside beginUpdate()/endUpdate()
+      target->setDocument(p->document);
+    } else {
+      target->showDocument(p->document, p.get());
+    }
+    if (ready) { ready(); }
+  });
+  return jobHasFinished;
+}
+
+// MARK: - Stream Job
+
+BarelyMLDisplay::StreamJob::StreamJob(BarelyMLDisplay& d, std::unique_ptr<InputStream> s, std::function<void()> ready)
+  : ThreadPoolJob("BarelyML Stream Parser"), stream(std::move(s)), display(&d), onReady(ready)
+{
+  shownTimes = { 0.0, 0.0 };
+  generation = d.contentGeneration;
+}
+
+ThreadPoolJob::JobStatus BarelyMLDisplay::StreamJob::runJob() {
+  BarelyMLDocument::StreamParser parser;
+  HeapBlock<char> buffer(chunkSize);
+  // a snapshot of the blocks parsed so far is shown after the first chunk (a screenful, unless
+  // the lines are extremely long) and then whenever the number of blocks has doubled, so that
+  // copying the snapshots and updating the display stays linear in the document size
+  size_t numBlocksForSnapshot = 1;
+  while (stream != nullptr && !stream->isExhausted()) {
+    if (shouldExit()) { return jobHasFinished; } // (superseded)
+    int numRead = stream->read(buffer.getData(), chunkSize);
+    if (numRead <= 0) { break; }
+    parser.addData(buffer.getData(), (size_t)numRead);
+    size_t numBlocks = parser.getDocument().blocks.size();
+    if (numBlocks >= numBlocksForSnapshot) {
+      show(parser.getDocument(), false);
+      numBlocksForSnapshot = 2*numBlocks;
+    }
+  }
+  stream.reset();                       // (e.g. closes the file)
+  if (shouldExit()) { return jobHasFinished; }
+  parser.finish();
+  show(parser.takeDocument(), true);
+  return jobHasFinished;
+}
+
+void BarelyMLDisplay::StreamJob::show(BarelyMLDocument doc, bool isComplete) {
+  // only the time spent since the last snapshot is counted (in the statistics)
+  BarelyMLDocument::ParseTimes total = doc.parseTimes;
+  doc.parseTimes = { total.classify - shownTimes.classify, total.blocks - shownTimes.blocks };
+  shownTimes = total;
+  auto d = std::make_shared<const BarelyMLDocument>(std::move(doc));
+  auto target = display;
+  int g = generation;
+  auto ready = isComplete ? onReady : nullptr;
+  MessageManager::callAsync([d, target, g, ready, isComplete] {
+    if (target == nullptr || target->contentGeneration != g) { return; }
+    if (target->updateDepth > 0) {      // inside beginUpdate()/endUpdate(), the next snapshot will
+      if (isComplete) {                 // have these blocks too, the complete document is shown
+        target->setDocument(d);         // at endUpdate()
+        if (ready) { ready(); }
+      }
+      return;
+    }
+    // blocks which are already there are reused, and since the new ones are appended at the end,
+    // the content in view stays where it is
+    const ScopedValueSetter<bool> keep(target->keepScrollPosition, true);
+    target->showDocument(d, nullptr);
+    if (ready) { ready(); }
+  });
+}
+
+// MARK: - Renderer
+
+BarelyMLDisplay::Renderer::Renderer() {
+  style = getDefaultStyle();
+  styleGeneration = 0;
+  fileSource = nullptr;
+  drawableCache = std::make_shared<DrawableCache>();
+  cachedLayout.height = 0;
+  layoutWidth = layoutGeneration = -1;
+}
+
+BarelyMLDisplay::Renderer::Renderer(const BarelyMLDisplay& display) : Renderer() {
+  style = display.style;
+  fileSource = display.fileSource;
+  drawableCache = std::make_shared<DrawableCache>(display.drawableCache->getMaxNumBytes());
+  setDocument(display.getDocument());
+}
+
+void BarelyMLDisplay::Renderer::setDocument(std::shared_ptr<const BarelyMLDocument> doc) {
+  // index the current blocks by their source hash (like BarelyMLDisplay::showDocument)...
+  std::unordered_map<int64, Array<int>> reusableBlocks;
+  for (int i=blocks.size()-1; i>=0; i--) {
+    reusableBlocks[blocks[i]->getSourceHash()].add(i);
+  }
+  OwnedArray<Block> newBlocks;
+  for (int i=0; doc && i<(int)doc->blocks.size(); i++) {
+    int64 key = doc->blocks[(size_t)i].hash;
+    Block* b = nullptr;
+    auto it = reusableBlocks.find(key);
+    if (it != reusableBlocks.end() && !it->second.isEmpty()) { // ...reuse identical blocks...
+      b = blocks[it->second.getLast()];
+      blocks.set(it->second.getLast(), nullptr, false);
+      it->second.removeLast();
+      b->setNode(doc, i);
+    } else {                                        // ...and create the others.
+      b = createBlockOfType(doc->blocks[(size_t)i].type);
+      b->setBMLDisplay(nullptr);                    // (headless)
+      b->setNode(doc, i);
+      b->loadImages(fileSource, *drawableCache);
+      b->setSourceHash(key);
+    }
+    newBlocks.add(b);
+  }
+  blocks.swapWith(newBlocks);
+  document = doc;
+  layoutWidth = -1;                     // lay out again
+}
+
+const BarelyMLDisplay::Layout& BarelyMLDisplay::Renderer::layout(int width) {
+  if (width != layoutWidth || styleGeneration != layoutGeneration) {
+    for (auto b : blocks) {
+      b->setStyle(&style, styleGeneration); // (only blocks with an outdated style are updated)
+    }
+    cachedLayout = computeLayout(blocks, width, style.margin);
+    layoutWidth = width;
+    layoutGeneration = styleGeneration;
+  }
+  return cachedLayout;
+}
+
+Image BarelyMLDisplay::Renderer::renderToImage(int width, float scale, Rectangle<int> clip) {
+  Rectangle<int> area(0, 0, width, layout(width).height);
+  if (!clip.isEmpty()) {
+    area = area.getIntersection(clip);
+  }
+  int w = roundToInt(area.getWidth()*scale);
+  int h = roundToInt(area.getHeight()*scale);
+  if (w <= 0 || h <= 0) { return {}; }
+  Image image(Image::ARGB, w, h, true, SoftwareImageType()); // (software images work on any thread)
+  Graphics g(image);
+  g.addTransform(AffineTransform::scale(scale));
+  g.setOrigin(-area.getPosition());
+  render(g, width, area);
+  return image;
+}
+
+void BarelyMLDisplay::Renderer::render(Graphics& g, int width, Rectangle<int> clip) {
+  const Layout& l = layout(width);
+  g.setColour(style.bg);
+  g.fillRect(clip);
+  // find the first block in the clip region (block tops are sorted)...
+  auto it = std::upper_bound(l.blockBounds.begin(), l.blockBounds.end(), clip.getY(),
+                             [](int y, const Rectangle<int>& r) { return y < r.getY(); });
+  // ...and paint the blocks until we're below it (blocks with a margin overlap their successor)
+  for (int i=jmax(0, (int)(it - l.blockBounds.begin()) - 1); i<blocks.size(); i++) {
+    const Rectangle<int>& r = l.blockBounds.getReference(i);
+    if (r.getY() >= clip.getBottom()) { break; }
+    if (!r.intersects(clip)) { continue; }
+    Block* b = blocks[i];
+    b->setBounds(r);                    // (blocks aren't on screen, so this is fine on any thread)
+    Graphics::ScopedSaveState state(g);
+    g.reduceClipRegion(r.getIntersection(clip));
+    g.setOrigin(r.getPosition());
+    b->paintEntireComponent(g, true);
+  }
+}
+
+// MARK: - Block Creation
+
+BarelyMLDisplay::Block* BarelyMLDisplay::createBlockOfType(BarelyMLDocument::BlockType type) {
+  switch (type) {
+    case BarelyMLDocument::textBlock:       return new TextBlock;
+    case BarelyMLDocument::admonitionBlock: return new AdmonitionBlock;
+    case BarelyMLDocument::imageBlock:      return new ImageBlock;
+    case BarelyMLDocument::tableBlock:      return new TableBlock;
+    case BarelyMLDocument::listItemBlock:   return new ListItem;
+    default:                                return new TextBlock;
+  }
+}
+
+BarelyMLDisplay::Block* BarelyMLDisplay::createBlock(std::shared_ptr<const BarelyMLDocument> doc, int index) {
+  Block* b = createBlockOfType(doc->blocks[(size_t)index].type);
+  b->setBMLDisplay(this);                           // register this display...
+  b->setNode(doc, index);                           // ...and set the document node.
+  return b;
+}
+
+int64 BarelyMLDisplay::getReuseKey(const BarelyMLDocument::BlockNode& node, int generation) {
+  // combine the node's hash with the generation (to invalidate e.g. after file source changes)
+  return (int64)((uint64)node.hash * 31ULL + (uint64)generation);
+}
+
+// MARK: - Format Conversion
+
+// NOTE: The converters read their input line by line as views into the UTF-8 data of the
+//       source string and write into a single pre-reserved stream. The rules of a format are
+//       applied while a line is copied, so that each conversion is linear in input size.
+
+namespace BarelyMLConversion {
+  struct LineView {                     // a line (without line break) inside the input's UTF-8 data
+    const char* start = nullptr;
+    const char* end = nullptr;
+
+    size_t length() const { return (size_t)(end - start); }
+    bool isEmpty() const { return start == end; }
+    bool isNotEmpty() const { return start != end; }
+    bool startsWith(const char* prefix) const {
+      size_t n = strlen(prefix);
+      return length() >= n && memcmp(start, prefix, n) == 0;
+    }
+    bool endsWith(const char* suffix) const {
+      size_t n = strlen(suffix);
+      return length() >= n && memcmp(end - n, suffix, n) == 0;
+    }
+    bool contains(char c) const { return memchr(start, c, length()) != nullptr; }
+    bool containsOnly(const char* chars) const {  // like String::containsOnly (true if empty)
+      for (const char* p = start; p < end; p++) {
+        if (strchr(chars, *p) == nullptr) { return false; }
+      }
+      return true;
+    }
+    int count(char c) const {
+      int n = 0;
+      for (const char* p = start; p < end; p++) { n += (*p == c); }
+      return n;
+    }
+    LineView from(size_t n) const { return { start + jmin(n, length()), end }; }
+    LineView trimmedStart() const {
+      const char* p = start;
+      while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+      return { p, end };
+    }
+    LineView trimmedEnd() const {
+      const char* p = end;
+      while (p > start && (p[-1] == ' ' || p[-1] == '\t')) { p--; }
+      return { start, p };
+    }
+  };
+
+  class LineReader {                    // splits like StringArray::addLines ("\n", "\r\n" or "\r")
+  public:
+    explicit LineReader(const String& text)
+      : pos(text.toRawUTF8()), end(pos + text.getNumBytesAsUTF8()), finished(pos == end) {}
+
+    bool next(LineView& line) {
+      if (finished) { return false; }
+      line.start = pos;
+      while (pos < end && *pos != '\n' && *pos != '\r') { pos++; }
+      line.end = pos;
+      if (pos == end) {
+        finished = true;
+      } else if (*pos++ == '\r' && pos < end && *pos == '\n') {
+        pos++;
+      }
+      return true;
+    }
+    bool peek(LineView& line) const { LineReader r(*this); return r.next(line); }
+    bool hasNext() const { return !finished; }
+    const char* getEnd() const { return end; }
+
+  private:
+    const char* pos;
+    const char* end;
+    bool finished;
+  };
+
+  // returns the first occurrence of pattern (n bytes) in [s, e), or nullptr
+  const char* findPattern(const char* s, const char* e, const char* pattern, size_t n) {
+    if (n == 0) { return s; }
+    for (const char* p = s; p + n <= e; p++) {
+      p = (const char*)memchr(p, pattern[0], (size_t)(e - p));
+      if (p == nullptr || p + n > e) { break; }
+      if (memcmp(p, pattern, n) == 0) { return p; }
+    }
+    return nullptr;
+  }
+
+  class Finder {                        // finds the next occurrence of a pattern before end...
+  public:                               // ...remembering it, so that scans from increasing positions stay linear
+    Finder(const char* p = "", const char* e = nullptr) : pattern(p), patternLength(strlen(p)), end(e) {}
+
+    const char* next(const char* from) {  // returns end if there is no further occurrence
+      if (found == nullptr || from < searchedFrom || from > found) {
+        const char* p = findPattern(from, end, pattern, patternLength);
+        searchedFrom = from;
+        found = p != nullptr ? p : end;
+      }
+      return found;
+    }
+
+  private:
+    const char* pattern;
+    size_t patternLength;
+    const char* end;
+    const char* searchedFrom = nullptr;
+    const char* found = nullptr;
+  };
+
+  size_t getReservedSize(const String& input) {
+    size_t n = input.getNumBytesAsUTF8();
+    return n + n / 8 + 16;              // most conversions grow the text only slightly
+  }
+
+  void append(MemoryOutputStream& out, const char* s, const char* e) {
+    if (e > s) { out.write(s, (size_t)(e - s)); }
+  }
+
+  void append(MemoryOutputStream& out, LineView v) { append(out, v.start, v.end); }
+
+  LineView getContent(const MemoryOutputStream& m) {
+    const char* s = (const char*)m.getData();
+    return { s, s + m.getDataSize() };
+  }
+
+  bool startsWithLinkScheme(const char* p, const char* e) {
+    for (auto scheme : { "http://", "https://", "mailto:" }) {
+      size_t n = strlen(scheme);
+      if ((size_t)(e - p) >= n && memcmp(p, scheme, n) == 0) { return true; }
+    }
+    return false;
+  }
+
+  bool isSpace(char c) { return c == ' ' || c == '\t'; }
+}
 
-// MARK: - Display
+using namespace BarelyMLConversion;
 
-BarelyMLDisplay::BarelyMLDisplay()
-{
-  // default colour palette (CGA 16 colours with some extensions)
-  colours.set("black",        "#000");
-  colours.set("blue",         "#00A");
-  colours.set("green",        "#0A0");
-  colours.set("cyan",         "#0AA");
-  colours.set("red",          "#A00");
-  colours.set("magenta",      "#A0A");
-  colours.set("brown",        "#A50");
-  colours.set("lightgray",    "#AAA");
-  colours.set("darkgray",     "#555");
-  colours.set("lightblue",    "#55F");
-  colours.set("lightgreen",   "#5F5");
-  colours.set("lightcyan",    "#5FF");
-  colours.set("lightred",     "#F55");
-  colours.set("lightmagenta", "#F5F");
-  colours.set("yellow",       "#FF5");
-  colours.set("white",        "#FFF");
-  colours.set("orange",       "#FA5");
-  colours.set("pink",         "#F5F");
-  colours.set("darkyellow",   "#AA0");
-  colours.set("purple",       "#A0F");
-  colours.set("gray",         "#777");
-  colours.set("linkcolour",   "#00A");
-  
-  // default font
-  font = Font(15);
-  
-  // default background
-  bg = Colours::white;
+struct BarelyMLDisplay::ConversionRules::State {
+  State(const ConversionRules& r, MemoryOutputStream& o, const char* end)
+    : rules(r), out(o), inputFrom(end), inputEnd(end), openSpans(r.rules.size(), 0), separators(r.rules.size()),
+      closes(r.rules.size()), opens(r.rules.size()), laterCloses(r.rules.size()),
+      separatorsAfterLinks(r.rules.size()), closesAfterLinks(r.rules.size())
+  {
+    for (int i=0; i<maxListLevels; i++) { listNumbers.add(1); }
+    for (size_t i=0; i<r.rules.size(); i++) {
+      laterCloses[i] = Finder(r.rules[i].close.toRawUTF8(), inputEnd);
+    }
+  }
 
-  // default table backgrounds
-  tableBGHeader = Block::parseHexColourStatic(colours["lightcyan"], Colours::black);
-  tableBG = Block::parseHexColourStatic(colours["lightgray"], Colours::black);
+  void beginLine(const char* lineEnd) {  // (the finders search the current line only)
+    for (size_t i=0; i<rules.rules.size(); i++) {
+      separators[i] = Finder(rules.rules[i].separator.toRawUTF8(), lineEnd);
+      closes[i] = Finder(rules.rules[i].close.toRawUTF8(), lineEnd);
+      opens[i] = Finder(rules.rules[i].from.toRawUTF8(), lineEnd);
+      separatorsAfterLinks[i] = Finder(rules.rules[i].separator.toRawUTF8(), lineEnd);
+      closesAfterLinks[i] = Finder(rules.rules[i].close.toRawUTF8(), lineEnd);
+    }
+    space = Finder(" ", lineEnd);
+    tab = Finder("\t", lineEnd);
+    labelEnd = Finder("]", lineEnd);
+  }
 
-  // default table margins
-  tableMargin = 10;
-  tableGap = 2;
-  
-  // default list indents
-  indentPerSpace = 15;
-  labelGap = 30;
-  
-  // default content margin
-  margin = 20;
-  
-  // default admonition margin and sizes
-  iconsize = 20;
-  admargin = 10;
-  adlinewidth = 2;
-  
-  // default file source (none)
-  fileSource = nullptr;
+  void setListLevel(int level) {        // resets the item numbers of all deeper levels
+    for (int i = level; i < maxListLevels; i++) {
+      listNumbers.set(i, 1);
+    }
+  }
 
-  addAndMakeVisible(viewport);
-  viewport.setViewedComponent(&content, false); // we manage the content component
-  viewport.setScrollBarsShown(false, false, true, false);
-  viewport.setScrollOnDragMode(Viewport::ScrollOnDragMode::nonHover);
+  const ConversionRules& rules;
+  MemoryOutputStream& out;
+  const char* inputFrom;                // the input after the current line...
+  const char* inputEnd;                 // ...up to here (for spans closed in a later line)
+  Array<int> listNumbers;               // the next item number for each ordered list level
+  std::vector<int> openSpans;           // for each span rule
+  std::vector<Finder> separators, closes, opens, laterCloses; // for each rule
+  // (searching after a link in a label, see matchLink, this point moves forward on its own)
+  std::vector<Finder> separatorsAfterLinks, closesAfterLinks;
+  Finder space, tab, labelEnd;          // for bare links
+};
+
+struct BarelyMLDisplay::ConversionRules::Match {
+  const char* end = nullptr;            // the end of the match
+  const char* address = nullptr;        // the address of a link, or the spaces of a prefix
+  const char* addressEnd = nullptr;
+  const char* label = nullptr;          // the label of a link, or the name of a span
+  const char* labelEnd = nullptr;
+  bool hasLabel = false;
+  int number = 0;                       // the ordered list item number for prefixes
+};
+
+// MARK: - Conversion Rules
+
+BarelyMLDisplay::ConversionRules::ConversionRules() : prefixes(1), markers(1) {}
+
+void BarelyMLDisplay::ConversionRules::addPrefixRule(const String& from, const String& to, int listLevel,
+                                                     const String& suffix, const String& trimTrailing) {
+  jassert(listLevel >= 0 && listLevel <= maxListLevels);
+  rules.push_back({ prefixRule, from, to, {}, {}, {}, suffix, trimTrailing, jlimit(0, maxListLevels, listLevel), 0, -1 });
+  insert(prefixes, from, (int)rules.size()-1, true);
 }
 
-BarelyMLDisplay::~BarelyMLDisplay() { }
+void BarelyMLDisplay::ConversionRules::addInlineRule(const String& from, const String& to) {
+  rules.push_back({ inlineRule, from, to, {}, {}, {}, {}, {}, 0, 0, -1 });
+  insert(markers, from, (int)rules.size()-1, false);
+}
 
-void BarelyMLDisplay::paint (Graphics& g)
-{
-  g.fillAll(bg);   // clear the background
+void BarelyMLDisplay::ConversionRules::addLinkRule(const String& open, const String& separator, const String& close,
+                                                   const String& to, const String& toWithoutLabel, int flags) {
+  rules.push_back({ linkRule, open, to, separator, close, toWithoutLabel, {}, {}, 0, flags, -1 });
+  insert(markers, open, (int)rules.size()-1, false);
 }
 
-void BarelyMLDisplay::resized()
-{
-  // let's keep the relative vertical position
-  double relativeScrollPosition = static_cast<double>(viewport.getViewPositionY()) / content.getHeight();
-  // compute content height
-  int h = margin;
-  for (int i=0; i<blocks.size(); i++) {
-    int bh;
-    bh = blocks[i]->getHeightRequired(getWidth()-2*margin)+5;  // just to be on the safe side
-    if (blocks[i]->canExtendBeyondMargin()) {
-      blocks[i]->setBounds(0,h,getWidth(),bh);
+void BarelyMLDisplay::ConversionRules::addBareLinkRule(const String& scheme, const String& to, const String& toWithLabel) {
+  rules.push_back({ bareLinkRule, scheme, toWithLabel, {}, {}, to, {}, {}, 0, 0, -1 });
+  insert(markers, scheme, (int)rules.size()-1, false);
+}
+
+void BarelyMLDisplay::ConversionRules::addSpanRule(const String& open, const String& separator, const String& close,
+                                                   const String& to, const String& closeTo) {
+  int span = (int)rules.size();
+  rules.push_back({ spanRule, open, to, separator, close, closeTo, {}, {}, 0, 0, span });
+  insert(markers, open, span, false);
+  rules.push_back({ spanCloseRule, close, closeTo, {}, {}, {}, {}, {}, 0, 0, span });
+  insert(markers, close, span+1, false);
+}
+
+void BarelyMLDisplay::ConversionRules::insert(std::vector<Node>& trie, const String& pattern, int rule, bool wildcards) {
+  jassert(pattern.isNotEmpty());        // empty patterns would match everywhere
+  if (pattern.isEmpty()) { return; }
+  const char* p = pattern.toRawUTF8();
+  int n = 0;
+  while (*p != 0) {
+    int c;                              // a byte, or one of the wildcards
+    if (wildcards && strncmp(p, "$digits", 7) == 0) {
+      c = 256; p += 7;
+    } else if (wildcards && strncmp(p, "$spaces", 7) == 0) {
+      c = 257; p += 7;
     } else {
-      blocks[i]->setBounds(margin,h,getWidth()-2*margin,bh+10);
+      c = (uint8)*p++;
+    }
+    auto child = [&trie, &n, c]() -> int& {
+      Node& node = trie[(size_t)n];
+      return c == 256 ? node.digits : (c == 257 ? node.spaces : node.next[(size_t)c]);
+    };
+    if (child() < 0) {
+      int index = (int)trie.size();
+      trie.emplace_back();              // (this may move the nodes, so look up the child again)
+      child() = index;
     }
-    h += bh;
+    n = child();
   }
-  // set new bounds
-  viewport.setBounds(getLocalBounds());
-  content.setBounds(0,0,getWidth(), h+margin);
-  // set vertical scroll position
-  int newScrollY = static_cast<int>(relativeScrollPosition * content.getHeight());
-  viewport.setViewPosition(0, newScrollY);
+  trie[(size_t)n].rules.add(rule);
 }
 
-void BarelyMLDisplay::setMarkupString(String s) {
-  markupString = s; // store for later use (e.g. if colors changed)
-  blocks.clear();
-  StringArray lines;
-  lines.addLines(s);
-  
-  int li=0; // line index
-  while (li<lines.size()) {
-    String line=lines[li];
-    if (ListItem::isListItem(line)) {               // if we find a list item...
-      ListItem* b = new ListItem;                   // ...create a new object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      b->setColours(&colours);                      // ...set its colour palette...
-      if (Block::containsLink(line)) {              // ...and, if there's a link...
-        line = b->consumeLink(line);                // ...preprocess line...
-      }
-      b->parseItemMarkup(line, font, indentPerSpace, labelGap); // ...parse it...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list...
-      li++;                                         // ...and go to next line.
-    } else if (AdmonitionBlock::isAdmonitionLine(line)) {  // if we find an admonition...
-      AdmonitionBlock* b = new AdmonitionBlock;     // ...create a new object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      b->setColours(&colours);                      // ...set its colour palette...
-      if (Block::containsLink(line)) {              // ...and, if there's a link...
-        line = b->consumeLink(line);                // ...preprocess line...
-      }
-      b->parseAdmonitionMarkup(line, font, iconsize, admargin, adlinewidth); // ...parse it...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list...
-      li++;                                         // ...and go to next line.
-    } else if (ImageBlock::isImageLine(line)) {     // if we find an image...
-      ImageBlock* b = new ImageBlock;               // ...create a new object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      if (Block::containsLink(line)) {              // ...and, if there's a link...
-        line = b->consumeLink(line);                // ...preprocess line...
-      }
-      b->parseImageMarkup(line, fileSource);        // ...parse it...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list...
-      li++;                                         // ...and go to next line.
-    } else if (TableBlock::isTableLine(line)) {     // if we find a table...
-      TableBlock* b = new TableBlock;               // ...create a new object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      b->setFileSource(fileSource);                 // ...give it a fileSource...
-      b->setColours(&colours);                      // ...set its colour palette...
-      b->setBGColours(tableBG, tableBGHeader);      // ...its background colours...
-      b->setMargins(tableMargin, tableGap, margin); // ...and its margins.
-      StringArray tlines;                           // set up table lines and while...
-      while (TableBlock::isTableLine(line)) {       // ...current line belongs to table...
-        tlines.add(line);                           // ...add it to table lines...
-        line = lines[++li];                         // ...and read next line.
-      }
-      b->parseMarkup(tlines, font);                 // ...parse the collected lines...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list.
-    } else if (Block::containsLink(line)) {          // ...if we got here and there's a link...
-      TextBlock* b = new TextBlock();               // ...set up a new text block object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      b->setColours(&colours);                      // ...set its colours...
-      line = b->consumeLink(line);                  // ...preprocess line...
-      b->parseMarkup(line, font);                   // ...parse markup...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list...
-      li++;                                         // ...and go to next line.
-    } else {                                        // otherwise we assume that we have a text block
-      StringArray blines;                           // set up text block lines
-      bool blockEnd = false;
-      while (!ListItem::isListItem(line) &&         // while line is not part of a list...
-             !TableBlock::isTableLine(line) &&      // ...nor a table...
-             !AdmonitionBlock::isAdmonitionLine(line) && // ...nor an admonition...
-             !ImageBlock::isImageLine(line) &&      // ...nor an image...
-             !Block::containsLink(line) &&          // ...and doesn't contain a link...
-             li<lines.size() && !blockEnd) {        // ...and we're not done yet...
-        blines.add(line);                           // ...add line to text block lines...
-        blockEnd = line.isEmpty();                  // ...and set up shouldEndBlock...
-        line = lines[++li];                         // ...read next line...
-        blockEnd &= line.isNotEmpty();              // ...and finish shouldEndBloc...
-      }
-      TextBlock* b = new TextBlock();               // set up a new text block object...
-      b->setBMLDisplay(this);                       // ...register this display...
-      b->setColours(&colours);                      // ...set its colours...
-      b->parseMarkup(blines, font);                 // ...parse markup...
-      content.addAndMakeVisible(b);                 // ...add the object to content component...
-      blocks.add(b);                                // ...and the block list.
+int BarelyMLDisplay::ConversionRules::matchPrefix(const char* s, const char* e, Match& m) const {
+  int best = -1;
+  const char* spaces = s;
+  const char* spacesEnd = s;
+  const char* p = s;
+  int n = 0;
+  while (true) {
+    const Node& node = prefixes[(size_t)n];
+    if (!node.rules.isEmpty()) {        // the longest match wins (and the last rule added for it)
+      best = node.rules.getLast();
+      m.end = p;
+      m.address = spaces;
+      m.addressEnd = spacesEnd;
+    }
+    if (p < e && node.next[(uint8)*p] >= 0) {
+      n = node.next[(uint8)*p++];
+    } else if (p < e && node.digits >= 0 && *p >= '0' && *p <= '9') {
+      while (p < e && *p >= '0' && *p <= '9') { p++; }
+      n = node.digits;
+    } else if (node.spaces >= 0) {
+      spaces = p;
+      while (p < e && isSpace(*p)) { p++; }
+      spacesEnd = p;
+      n = node.spaces;
+    } else {
+      break;
     }
   }
-  
-  resized();
+  return best;
 }
 
-String BarelyMLDisplay::convertFromMarkdown(String md) {
-  StringArray lines;
-  lines.addLines(md);
-  String bml;
-  bool lastLineWasTable = false;
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
-    // replace unspported unordered list markers
-    if (line.trimStart().startsWith("* ")) {
-      int idx = line.indexOf("* ");
-      line = line.substring(0, idx) + "- " + line.substring(idx+2);
-    }
-    if (line.trimStart().startsWith("+ ")) {
-      int idx = line.indexOf("+ ");
-      line = line.substring(0, idx) + "- " + line.substring(idx+2);
-    }
-    // replace images
-    while (line.contains("![") &&
-        line.fromFirstOccurrenceOf("![", false, false).contains("](") &&
-        line.fromLastOccurrenceOf("](", false, false).contains(")")) {
-      // replace images
-      int idx1 = line.indexOf("![");
-      int idx2 = line.indexOf(idx1+2, "](");
-      int idx3 = line.indexOf(idx2+2, ")");
-      String address = line.substring(idx2+2, idx3);
-      line = line.substring(0, idx1) + "{{" + address + "}}" + line.substring(idx3+2);
-    }
-    // replace links with labels
-    while (line.contains("[") &&
-               line.fromFirstOccurrenceOf("[", false, false).contains("](") &&
-               line.fromLastOccurrenceOf("](", false, false).contains(")")) {
-      // replace links
-      int idx1 = line.indexOf("[");
-      int idx2 = line.indexOf(idx1+1, "](");
-      int idx3 = line.indexOf(idx2+2, ")");
-      String text = line.substring(idx1+1, idx2);
-      String address = line.substring(idx2+2, idx3);
-      line = line.substring(0, idx1) + "[[" + address + "|" + text + "]]" + line.substring(idx3+1);
-    }
-    // replace links without labels
-    while (line.contains("<") &&
-           line.fromFirstOccurrenceOf("<", false, false).contains(">") && (
-           line.fromFirstOccurrenceOf("<", false, false).startsWith("http://") ||
-           line.fromFirstOccurrenceOf("<", false, false).startsWith("https://") ||
-           line.fromFirstOccurrenceOf("<", false, false).startsWith("mailto:"))
-          ) {
-      // replace links
-      int idx1 = line.indexOf("<");
-      int idx2 = line.indexOf(idx1+1, ">");
-      String address = line.substring(idx1+1, idx2);
-      line = line.substring(0, idx1) + "[[" + address + "]]" + line.substring(idx2+1);
+void BarelyMLDisplay::ConversionRules::convertLine(State& state, const char* s, const char* e, bool applyPrefixRules) const {
+  state.beginLine(e);
+  Match m;
+  int rule = applyPrefixRules ? matchPrefix(s, e, m) : -1;
+  if (rule < 0) {
+    state.setListLevel(0);
+    convertText(state, s, e, true);
+    return;
+  }
+  const Rule& r = rules[(size_t)rule];
+  const char* end = e;
+  while (end > m.end && r.trimTrailing.containsChar((juce_wchar)(uint8)end[-1])) { end--; }
+  if (r.listLevel > 0) {                // keep track of the ordered list item numbers
+    m.number = state.listNumbers[r.listLevel-1];
+    state.listNumbers.set(r.listLevel-1, m.number + 1);
+  }
+  state.setListLevel(r.listLevel);
+  if (end == m.end && r.trimTrailing.isNotEmpty()) {
+    // nothing left after trimming, so trim the prefix too
+    writeTemplate(state, r.to.trimCharactersAtEnd(r.trimTrailing), m);
+  } else {
+    writeTemplate(state, r.to, m);
+  }
+  convertText(state, m.end, end, r.to.isEmpty() || r.to.endsWithChar(' ') || r.to.endsWithChar('\t'));
+  state.out << r.suffix;
+}
+
+void BarelyMLDisplay::ConversionRules::convertText(State& state, const char* s, const char* e, bool atWordStart) const {
+  const char* run = s;                  // start of the text that doesn't need rewriting
+  const char* p = s;
+  while (p < e) {
+    Match m;
+    int rule = -1;
+    if (markers[0].next[(uint8)*p] >= 0) {
+      rule = findMatch(state, p, e, p == s ? atWordStart : isSpace(p[-1]), m);
     }
-    // when in a table, skip lines which look like this : | --- | --- |
-    if (!lastLineWasTable || !(line.containsOnly("| -\t") && line.isNotEmpty())) {
-      // if we found a table...
-      if (line.trim().startsWith("|")) {
-        // ...and this is the first line and the next line is a header separator...
-        if (!lastLineWasTable && li+1<lines.size() && lines[li+1].isNotEmpty() && lines[li+1].containsOnly("| -\t") && lines[li+1].contains("-")) {
-          lastLineWasTable = true;        // ...keep track of it...
-          line = line.replace("|", "^");  // ...and make its cells header cells.
-        }
-      } else {
-        lastLineWasTable = false;         // ...otherwise, keep also track.
-      }
-      bml += line + (li<lines.size()-1?"\n":"");
+    if (rule < 0) {
+      p++;
+    } else {
+      append(state.out, run, p);        // flush the text so far...
+      writeMatch(state, rule, m);       // ...and then write the rewritten match.
+      p = run = m.end;
     }
   }
-  // replace bold and italic markers
-  String tmpBoldMarker = "%%%BarelyML%%%Bold%%%";
-  bml = bml.replace("**", tmpBoldMarker);
-  bml = bml.replace("__", tmpBoldMarker);
-  bml = bml.replace("*", "_");            // replace italic marker
-  bml = bml.replace(tmpBoldMarker, "*");  // replace temporary bold marker
-  return bml;
+  append(state.out, run, e);
 }
 
-String BarelyMLDisplay::convertToMarkdown(String bml) {
-  StringArray lines;
-  lines.addLines(bml);
-  String md;
-  
-  bool isTable = false;
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
-    
-    // replace table headers
-    if (line.startsWith("^") && !isTable) {
-      isTable = true;
-      line = line.replace("^", "|");
-      // count columns
-      String tmp = line.substring(1);
-      Array<int> colWidths;
-      while (tmp.contains("|")) {
-        colWidths.add(tmp.indexOf("|"));
-        tmp = tmp.fromFirstOccurrenceOf("|", false, false);
+int BarelyMLDisplay::ConversionRules::findMatch(State& state, const char* p, const char* e, bool atWordStart, Match& m, bool nestedLinks) const {
+  // collect the trie nodes with rules along the path of the text at p...
+  const int maxCandidates = 8;
+  int nodes[maxCandidates];
+  const char* ends[maxCandidates];
+  int numCandidates = 0;
+  int n = 0;
+  for (const char* q = p; q < e && markers[(size_t)n].next[(uint8)*q] >= 0; ) {
+    n = markers[(size_t)n].next[(uint8)*q++];
+    if (!markers[(size_t)n].rules.isEmpty()) {
+      if (numCandidates == maxCandidates) { // (keep the longest ones)
+        memmove(nodes, nodes+1, sizeof(int) * (maxCandidates-1));
+        memmove(ends, ends+1, sizeof(const char*) * (maxCandidates-1));
+        numCandidates--;
       }
-      if (!colWidths.isEmpty()) {
-        line += "\n|";
-        for (int i=0; i<colWidths.size(); i++) {
-          int nhyphen = jmax(3,colWidths[i]-2);
-          line += " ";
-          while (nhyphen>0) {
-            line += "-";
-            nhyphen--;
-          }
-          line += " |";
-        }
+      nodes[numCandidates] = n;
+      ends[numCandidates++] = q;
+    }
+  }
+  // ...and try their rules, longest pattern first (and the last rule added for it first)
+  for (int c = numCandidates-1; c >= 0; c--) {
+    auto& candidates = markers[(size_t)nodes[c]].rules;
+    for (int i = candidates.size()-1; i >= 0; i--) {
+      if (match(state, candidates[i], p, ends[c], e, atWordStart, nestedLinks, m)) { return candidates[i]; }
+    }
+  }
+  return -1;
+}
+
+bool BarelyMLDisplay::ConversionRules::match(State& state, int rule, const char* p, const char* patternEnd,
+                                             const char* e, bool atWordStart, bool nestedLinks, Match& m) const {
+  const Rule& r = rules[(size_t)rule];
+  m = Match();
+  switch (r.type) {
+    case inlineRule:
+      m.end = patternEnd;
+      return true;
+    case linkRule:
+      return matchLink(state, rule, p, patternEnd, e, nestedLinks, m);
+    case bareLinkRule: {
+      if (!atWordStart) { return false; }
+      const char* end = state.space.next(p);
+      if (end >= e) { end = state.tab.next(p); }
+      if (end >= e) { end = e; }
+      // needed for cases like this: [JUCE Forum] (space in label)
+      const char* bracket = (const char*)memchr(p, '[', (size_t)(end - p));
+      if (bracket != nullptr) {
+        const char* close = state.labelEnd.next(p);
+        if (close < e) { end = jmax(end, close + 1); }
       }
+      m.hasLabel = bracket != nullptr && end[-1] == ']';
+      m.address = p;
+      m.addressEnd = m.hasLabel ? bracket : end;
+      m.label = m.hasLabel ? bracket + 1 : end;
+      m.labelEnd = m.hasLabel ? end - 1 : end;
+      m.end = end;
+      return true;
     }
-    if (line.startsWith("^") | line.startsWith("|")) {
-      isTable = true;
-    } else {
-      isTable = false;
+    case spanRule: {
+      size_t sl = r.separator.getNumBytesAsUTF8();
+      size_t cl = r.close.getNumBytesAsUTF8();
+      const char* sep = state.separators[(size_t)rule].next(patternEnd);
+      // the span's name must not contain its opening pattern (e.g. [ for [red]#text#)...
+      if (sep + sl > e || state.opens[(size_t)rule].next(patternEnd) < sep) { return false; }
+      // ...and the span must be closed, in this line or a later one
+      if (state.closes[(size_t)rule].next(sep + sl) + cl > e &&
+          state.laterCloses[(size_t)rule].next(state.inputFrom) >= state.inputEnd) { return false; }
+      m.label = patternEnd;
+      m.labelEnd = sep;
+      m.end = sep + sl;
+      return true;
     }
-    
-    // replace links
-    while (line.contains("[[") && line.fromFirstOccurrenceOf("[[", false, false).contains("]]")) {
-      int idx1 = line.indexOf("[[");
-      int idx2 = line.indexOf(idx1, "]]");
-      String link = line.substring(idx1+2, idx2);
-      if (link.contains("|")) {
-        line = line.substring(0, idx1) + "[" + link.fromFirstOccurrenceOf("|", false, false) + "](" + link.upToFirstOccurrenceOf("|", false, false)  + ")" + line.substring(idx2+2);
+    case spanCloseRule:
+      m.end = patternEnd;
+      return state.openSpans[(size_t)r.span] > 0;
+    default:
+      return false;
+  }
+}
+
+bool BarelyMLDisplay::ConversionRules::matchLink(State& state, int rule, const char* p, const char* patternEnd,
+                                                 const char* e, bool nestedLinks, Match& m) const {
+  const Rule& r = rules[(size_t)rule];
+  size_t sl = r.separator.getNumBytesAsUTF8();
+  size_t cl = r.close.getNumBytesAsUTF8();
+  const char *first, *firstEnd, *second = nullptr, *secondEnd = nullptr, *close;
+  if (r.flags & labelRequired) {
+    const char* from = patternEnd;
+    if ((r.flags & labelFirst) && nestedLinks) {
+      // the label may be another link (e.g. a linked image), so look for the separator after it
+      // (but not for links in its label, which would make every further [ look ahead again)
+      Match inner;
+      int innerRule = findMatch(state, patternEnd, e, false, inner, false);
+      if (innerRule >= 0 && rules[(size_t)innerRule].type == linkRule) { from = inner.end; }
+    }
+    bool afterLink = from != patternEnd;
+    Finder& separators = (afterLink ? state.separatorsAfterLinks : state.separators)[(size_t)rule];
+    Finder& closes = (afterLink ? state.closesAfterLinks : state.closes)[(size_t)rule];
+    const char* sep = separators.next(from);
+    if (sep + sl > e) { return false; }
+    close = closes.next(sep + sl);
+    if (close + cl > e) { return false; }
+    first = patternEnd;
+    firstEnd = sep;
+    second = sep + sl;
+    secondEnd = close;
+  } else {
+    close = state.closes[(size_t)rule].next(patternEnd);
+    if (close + cl > e) { return false; }
+    const char* sep = sl > 0 ? findPattern(patternEnd, close, r.separator.toRawUTF8(), sl) : nullptr;
+    first = patternEnd;
+    firstEnd = sep != nullptr ? sep : close;
+    if (sep != nullptr) {
+      second = sep + sl;
+      secondEnd = close;
+    }
+  }
+  m.hasLabel = second != nullptr;
+  bool swap = m.hasLabel && (r.flags & labelFirst);
+  m.address = swap ? second : first;
+  m.addressEnd = swap ? secondEnd : firstEnd;
+  m.label = swap ? first : second;
+  m.labelEnd = swap ? firstEnd : secondEnd;
+  m.end = close + cl;
+  return !(r.flags & urlOnly) || startsWithLinkScheme(m.address, m.addressEnd);
+}
+
+void BarelyMLDisplay::ConversionRules::writeMatch(State& state, int rule, const Match& m) const {
+  const Rule& r = rules[(size_t)rule];
+  switch (r.type) {
+    case inlineRule:
+      state.out << r.to;
+      break;
+    case linkRule:
+    case bareLinkRule:
+      writeTemplate(state, m.hasLabel ? r.to : r.alternative, m);
+      break;
+    case spanRule:
+      writeTemplate(state, r.to, m);
+      state.openSpans[(size_t)rule]++;
+      break;
+    case spanCloseRule:
+      state.out << r.to;
+      state.openSpans[(size_t)r.span]--;
+      break;
+    default:
+      break;
+  }
+}
+
+void BarelyMLDisplay::ConversionRules::writeTemplate(State& state, const String& t, const Match& m) const {
+  const char* p = t.toRawUTF8();
+  const char* run = p;
+  while (*p != 0) {
+    if (*p == '$') {
+      const char* q = p;
+      if (strncmp(p, "$address", 8) == 0 || strncmp(p, "$spaces", 7) == 0) {
+        append(state.out, run, p);
+        append(state.out, m.address, m.addressEnd);
+        p += p[1] == 'a' ? 8 : 7;
+      } else if (strncmp(p, "$label", 6) == 0) {
+        append(state.out, run, p);
+        convertText(state, m.label, m.labelEnd, true); // (labels are converted, addresses aren't)
+        p += 6;
+      } else if (strncmp(p, "$name", 5) == 0) {
+        append(state.out, run, p);
+        append(state.out, m.label, m.labelEnd);
+        p += 5;
+      } else if (strncmp(p, "$number", 7) == 0) {
+        append(state.out, run, p);
+        state.out << m.number;
+        p += 7;
       } else {
-        line = line.substring(0, idx1) + "<" + link + ">" + line.substring(idx2+2);
+        p++;
       }
+      if (p != q + 1) { run = p; }
+    } else {
+      p++;
     }
+  }
+  append(state.out, run, p);
+}
 
-    // add line
-    md += line + (li<lines.size()-1?"\n":"");
+String BarelyMLDisplay::ConversionRules::convert(const String& text) const {
+  LineReader reader(text);
+  MemoryOutputStream out(getReservedSize(text));
+  State state(*this, out, reader.getEnd());
+  LineView line;
+  while (reader.next(line)) {
+    state.inputFrom = line.end;
+    convertLine(state, line.start, line.end, true);
+    if (reader.hasNext()) { out << '\n'; }
   }
-  
-  // replace bold markers
-  md = md.replace("*", "**");
-  return md;
+  return out.toUTF8();
 }
 
-String BarelyMLDisplay::convertFromDokuWiki(String dw) {
-  StringArray lines;
-  lines.addLines(dw);
-  String bml;
-  Array<int> oLI = {1, 1, 1, 1, 1}; // ordered list indices up to 5 nesting levels supported
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
-    // replace headings
-    bool isHeading = false;
-    if (line.startsWith("====== ")) { line = "# " + line.substring(7); isHeading = true; }
-    if (line.startsWith("===== ")) { line = "## " + line.substring(6); isHeading = true; }
-    if (line.startsWith("==== ")) { line = "### " + line.substring(5); isHeading = true; }
-    if (line.startsWith("=== ")) { line = "#### " + line.substring(4); isHeading = true; }
-    if (line.startsWith("== ")) { line = "##### " + line.substring(3); isHeading = true; }
-    if (isHeading) { // if we've identified a heading, let's drop the trailing markup
-      while (line.endsWith(" ") || line.endsWith("=")) {
-        line = line.dropLastCharacters(1);
+// MARK: - Built-in Rule Sets
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::fromMarkdown() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    // replace unsupported unordered list markers
+    r.addPrefixRule("$spaces* ", "$spaces- ");
+    r.addPrefixRule("$spaces+ ", "$spaces- ");
+    // replace bold and italic markers
+    r.addInlineRule("**", "*");
+    r.addInlineRule("__", "*");
+    r.addInlineRule("*", "_");
+    // replace images, links with labels and links without labels
+    r.addLinkRule("![", "](", ")", "{{$address}}", {}, labelFirst | labelRequired);
+    r.addLinkRule("[", "](", ")", "[[$address|$label]]", {}, labelFirst | labelRequired);
+    r.addLinkRule("<", {}, ">", {}, "[[$address]]", urlOnly);
+    return r;
+  }();
+  return rules;
+}
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::toMarkdown() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    r.addInlineRule("*", "**");         // replace bold markers
+    r.addLinkRule("[[", "|", "]]", "[$label]($address)", "<$address>");
+    return r;
+  }();
+  return rules;
+}
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::fromDokuWiki() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    for (int level=1; level<=maxListLevels; level++) {
+      // replace headings (and drop their trailing markup)
+      r.addPrefixRule(String::repeatedString("=", 7-level) + " ", String::repeatedString("#", level) + " ", 0, {}, " =");
+      // replace ordered and unordered list markers (up to 5 nesting levels)
+      r.addPrefixRule(String::repeatedString("  ", level) + "- ", String::repeatedString(" ", level-1) + "$number. ", level);
+      r.addPrefixRule(String::repeatedString("  ", level) + "* ", String::repeatedString(" ", level-1) + "- ");
+    }
+    // replace bold and italic markers
+    r.addInlineRule("**", "*");
+    r.addInlineRule("//", "_");
+    // replace color markers (supporting a subset of the "color" plugin syntax)
+    r.addInlineRule("<color #", "<c#");
+    r.addInlineRule("<color ", "<c:");
+    r.addInlineRule("</color>", "</c>");
+    // keep links as they are (so that e.g. the // of their URLs stay intact)
+    r.addLinkRule("[[", "|", "]]", "[[$address|$label]]", "[[$address]]");
+    r.addInlineRule("://", "://"); // ...and bare or unclosed URLs too
+    return r;
+  }();
+  return rules;
+}
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::toDokuWiki() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    for (int level=1; level<=maxListLevels; level++) {
+      // replace headings
+      String heading = String::repeatedString("=", 7-level);
+      r.addPrefixRule(String::repeatedString("#", level) + " ", heading + " ", 0, " " + heading);
+      // replace unordered and ordered list markers (up to 5 nesting levels)
+      r.addPrefixRule(String::repeatedString(" ", level-1) + "- ", String::repeatedString("  ", level) + "* ");
+      r.addPrefixRule(String::repeatedString(" ", level-1) + "$digits. ", String::repeatedString("  ", level) + "- ");
+    }
+    // replace bold and italic markers
+    r.addInlineRule("*", "**");
+    r.addInlineRule("_", "//");
+    // replace color markers (supporting a subset of the "color" plugin syntax)
+    r.addInlineRule("<c#", "<color #");
+    r.addInlineRule("<c:", "<color ");
+    r.addInlineRule("</c>", "</color>");
+    // keep links as they are (so that e.g. the _ of their URLs stay intact)
+    r.addLinkRule("[[", "|", "]]", "[[$address|$label]]", "[[$address]]");
+    return r;
+  }();
+  return rules;
+}
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::fromAsciiDoc() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    for (int level=1; level<=maxListLevels; level++) {
+      // replace headings
+      r.addPrefixRule(String::repeatedString("=", level) + " ", String::repeatedString("#", level) + " ");
+      // replace ordered and unordered list markers (up to 5 nesting levels)
+      r.addPrefixRule(String::repeatedString(".", level) + " ", String::repeatedString(" ", level-1) + "$number. ", level);
+      r.addPrefixRule(String::repeatedString("*", level) + " ", String::repeatedString(" ", level-1) + "- ");
+    }
+    // replace admonitions (only NOTE and TIP, the other ones are identical)
+    r.addPrefixRule("NOTE: ", "INFO: ");
+    r.addPrefixRule("TIP: ", "HINT: ");
+    // replace bold and italic markers
+    r.addInlineRule("**", "*");
+    r.addInlineRule("__", "_");
+    // replace links
+    for (auto scheme : { "http://", "https://", "mailto:" }) {
+      r.addBareLinkRule(scheme, "[[$address]]", "[[$address|$label]]");
+    }
+    // replace color markers (which are actually style markers, so this is not perfectly accurate)
+    r.addSpanRule("[", "]#", "#", "<c:$name>", "</c>");
+    return r;
+  }();
+  return rules;
+}
+
+const BarelyMLDisplay::ConversionRules& BarelyMLDisplay::ConversionRules::toAsciiDoc() {
+  static const ConversionRules rules = [] {
+    ConversionRules r;
+    for (int level=1; level<=maxListLevels; level++) {
+      // replace headings
+      r.addPrefixRule(String::repeatedString("#", level) + " ", String::repeatedString("=", level) + " ");
+      // replace unordered and ordered list markers (up to 5 nesting levels)
+      r.addPrefixRule(String::repeatedString(" ", level-1) + "- ", String::repeatedString("*", level) + " ");
+      r.addPrefixRule(String::repeatedString(" ", level-1) + "$digits. ", String::repeatedString(".", level) + " ");
+    }
+    // replace admonitions (only INFO and HINT, the other ones are identical)
+    r.addPrefixRule("INFO: ", "NOTE: ");
+    r.addPrefixRule("HINT: ", "TIP: ");
+    // replace links (only URLs)
+    r.addLinkRule("[[", "|", "]]", "$address[$label]", "$address", urlOnly);
+    // replace color markers (named colors only)
+    r.addSpanRule("<c:", ">", "</c>", "[$name]#", "#");
+    return r;
+  }();
+  return rules;
+}
+
+// MARK: - Format Conversion
+
+String BarelyMLDisplay::convertFromMarkdown(String md, const ConversionRules& rules) {
+  ConversionRules headerRules(rules);
+  headerRules.addInlineRule("|", "^");  // (header cells)
+  LineReader reader(md);
+  MemoryOutputStream bml(getReservedSize(md));
+  ConversionRules::State state(rules, bml, reader.getEnd()), headerState(headerRules, bml, reader.getEnd());
+  bool lastLineWasTable = false;
+  LineView line, next;
+  while (reader.next(line)) {
+    // when in a table, skip lines which look like this : | --- | --- |
+    if (lastLineWasTable && line.isNotEmpty() && line.containsOnly("| -\t")) { continue; }
+    // if we found a table...
+    bool header = false;
+    if (line.trimmedStart().startsWith("|")) {
+      // ...and this is the first line and the next line is a header separator...
+      if (!lastLineWasTable && reader.peek(next) && next.isNotEmpty() && next.containsOnly("| -\t") && next.contains('-')) {
+        lastLineWasTable = true;          // ...keep track of it...
+        header = true;                    // ...and make its cells header cells.
       }
+    } else {
+      lastLineWasTable = false;           // ...otherwise, keep also track.
     }
-    // replace ordered list markers (up to 5 nesting levels);
-    int oLLevel = 0;
-    bool isOL = false;
-    if (line.startsWith("  - ")) { line =     String(oLI[0]) + ". " + line.substring(4); oLLevel = 1; isOL = true; }
-    if (line.startsWith("    - ")) { line = " " + String(oLI[1]) + ". " + line.substring(6); oLLevel = 2; isOL = true; }
-    if (line.startsWith("      - ")) { line = "  " + String(oLI[2]) + ". " + line.substring(8); oLLevel = 3; isOL = true; }
-    if (line.startsWith("        - ")) { line = "   " + String(oLI[3]) + ". " + line.substring(10); oLLevel = 4; isOL = true; }
-    if (line.startsWith("          - ")) { line = "    " + String(oLI[4]) + ". " + line.substring(12); oLLevel = 5; isOL = true; }
-    if (isOL) { // if we've identified an ordered list item, keep track of indices
-      oLI.set(oLLevel-1, oLI[oLLevel-1] + 1); // increase counter at this level
-    }
-    // reset the indices for deeper levels
-    for (int i = oLLevel; i < 5; i++) {
-      oLI.set(i, 1);
-    }
-    // replace unordered list markers (up to 5 nesting levels);
-    if (line.startsWith("  * ")) { line = "- " + line.substring(4); }
-    if (line.startsWith("    * ")) { line = " - " + line.substring(6); }
-    if (line.startsWith("      * ")) { line = "  - " + line.substring(8); }
-    if (line.startsWith("        * ")) { line = "   - " + line.substring(10); }
-    if (line.startsWith("          * ")) { line = "    - " + line.substring(12); }
-    // add line
-    bml += line + (li<lines.size()-1?"\n":"");
+    auto& s = header ? headerState : state;
+    s.inputFrom = line.end;
+    (header ? headerRules : rules).convertLine(s, line.start, line.end, true);
+    if (reader.hasNext()) { bml << '\n'; }
   }
-  
-  // save the URLs
-  bml = bml.replace("[[http://", "[[http%%%BarelyML%%%URLSEPARATOR%%%");
-  bml = bml.replace("[[https://", "[[https%%%BarelyML%%%URLSEPARATOR%%%");
+  return bml.toUTF8();
+}
 
-  // replace bold and italic markers
-  bml = bml.replace("**", "*");
-  bml = bml.replace("//", "_");
+String BarelyMLDisplay::convertToMarkdown(String bml, const ConversionRules& rules) {
+  ConversionRules headerRules(rules);
+  headerRules.addInlineRule("^", "|");  // (header cells)
+  LineReader reader(bml);
+  MemoryOutputStream md(getReservedSize(bml));
+  ConversionRules::State state(rules, md, reader.getEnd()), headerState(headerRules, md, reader.getEnd());
+  bool isTable = false;
+  LineView line;
+  while (reader.next(line)) {
+    // replace table headers
+    bool header = line.startsWith("^") && !isTable;
+    isTable = line.startsWith("^") || line.startsWith("|");
+    auto& s = header ? headerState : state;
+    s.inputFrom = line.end;
+    (header ? headerRules : rules).convertLine(s, line.start, line.end, true);
+    if (header) {
+      // add a header separator, with a cell for each column of the header (sized like it)
+      bool hasColumns = false;
+      int width = 0;                      // in characters, not bytes
+      for (const char* p = line.start + 1; p < line.end; p++) {
+        if (*p == '^' || *p == '|') {
+          md << (hasColumns ? " " : "\n| ") << String::repeatedString("-", jmax(3, width-2)) << " |";
+          hasColumns = true;
+          width = 0;
+        } else if ((*p & 0xC0) != 0x80) {
+          width++;
+        }
+      }
+    }
+    if (reader.hasNext()) { md << '\n'; }
+  }
+  return md.toUTF8();
+}
 
-  // restore the URLS
-  bml = bml.replace("%%%BarelyML%%%URLSEPARATOR%%%", "://");
-  
-  // replace color markers (supporting a subset of the "color" plugin syntax)
-  bml = bml.replace("<color #", "<c#");
-  bml = bml.replace("<color " , "<c:");
-  bml = bml.replace("</color>", "</c>");
-  
-  return bml;
+String BarelyMLDisplay::convertFromDokuWiki(String dw, const ConversionRules& rules) {
+  return rules.convert(dw);
 }
 
-String BarelyMLDisplay::convertToDokuWiki(String bml) {
-  StringArray lines;
-  lines.addLines(bml);
-  String dw;
-  
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
-    // replace bold and italic markers
-    line = line.replace("*", "**");
-    line = line.replace("_", "//");
-    // replace headings
-    if (line.startsWith("# ")) { line = "====== " + line.substring(2) + " ======"; }
-    if (line.startsWith("## ")) { line = "===== " + line.substring(3) + " ====="; }
-    if (line.startsWith("### ")) { line = "==== " + line.substring(4) + " ===="; }
-    if (line.startsWith("#### ")) { line = "=== " + line.substring(5) + " ==="; }
-    if (line.startsWith("##### ")) { line = "== " + line.substring(6) + " =="; }
-    // replace unordered list markers (up to 5 nesting levels);
-    if (line.startsWith("- ")) { line = "  * " + line.substring(2); }
-    if (line.startsWith(" - ")) { line = "    * " + line.substring(3); }
-    if (line.startsWith("  - ")) { line = "      * " + line.substring(4); }
-    if (line.startsWith("   - ")) { line = "        * " + line.substring(5); }
-    if (line.startsWith("    - ")) { line = "          * " + line.substring(6); }
-    // replace ordered list markers (up to 5 nesting levels)
-    if (line.indexOf(". ")>0 && line.substring(0, line.indexOf(". ")).trim().containsOnly("0123456789")) {
-      int didx = line.indexOf(". ");
-      if (line.startsWith("    ") && line.substring(4, didx).containsOnly("0123456789")) { line = "          - " + line.substring(didx+2); }
-      if (line.startsWith("   ") && line.substring(3, didx).containsOnly("0123456789")) { line = "        - " + line.substring(didx+2); }
-      if (line.startsWith("  ") && line.substring(2, didx).containsOnly("0123456789")) { line = "      - " + line.substring(didx+2); }
-      if (line.startsWith(" ") && line.substring(1, didx).containsOnly("0123456789")) { line = "    - " + line.substring(didx+2); }
-      if (                       line.substring(0, didx).containsOnly("0123456789")) { line = "  - " + line.substring(didx+2); }
-    }
-    // add line
-    dw += line + (li<lines.size()-1?"\n":"");
-  }
-
-  // replace color markers (supporting a subset of the "color" plugin syntax)
-  dw = dw.replace("<c#" , "<color #");
-  dw = dw.replace("<c:" , "<color ");
-  dw = dw.replace("</c>", "</color>");
-  
-  return dw;
+String BarelyMLDisplay::convertToDokuWiki(String bml, const ConversionRules& rules) {
+  return rules.convert(bml);
 }
 
-String BarelyMLDisplay::convertFromAsciiDoc(String ad) {
-  StringArray lines;
-  lines.addLines(ad);
-  String bml;
-  Array<int> oLI = {1, 1, 1, 1, 1}; // ordered list indices up to 5 nesting levels supported
+String BarelyMLDisplay::convertFromAsciiDoc(String ad, const ConversionRules& rules) {
+  LineReader reader(ad);
+  MemoryOutputStream bml(getReservedSize(ad)), row;
+  ConversionRules::State state(rules, bml, reader.getEnd());
   bool isTable = false;
   int tableCols = 0;
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
+  LineView line, next;
+  while (reader.next(line)) {
     bool skipLine = false;
     // skip lines in square brackets (these are used for features we don't support)
     if (line.startsWith("[") && line.endsWith("]")) { skipLine = true; }
     // skip table delimiters
-    if (line.startsWith("|") && line.substring(1).containsOnly("=")) { skipLine = true; isTable = !isTable; tableCols = 0; }
-    // handle table
-    if (!skipLine && line.startsWith("|")) {
+    if (line.startsWith("|") && line.from(1).containsOnly("=")) { skipLine = true; isTable = !isTable; tableCols = 0; }
+    // skip empty line inside table
+    if (isTable && line.isEmpty()) { skipLine = true; }
+    if (skipLine) {
+      state.setListLevel(0);
+      continue;
+    }
+    if (line.startsWith("|")) {
+      // handle table
+      row.reset();
       if (tableCols == 0) {  // first line -> contains all columns (not guaranteed for remaining lines)
-        // count columns
-        String tmp = line;
-        while (tmp.contains("|")) {
-          tmp = tmp.fromFirstOccurrenceOf("|", false, false);
-          tableCols++;
-        }
+        tableCols = line.count('|');
         // check if next line is empty
-        if (li+1<lines.size() && lines[li+1].isEmpty()) { // empty -> header
+        if (reader.peek(next) && next.isEmpty()) { // empty -> header
           // let's remove ^ characters first, otherwise there will be alignment issues
-          line = line.replace("^","").replace("|", "^") + " ^";
+          for (const char* p = line.start; p < line.end; p++) {
+            if (*p != '^') { row << (*p == '|' ? '^' : *p); }
+          }
+          row << " ^";
         } else { // not empty -> regular table row
-          line = line + " |";
+          append(row, line);
+          row << " |";
         }
       } else {
         // when we're here this is the first line of a non-header table row
-        int colsFound = 0;
-        // count columns in this line
-        String tmp = line;
-        while (tmp.contains("|")) {
-          tmp = tmp.fromFirstOccurrenceOf("|", false, false);
-          colsFound++;
-        }
+        int colsFound = line.count('|');
+        append(row, line);
         // accumulate lines until we've found enough columns
-        while (colsFound < tableCols && li+1<lines.size() && lines[li+1].startsWith("|") && !lines[li+1].substring(1).containsOnly("=")) {
-          String nextLine = lines[++li];
-          line += nextLine;
-          while (nextLine.contains("|")) {
-            nextLine = nextLine.fromFirstOccurrenceOf("|", false, false);
-            colsFound++;
-          }
+        while (colsFound < tableCols && reader.peek(next) && next.startsWith("|") && !next.from(1).containsOnly("=")) {
+          reader.next(line);
+          append(row, line);
+          colsFound += line.count('|');
         }
-        line += " |";
+        row << " |";
       }
+      state.inputFrom = line.end;
+      LineView r = getContent(row);
+      rules.convertLine(state, r.start, r.end, false);
+    } else {
+      state.inputFrom = line.end;
+      rules.convertLine(state, line.start, line.end, true);
     }
-    // skip empty line inside table
-    if (isTable && line.isEmpty()) { skipLine = true; }
-    // replace headings
-    if (line.startsWith("= ")) { line = "# " + line.substring(2); }
-    if (line.startsWith("== ")) { line = "## " + line.substring(3); }
-    if (line.startsWith("=== ")) { line = "### " + line.substring(4); }
-    if (line.startsWith("==== ")) { line = "#### " + line.substring(5); }
-    if (line.startsWith("===== ")) { line = "##### " + line.substring(6); }
-    // replace ordered list markers (up to 5 nesting levels);
-    int oLLevel = 0;
-    bool isOL = false;
-    if (line.startsWith(". ")) { line =     String(oLI[0]) + ". " + line.substring(2); oLLevel = 1; isOL = true; }
-    if (line.startsWith(".. ")) { line = " " + String(oLI[1]) + ". " + line.substring(3); oLLevel = 2; isOL = true; }
-    if (line.startsWith("... ")) { line = "  " + String(oLI[2]) + ". " + line.substring(4); oLLevel = 3; isOL = true; }
-    if (line.startsWith(".... ")) { line = "   " + String(oLI[3]) + ". " + line.substring(5); oLLevel = 4; isOL = true; }
-    if (line.startsWith("..... ")) { line = "    " + String(oLI[4]) + ". " + line.substring(6); oLLevel = 5; isOL = true; }
-    if (isOL) { // if we've identified an ordered list item, keep track of indices
-      oLI.set(oLLevel-1, oLI[oLLevel-1] + 1); // increase counter at this level
-    }
-    // reset the indices for deeper levels
-    for (int i = oLLevel; i < 5; i++) {
-      oLI.set(i, 1);
-    }
-    // replace unordered list markers (up to 5 nesting levels);
-    if (line.startsWith("* ")) { line = "- " + line.substring(2); }
-    if (line.startsWith("** ")) { line = " - " + line.substring(3); }
-    if (line.startsWith("*** ")) { line = "  - " + line.substring(4); }
-    if (line.startsWith("**** ")) { line = "   - " + line.substring(5); }
-    if (line.startsWith("***** ")) { line = "    - " + line.substring(6); }
-    
-    // replace admonitions (only NOTE and TIP, the other ones are identical)
-    if (line.startsWith("NOTE: ")) { line = "INFO: " + line.substring(6); }
-    if (line.startsWith("TIP: ")) { line = "HINT: " + line.substring(5); }
+    if (reader.hasNext()) { bml << '\n'; }
+  }
+  return bml.toUTF8();
+}
 
-    // replace links
-    StringArray linkSchemes = {"http://", "https://", "mailto:"};
-    StringArray precedingChar = {" ", "\t"};
-    for (int s=0; s<linkSchemes.size(); s++) {
-      for (int p=0; p<precedingChar.size(); p++) {
-        String target = precedingChar[p] + linkSchemes[s];
-        while (line.contains(target) || line.startsWith(linkSchemes[s])) {
-          int idx1 = line.indexOf(target)+1;
-          if (idx1<0) { // if we don't find the target...
-            idx1 = 0;   // ...that means the line starts with the link scheme
-          }
-          int idx2 = line.indexOf(idx1, " ");
-          if (idx2<0) { idx2 = line.indexOf(idx1, "\t"); }
-          if (idx2<0) { idx2 = line.length(); }
-          // needed for cases like this: [JUCE Forum] (space in label)
-          if (line.substring(idx1, idx2).contains("[")) {
-            idx2 = jmax(idx2, line.indexOf(idx1, "]")+1);
-          }
-          String link = line.substring(idx1, idx2);
-          if (link.contains("[") && link.endsWith("]")) {
-            int lidx = link.indexOf("[");
-            line = line.substring(0, idx1) + "[[" + link.substring(0, lidx) + "|" + link.substring(lidx+1) + "]" + line.substring(idx2);
-          } else {
-            line = line.substring(0, idx1) + "[[" + link + "]]" + line.substring(idx2);
-          }
+String BarelyMLDisplay::convertToAsciiDoc(String bml, const ConversionRules& rules) {
+  LineReader reader(bml);
+  MemoryOutputStream ad(getReservedSize(bml)), row;
+  ConversionRules::State state(rules, ad, reader.getEnd());
+  bool isTable = false;
+  LineView line, next;
+  while (reader.next(line)) {
+    state.inputFrom = line.end;
+    if (line.startsWith("^") || line.startsWith("|")) {
+      // table
+      row.reset();
+      if (!isTable) { // this is the first line
+        LineView cells = line;
+        while (cells.end[-1] != '^' && cells.end[-1] != '|') { cells.end--; }
+        cells.end--;                      // drop everything from the last cell marker
+        row << "|===\n";
+        for (const char* p = cells.start; p < cells.end; p++) {
+          row << (*p == '^' ? '|' : *p);
         }
+        row << '\n';
+      } else {
+        // drop the trailing | or ^ (note that we assume reasonable well-formedness here)
+        LineView cells = line.trimmedEnd();
+        if (cells.isNotEmpty()) { cells.end--; }
+        append(row, cells);
+      }
+      isTable = true;
+      if (!(reader.peek(next) && (next.startsWith("|") || next.startsWith("^")))) {
+        // insert a table delimiter before the next line
+        row << "\n|===";
+        isTable = false;
+      }
+      LineView r = getContent(row);
+      rules.convertLine(state, r.start, r.end, false);
+    } else {
+      rules.convertLine(state, line.start, line.end, true);
+    }
+    if (reader.hasNext()) { ad << '\n'; }
+  }
+  return ad.toUTF8();
+}
+
+
+// MARK: - Cached Text Layout
+
+std::atomic<int> BarelyMLDisplay::CachedTextLayout::numLayoutsCreated { 0 };
+
+const TextLayout& BarelyMLDisplay::CachedTextLayout::getLayout(float width) {
+  if (width != layoutWidth || layout == nullptr) { // only lay out again if the width has changed
+    layout = SharedLayout::get(getTextKey(), width, text); // (or take an identical one)
+    layoutWidth = width;
+  }
+  return *layout;
+}
+
+int64 BarelyMLDisplay::CachedTextLayout::getTextKey() {
+  if (!keyComputed) {
+    textKey = SharedLayout::getKey(*text);
+    keyComputed = true;
+  }
+  return textKey;
+}
+
+float BarelyMLDisplay::CachedTextLayout::estimateHeight(float width) {
+  // assumes an average glyph width of half the font height and adds up the (wrapped) lines, the
+  // text is only scanned once (and never shaped)
+  if (!linesCounted) {
+    lines.clearQuick();
+    int numAttributes = text->getNumAttributes();
+    int attribute = 0;
+    int index = 0;
+    Point<float> line;                  // width and height of the current line
+    for (auto p = text->getText().getCharPointer(); !p.isEmpty() && numAttributes > 0; index++) {
+      juce_wchar c = p.getAndAdvance();
+      while (attribute < numAttributes-1 && index >= text->getAttribute(attribute).range.getEnd()) {
+        attribute++;
+      }
+      float h = text->getAttribute(attribute).font.getHeight();
+      line.y = jmax(line.y, h);
+      if (c == '\n') {
+        lines.add(line);
+        line = {};
+      } else {
+        line.x += 0.5f*h;
       }
     }
+    if (line.x > 0.f) { lines.add(line); }
+    linesCounted = true;
+  }
+  float height = 0.f;
+  for (auto& line : lines) {
+    height += line.y * jmax(1.f, std::ceil(line.x / jmax(1.f, width)));
+  }
+  return height;
+}
 
-    // add line
-    if (!skipLine) {
-      bml += line + (li<lines.size()-1?"\n":"");
+Array<Rectangle<float>> BarelyMLDisplay::CachedTextLayout::getRangeBounds(Range<int> range, float width) {
+  // glyphs are mapped to characters proportionally within each run (which is exact unless the
+  // run has ligatures or combined characters)
+  Array<Rectangle<float>> bounds;
+  const TextLayout& l = getLayout(width);
+  for (int i=0; i<l.getNumLines(); i++) {
+    const TextLayout::Line& line = l.getLine(i);
+    if (line.stringRange.getEnd() <= range.getStart()) { continue; }
+    if (line.stringRange.getStart() >= range.getEnd()) { break; }
+    Range<float> y = line.getLineBoundsY();
+    for (auto run : line.runs) {
+      Range<int> r = run->stringRange.getIntersectionWith(range);
+      int n = run->glyphs.size();
+      int length = run->stringRange.getLength();
+      if (r.isEmpty() || n == 0 || length == 0) { continue; }
+      int first = jmin(n-1, (r.getStart()-run->stringRange.getStart())*n/length);
+      int last = jlimit(first, n-1, (r.getEnd()-run->stringRange.getStart())*n/length-1);
+      const TextLayout::Glyph& g0 = run->glyphs.getReference(first);
+      const TextLayout::Glyph& g1 = run->glyphs.getReference(last);
+      float x0 = line.lineOrigin.x + g0.anchor.x;
+      float x1 = line.lineOrigin.x + g1.anchor.x + g1.width;
+      bounds.add(Rectangle<float>(x0, y.getStart(), x1-x0, y.getLength()));
     }
   }
-  
-  // replace bold and italic markers
-  bml = bml.replace("**", "*");
-  bml = bml.replace("__", "_");
-  
-  // replace color markers (which are actually style markers, so this is not perfectly accurate)
-  while (bml.contains("]#") && bml.fromLastOccurrenceOf("]#", false, false).contains("#") && bml.upToLastOccurrenceOf("]#", false, false).contains("[")) {
-    int idx2 = bml.lastIndexOf("]#");
-    int idx1 = bml.substring(0, idx2).lastIndexOf("[");
-    int idx3 = bml.indexOf(idx2+2, "#");
-    bml = bml.substring(0, idx1) + "<c:" + bml.substring(idx1+1, idx2) + ">" + bml.substring(idx2+2,idx3) + "</c>" + bml.substring(idx3+1);
+  return bounds;
+}
+
+// MARK: - Palette
+
+void BarelyMLDisplay::Palette::compile(const StringPairArray& c) {
+  colours.clearQuick();
+  indices.clear();
+  hash = 0;
+  for (int i=0; i<c.size(); i++) {
+    String name = c.getAllKeys()[i];
+    hash = (int64)((uint64)hash * 31ULL + (uint64)name.hashCode64()) ^ c.getAllValues()[i].hashCode64();
+    indices[name] = colours.size();
+    // NOTE: empty values are black
+    colours.add(BarelyMLDocument::parseHexColour(c.getAllValues()[i], Colours::black));
   }
-  
-  return bml;
 }
 
-String BarelyMLDisplay::convertToAsciiDoc(String bml) {
-  StringArray lines;
-  lines.addLines(bml);
-  String ad;
-  
-  bool isTable = false;
-  
-  for (int li=0; li<lines.size(); li++) {
-    String line = lines[li];
-    // table
-    if (line.startsWith("^") || line.startsWith("|")) {
-      if (!isTable) { // this is the first line
-        line = "|===\n" + line.replace("^", "|").upToLastOccurrenceOf("|", false, false) + "\n";
+int BarelyMLDisplay::Palette::indexOf(const String& name) const {
+  auto it = indices.find(name);
+  return it != indices.end() ? it->second : -1;
+}
+
+Colour BarelyMLDisplay::Palette::getColour(const String& name, Colour fallback) const {
+  int index = indexOf(name);
+  return index >= 0 ? colours[index] : fallback;
+}
+
+// MARK: - Rasterized Drawable
+
+void BarelyMLDisplay::RasterizedDrawable::draw(Graphics& g, const Drawable& d, Rectangle<float> area) {
+  // same placement as drawWithin(..., RectanglePlacement::centred, ...)
+  Rectangle<float> dest = RectanglePlacement(RectanglePlacement::centred).appliedTo(d.getDrawableBounds(), area);
+  float s = g.getInternalContext().getPhysicalPixelScaleFactor();
+  int w = roundToInt(dest.getWidth()*s);
+  int h = roundToInt(dest.getHeight()*s);
+  if (w <= 0 || h <= 0) { return; }
+  if ((int64)w*h > 4096*4096) {         // don't cache huge images, just draw the drawable
+    d.drawWithin(g, area, RectanglePlacement::centred, 1.0f);
+    return;
+  }
+  if (image.isNull() || source != &d || w != width || h != height || s != scale) {
+    // render the drawable at the destination size in physical pixels...
+    image = Image(Image::ARGB, w, h, true);
+    Graphics ig(image);
+    d.drawWithin(ig, Rectangle<float>(0.f, 0.f, (float)w, (float)h), RectanglePlacement::stretchToFit, 1.0f);
+    source = &d;
+    width = w;
+    height = h;
+    scale = s;
+  }
+  g.drawImage(image, dest);             // ...and blit it.
+}
+
+// MARK: - Paint Cache
+
+int64 BarelyMLDisplay::PaintCache::createId() {
+  static std::atomic<int64> lastId { 0 };
+  return ++lastId;
+}
+
+void BarelyMLDisplay::PaintCache::paint(Graphics& g, int64 id, int version, Rectangle<int> bounds,
+                                        const std::function<void(Graphics&)>& paintFunction) {
+  float scale = g.getInternalContext().getPhysicalPixelScaleFactor();
+  Rectangle<int> clip = g.getClipBounds().getIntersection(bounds);
+  if (clip.isEmpty()) { return; }
+  size_t maxTileBytes = (size_t)(tileWidth*scale) * (size_t)(tileHeight*scale) * 4;
+  if (scale <= 0.f || maxTileBytes > maxNumBytes) {
+    paintFunction(g);                   // (the budget can't even hold a single tile)
+    return;
+  }
+  // find the tiles which intersect the clip region...
+  int firstColumn = (clip.getX()-bounds.getX()) / tileWidth;
+  int lastColumn = (clip.getRight()-1-bounds.getX()) / tileWidth;
+  int firstRow = (clip.getY()-bounds.getY()) / tileHeight;
+  int lastRow = (clip.getBottom()-1-bounds.getY()) / tileHeight;
+  for (int row=firstRow; row<=lastRow; row++) {
+    for (int column=firstColumn; column<=lastColumn; column++) {
+      Rectangle<int> area = Rectangle<int>(bounds.getX()+column*tileWidth, bounds.getY()+row*tileHeight,
+                                           tileWidth, tileHeight).getIntersection(bounds);
+      int64 key = (id << 32) | ((int64)(row & 0xfffff) << 12) | (column & 0xfff);
+      auto it = index.find(key);
+      if (it != index.end()) {
+        tiles.splice(tiles.begin(), tiles, it->second); // (most recently used)
       } else {
-        // drop the trailing | or ^ (note that we assume reasonable well-formedness here)
-        line = line.trimEnd().dropLastCharacters(1);
-      }
-      isTable = true;
-      if (li+1 >= lines.size() || !(lines[li+1].startsWith("|") || lines[li+1].startsWith("^"))) {
-        // insert a table delimiter before the next line
-        line += "\n|===";
-        isTable = false;
+        tiles.push_front({ key, -1, {}, 0.f, {}, 0 });
+        index[key] = tiles.begin();
       }
-    }
-    // replace headings
-    if (line.startsWith("# ")) { line = "= " + line.substring(2); }
-    if (line.startsWith("## ")) { line = "== " + line.substring(3); }
-    if (line.startsWith("### ")) { line = "=== " + line.substring(4); }
-    if (line.startsWith("#### ")) { line = "==== " + line.substring(5); }
-    if (line.startsWith("##### ")) { line = "===== " + line.substring(6); }
-    // replace unordered list markers (up to 5 nesting levels);
-    if (line.startsWith("- ")) { line = "* " + line.substring(2); }
-    if (line.startsWith(" - ")) { line = "** " + line.substring(3); }
-    if (line.startsWith("  - ")) { line = "*** " + line.substring(4); }
-    if (line.startsWith("   - ")) { line = "**** " + line.substring(5); }
-    if (line.startsWith("    - ")) { line = "***** " + line.substring(6); }
-    // replace ordered list markers (up to 5 nesting levels)
-    if (line.indexOf(". ")>0 && line.substring(0, line.indexOf(". ")).trim().containsOnly("0123456789")) {
-      int didx = line.indexOf(". ");
-      if (line.startsWith("    ") && line.substring(4, didx).containsOnly("0123456789")) { line = "..... " + line.substring(didx+2); }
-      if (line.startsWith("   ") && line.substring(3, didx).containsOnly("0123456789")) { line = ".... " + line.substring(didx+2); }
-      if (line.startsWith("  ") && line.substring(2, didx).containsOnly("0123456789")) { line = "... " + line.substring(didx+2); }
-      if (line.startsWith(" ") && line.substring(1, didx).containsOnly("0123456789")) { line = ".. " + line.substring(didx+2); }
-      if (                       line.substring(0, didx).containsOnly("0123456789")) { line = ". " + line.substring(didx+2); }
-    }
-    
-    // replace links
-    while (line.contains("[[") && line.fromFirstOccurrenceOf("[[", false, false).contains("]]")) {
-      int idx1 = line.indexOf("[[");
-      int idx2 = line.indexOf(idx1, "]]");
-      String link = line.substring(idx1+2, idx2);
-      if (link.startsWith("http://") || link.startsWith("https://") || link.startsWith("mailto:")) {
-        if (link.contains("|")) {
-          line = line.substring(0, idx1) + link.upToFirstOccurrenceOf("|", false, false) + "[" + link.fromFirstOccurrenceOf("|", false, false) + "]" + line.substring(idx2+2);
-        } else {
-          line = line.substring(0, idx1) + link + line.substring(idx2+2);
+      Tile& tile = tiles.front();
+      if (tile.version != version || tile.bounds != bounds || tile.scale != scale) {
+        // ...paint the missing or outdated ones in physical pixels...
+        numMisses++;
+        int w = jmax(1, roundToInt(area.getWidth()*scale));
+        int h = jmax(1, roundToInt(area.getHeight()*scale));
+        tile.image = Image(Image::ARGB, w, h, true);
+        {
+          Graphics tg(tile.image);
+          tg.addTransform(AffineTransform::scale((float)w/area.getWidth(), (float)h/area.getHeight()));
+          tg.setOrigin(-area.getPosition());
+          paintFunction(tg);
         }
+        numBytes += (size_t)w*h*4 - tile.numBytes;
+        tile.numBytes = (size_t)w*h*4;
+        tile.version = version;
+        tile.bounds = bounds;
+        tile.scale = scale;
+      } else {
+        numHits++;
       }
+      // ...and blit them
+      Image image = tile.image;         // (keeps the image, in case the tile gets removed)
+      g.drawImageTransformed(image, AffineTransform::scale((float)area.getWidth()/image.getWidth(),
+                                                           (float)area.getHeight()/image.getHeight())
+                                    .translated((float)area.getX(), (float)area.getY()));
+      removeLeastRecentlyUsed();
     }
-    
-    // replace admonitions (only INFO and HINT, the other ones are identical)
-    if (line.startsWith("INFO: ")) { line = "NOTE: " + line.substring(6); }
-    if (line.startsWith("HINT: ")) { line = "TIP: " + line.substring(6); }
-
-    // add line
-    ad += line + (li<lines.size()-1?"\n":"");
   }
-  
-  // replace color markers (named colors only)
-  while (ad.contains("<c:") && ad.fromFirstOccurrenceOf("<c:", false, false).contains(">") && ad.fromFirstOccurrenceOf("<c:", false, false).fromFirstOccurrenceOf(">", false, false).contains("</c>")) {
-    int idx1 = ad.indexOf("<c:");
-    int idx2 = ad.indexOf(idx1, ">");
-    int idx3 = ad.indexOf(idx2, "</c>");
-    ad = ad.substring(0, idx1) + "[" + ad.substring(idx1+3, idx2) + "]#" + ad.substring(idx2+1,idx3) + "#" + ad.substring(idx3+4);
-  }
-  
-  return ad;
 }
 
+void BarelyMLDisplay::PaintCache::setMaxNumBytes(size_t maxBytes) {
+  maxNumBytes = maxBytes;
+  removeLeastRecentlyUsed();
+}
+
+void BarelyMLDisplay::PaintCache::clear() {
+  tiles.clear();
+  index.clear();
+  numBytes = 0;
+}
+
+void BarelyMLDisplay::PaintCache::removeLeastRecentlyUsed() {
+  // (the most recently used tile is always kept, it's being drawn)
+  while (numBytes > maxNumBytes && tiles.size() > 1) {
+    numBytes -= tiles.back().numBytes;
+    index.erase(tiles.back().key);
+    tiles.pop_back();
+  }
+}
 
 // MARK: - Block
 
-Colour BarelyMLDisplay::Block::parseHexColourStatic(String s, Colour defaultColour) {
-  if (s.startsWith("#")) {
-    s = s.substring(1);
-    // if we have 3 or 4 characters, expand by duplicating characters
-    if (s.length()==3 || s.length()==4) {
-      String expanded;
-      for (int i=0; i<s.length(); i++) {
-        expanded += s[i];
-        expanded += s[i];
-      }
-      s = expanded;
-    }
-    if (s.length()==6) { // also applies to duplicated 3 char string
-      s = String("FF")+s;
-    }
+void BarelyMLDisplay::Block::setNode(std::shared_ptr<const BarelyMLDocument> doc, int index) {
+  document = doc;
+  nodeIndex = index;
+  link = document->getText(getNode().link);
+}
+
+float BarelyMLDisplay::Block::getCachedHeightRequired(float width) {
+  for (auto& c : cachedHeights) {
+    if (c.width == width) { return c.height; }  // only ask the block for new widths...
   }
-  if (s.isEmpty()) {
-    return defaultColour;
-  } else {
-    return Colour::fromString(s);
+  CachedHeight& c = cachedHeights[(size_t)nextCachedHeight];
+  nextCachedHeight = (nextCachedHeight+1) % (int)cachedHeights.size();
+  c.height = getHeightRequired(width);  // ...and remember the result (instead of the oldest one)
+  c.width = width;
+  return c.height;
+}
+
+bool BarelyMLDisplay::Block::isHeightCached(float width) const {
+  for (auto& c : cachedHeights) {
+    if (c.width == width) { return true; }
+  }
+  return false;
+}
+
+void BarelyMLDisplay::Block::heightChanged() {
+  clearHeightCache();                     // measure again...
+  if (bmlDisplay) {
+    bmlDisplay->blockHeightChanged();     // ...and update the layout
   }
 }
 
-Colour BarelyMLDisplay::Block::parseHexColour(String s) {
-  return parseHexColourStatic(s, defaultColour);
+void BarelyMLDisplay::Block::paint(Graphics& g) {
+  if (bmlDisplay && bmlDisplay->paintCaching && isPaintCacheable()) {
+    bmlDisplay->paintCache.paint(g, paintId, paintVersion, getLocalBounds(), [this](Graphics& tg) { paintContent(tg); });
+  } else {
+    paintContent(g);                      // (e.g. in a Renderer, which has no display)
+  }
 }
 
-bool BarelyMLDisplay::Block::containsLink(String line) {
-  return line.contains("[[") && line.fromFirstOccurrenceOf("[[", false, false).contains("]]");
+void BarelyMLDisplay::Block::setHighlights(const Array<SearchMatch>& matches, int current) {
+  if (highlights.isEmpty() && matches.isEmpty()) { return; }
+  highlights.clearQuick();
+  for (auto& m : matches) { highlights.add(m.range); }
+  currentHighlight = current;
+  paintVersion++;                       // (paint again)
+  repaint();
 }
 
-String BarelyMLDisplay::Block::consumeLink(String line, String* link) {
-  // output either to Block's link or "link" argument
-  if (!link) { link = &this->link; }
-  int idx1 = line.indexOf("[[");
-  int idx2 = line.indexOf(idx1, "]]");
-  if (idx1>=0 && idx2>idx1) {
-    *link = line.substring(idx1+2, idx2);
-    if (link->contains("|")) {
-      String altText = link->fromFirstOccurrenceOf("|", false, false);
-      *link = link->upToFirstOccurrenceOf("|", false, false);
-      // if there's an image in the link...
-      if (altText.contains("{{") && altText.fromFirstOccurrenceOf("{{", false, false).contains("}}")) {
-        // ...return only the altText...
-        return line.substring(0, idx1) + altText + line.substring(idx2+2);
-      } else {
-        // ...otherwise, return highlighted text.
-        return line.substring(0, idx1) + "<c:linkcolour>*" + altText + "*</c>" + line.substring(idx2+2);
-      }
-    } else {
-      return line.substring(0, idx1) + "<c:linkcolour>*" + *link + "*</c>" + line.substring(idx2+2);
+void BarelyMLDisplay::Block::drawHighlights(Graphics& g, CachedTextLayout& t, Rectangle<float> area) {
+  for (int i=0; i<highlights.size(); i++) {
+    g.setColour(i == currentHighlight ? style->currentHighlight : style->highlight);
+    for (auto& r : t.getRangeBounds(highlights[i], area.getWidth())) {
+      g.fillRect(r + area.getPosition());
     }
-  } else {
-    *link = "";
-    return line;
   }
 }
 
+void BarelyMLDisplay::Block::requestPendingImages(AsyncFileSource* fs, DrawableCache& cache) {
+  if (fs == nullptr) { return; }
+  Component::SafePointer<Block> safeThis(this);
+  for (auto& filename : pendingImages) {
+    cache.loadDrawableAsync(fs, filename, [safeThis, filename] (std::shared_ptr<const Drawable> d) {
+      if (safeThis) { safeThis->drawableLoaded(filename, d); } // (unless the block has been deleted)
+    });
+  }
+  pendingImages.clear();
+}
+
 void BarelyMLDisplay::Block::mouseDown(const MouseEvent& event) {
   mouseDownPosition = event.position;     // keep track of position
 }
@@ -752,192 +3710,149 @@ void BarelyMLDisplay::Block::mouseUp(const MouseEvent& event) {
   }
 }
 
-AttributedString BarelyMLDisplay::Block::parsePureText(const StringArray& lines, Font font, bool addNewline)
+AttributedString BarelyMLDisplay::Block::createAttributedString(int firstRun, int numRuns, Font font)
 {
-  AttributedString attributedString;
-  
-  String currentLine;
-  currentColour = defaultColour;
-  
-  bool bold = false;
-  bool italic = false;
+  return createAttributedString(*document, *style, firstRun, numRuns, font);
+}
+
+std::shared_ptr<const AttributedString> BarelyMLDisplay::Block::getSharedAttributedString(int firstRun, int numRuns, bool bold)
+{
+  return getSharedAttributedString(*document, nodeIndex, *style, firstRun, numRuns, bold);
+}
+
+AttributedString BarelyMLDisplay::Block::createAttributedString(const BarelyMLDocument& doc, const Style& style,
+                                                                int firstRun, int numRuns, Font font)
+{
+  // relative font sizes for heading levels 1-5
+  static const float headingScale[] = { 1.0f, 2.1f, 1.7f, 1.42f, 1.25f, 1.1f };
   
-  for (auto line : lines)
-  {
-    line = line.replace("\\\\", "\n");
-    if (line.startsWith("##### "))
-    {
-      attributedString.append(parsePureText(line.substring(6), font.boldened().withHeight(font.getHeight()*1.1f),false));
-    }
-    else if (line.startsWith("#### "))
-    {
-      attributedString.append(parsePureText(line.substring(5), font.boldened().withHeight(font.getHeight()*1.25f),false));
-    }
-    else if (line.startsWith("### "))
-    {
-      attributedString.append(parsePureText(line.substring(4), font.boldened().withHeight(font.getHeight()*1.42f),false));
-    }
-    else if (line.startsWith("## "))
-    {
-      attributedString.append(parsePureText(line.substring(3), font.boldened().withHeight(font.getHeight()*1.7f),false));
-    }
-    else if (line.startsWith("# "))
-    {
-      attributedString.append(parsePureText(line.substring(2), font.boldened().withHeight(font.getHeight()*2.1f),false));
-    }
-    else
-    {
-      while (line.isNotEmpty()) {
-        bool needsNewFont = false;
-        // find first token to interpret
-        int bidx = line.indexOf("*");
-        int iidx = line.indexOf("_");
-        int tidx = line.indexOf("<");
-        Colour nextColour = currentColour;
-        if (bidx > -1 && (bidx < iidx | iidx == -1) && (bidx < tidx | tidx == -1)) {
-          // if the next token is toggling the bold state...
-          // ...first add everything up to the token...
-          attributedString.append(line.substring(0, bidx), font, currentColour);
-          line = line.substring(bidx+1); // ...then drop up to and including the token...
-          bold = !bold;                  // ...toggle the bold status...
-          needsNewFont = true;           // ...and request new font.
-        } else if (iidx > -1 && (iidx < tidx | tidx == -1)) {
-          // if the next token is toggling the italic state...
-          // ...first add everything up to the token...
-          attributedString.append(line.substring(0, iidx), font, currentColour);
-          line = line.substring(iidx+1); // ...then drop up to and including the token...
-          italic = !italic;              // ...toggle the italic status...
-          needsNewFont = true;           // ...and request new font.
-        } else if (tidx > -1) {
-          // if the next token is a tag, first figure out if it is a recognized tag...
-          String tag;
-          bool tagRecognized = false;
-          // find tag end
-          int tidx2 = line.indexOf(tidx, ">");
-          if (tidx2>tidx) {
-            tag = line.substring(tidx+1, tidx2);
-          }
-          if (tag.startsWith("c#")) {
-            // hex colour tag
-            nextColour = parseHexColour(tag.substring(1));
-            tagRecognized = true;
-          } else if (tag.startsWith("c:")) {
-            // named colour tag
-            String name = tag.substring(2);
-            if (colours != nullptr && colours->containsKey(name)) {
-              nextColour = parseHexColour((*colours)[name]);
-            }
-            tagRecognized = true;
-          } else if (tag.startsWith("/c")) {
-            // end of colour tag
-            nextColour = defaultColour;
-            tagRecognized = true;
-          }
-          if (tagRecognized) {
-            // ...first add everything up to the tag...
-            attributedString.append(line.substring(0, tidx), font, currentColour);
-            // ...then drop up to and including the tag.
-            line = line.substring(tidx2+1);
-          } else {
-            // ...first add everything up to and including the token...
-            attributedString.append(line.substring(0, tidx+1), font, currentColour);
-            // ...then drop it.
-            line = line.substring(tidx+1);
-          }
-        } else {
-          // if no token was found -> add the remaining text...
-          attributedString.append(line, font, currentColour);
-          // ...and clear the line.
-          line.clear();
-        }
-        currentColour = nextColour;
-        if (needsNewFont) {
-          font = font.withStyle(Font::plain);
-          if (bold) { font = font.boldened(); }
-          if (italic) { font = font.italicised(); }
-        }
+  AttributedString attributedString;
+  for (int i=firstRun; i<firstRun+numRuns; i++) {
+    const BarelyMLDocument::Run& run = doc.runs[(size_t)i];
+    Font f = run.heading > 0 ? font.withHeight(font.getHeight()*headingScale[run.heading]) : font;
+    if (run.flags & BarelyMLDocument::bold) { f = f.boldened(); }
+    if (run.flags & BarelyMLDocument::italic) { f = f.italicised(); }
+    attributedString.append(doc.getText(run.text), f, resolveColour(doc, style, run.colour));
+  }
+  return attributedString;
+}
+
+std::shared_ptr<const AttributedString> BarelyMLDisplay::Block::getSharedAttributedString(const BarelyMLDocument& doc, int nodeIndex, const Style& style,
+                                                                                         int firstRun, int numRuns, bool bold)
+{
+  // blocks with the same markup have the same runs, so runs are identified by the block's hash
+  // and their index relative to the block's first run (or its first cell's)
+  const BarelyMLDocument::BlockNode& node = doc.blocks[(size_t)nodeIndex];
+  int base = node.firstRun;
+  if (node.type == BarelyMLDocument::tableBlock) {
+    base = node.numRows > 0 ? doc.cells[(size_t)doc.rows[(size_t)node.firstRow].firstCell].firstRun : 0;
+  }
+  SharedText::Key key = { node.hash, firstRun-base, numRuns, bold, style.textHash };
+  auto isSame = [&](const AttributedString& s) {
+    // the string must consist of exactly the runs' text (in the document's text arena)
+    const String& t = s.getText();
+    const char* p = t.toRawUTF8();
+    size_t n = t.getNumBytesAsUTF8();
+    size_t pos = 0;
+    for (int i=firstRun; i<firstRun+numRuns; i++) {
+      const BarelyMLDocument::TextRange& r = doc.runs[(size_t)i].text;
+      if (pos + (size_t)r.length > n || memcmp(p + pos, doc.text.data() + r.start, (size_t)r.length) != 0) {
+        return false;
       }
+      pos += (size_t)r.length;
     }
-    
-    if (addNewline) {
-      attributedString.append(" \n", font, defaultColour);
+    return pos == n;
+  };
+  return SharedText::get(key, isSame, [&] {
+    return createAttributedString(doc, style, firstRun, numRuns, bold ? style.font.boldened() : style.font);
+  });
+}
+
+Colour BarelyMLDisplay::Block::resolveColour(const BarelyMLDocument& doc, const Style& style, int colour)
+{
+  while (colour > 0) {
+    const BarelyMLDocument::ColourRef& c = doc.colours[(size_t)colour];
+    if (c.kind == BarelyMLDocument::ColourRef::hexColour) {        // hex colour
+      return Colour(c.argb);
     }
+    int index = style.palette.indexOf(doc.colourNames[c.name]);
+    if (c.kind == BarelyMLDocument::ColourRef::namedColour && index >= 0) {
+      return style.palette[index];                                 // known colour name
+    }
+    colour = c.fallback;                                           // unknown name -> fallback
   }
-  return attributedString;
+  return style.palette.getColour("default", Colours::black);      // (the block's defaultColour)
 }
 
 // MARK: - Text Block
 
-void BarelyMLDisplay::TextBlock::parseMarkup(const StringArray& lines, Font font) {
-  attributedString = parsePureText(lines, font);
+void BarelyMLDisplay::TextBlock::applyStyle() {
+  Block::applyStyle();
+  text.setText(getSharedAttributedString(getNode().firstRun, getNode().numRuns));
 }
 
 float BarelyMLDisplay::TextBlock::getHeightRequired(float width) {
-  TextLayout layout;
-  layout.createLayout(attributedString, width);
-  return layout.getHeight();
+  return text.getHeight(width);
 }
 
-void BarelyMLDisplay::TextBlock::paint(juce::Graphics& g) {
-  attributedString.draw(g, getLocalBounds().toFloat());
+float BarelyMLDisplay::TextBlock::estimateHeightRequired(float width) {
+  return text.estimateHeight(width);
 }
 
-// MARK: - Admonition Block
+Array<Rectangle<float>> BarelyMLDisplay::TextBlock::getMatchBounds(const SearchMatch& m, int width) {
+  return text.getRangeBounds(m.range, (float)width);
+}
 
-bool BarelyMLDisplay::AdmonitionBlock::isAdmonitionLine(const String& line) {
-  return line.startsWith("INFO: ") || line.startsWith("HINT: ") || line.startsWith("IMPORTANT: ") || line.startsWith("CAUTION: ") || line.startsWith("WARNING: ");
+void BarelyMLDisplay::TextBlock::paintContent(juce::Graphics& g) {
+  drawHighlights(g, text, getLocalBounds().toFloat());
+  text.draw(g, getLocalBounds().toFloat());
 }
 
-void BarelyMLDisplay::AdmonitionBlock::parseAdmonitionMarkup(const String& line, Font font, int iconsize, int margin, int linewidth) {
-  if (line.startsWith("INFO: ")) { type = info; }
-  else if (line.startsWith("HINT: ")) { type = hint; }
-  else if (line.startsWith("IMPORTANT: ")) { type = important; }
-  else if (line.startsWith("CAUTION: ")) { type = caution; }
-  else if (line.startsWith("WARNING: ")) { type = warning; }
-  attributedString = parsePureText(line.fromFirstOccurrenceOf(": ", false, false), font);
-  this->iconsize = iconsize;
-  this->margin = margin;
-  this->linewidth = linewidth;
+// MARK: - Admonition Block
+
+void BarelyMLDisplay::AdmonitionBlock::applyStyle() {
+  Block::applyStyle();
+  text.setText(getSharedAttributedString(getNode().firstRun, getNode().numRuns));
+  // look up colour
+  switch (getNode().admonition) {
+    case BarelyMLDocument::info:      colour = style->palette.getColour("blue", defaultColour);   break;
+    case BarelyMLDocument::hint:      colour = style->palette.getColour("green", defaultColour);  break;
+    case BarelyMLDocument::important: colour = style->palette.getColour("red", defaultColour);    break;
+    case BarelyMLDocument::caution:   colour = style->palette.getColour("yellow", defaultColour); break;
+    case BarelyMLDocument::warning:   colour = style->palette.getColour("orange", defaultColour); break;
+  }
+  iconsize = style->iconsize;
+  margin = style->admargin;
+  linewidth = style->adlinewidth;
 }
 
 float BarelyMLDisplay::AdmonitionBlock::getHeightRequired(float width) {
-  TextLayout layout;
-  layout.createLayout(attributedString, width-iconsize-2*(margin+linewidth));
-  return jmax(layout.getHeight(),(float)iconsize);
+  return jmax(text.getHeight(width-iconsize-2*(margin+linewidth)),(float)iconsize);
 }
 
-void BarelyMLDisplay::AdmonitionBlock::paint(juce::Graphics& g) {
-  // select colour
-  switch (type) {
-    case info:
-      g.setColour(parseHexColour((*colours)["blue"]));
-      break;
-      
-    case hint:
-      g.setColour(parseHexColour((*colours)["green"]));
-      break;
-      
-    case important:
-      g.setColour(parseHexColour((*colours)["red"]));
-      break;
-      
-    case caution:
-      g.setColour(parseHexColour((*colours)["yellow"]));
-      break;
-      
-    case warning:
-      g.setColour(parseHexColour((*colours)["orange"]));
-      break;
-  }
+float BarelyMLDisplay::AdmonitionBlock::estimateHeightRequired(float width) {
+  return jmax(text.estimateHeight(width-iconsize-2*(margin+linewidth)),(float)iconsize);
+}
+
+void BarelyMLDisplay::AdmonitionBlock::paintContent(juce::Graphics& g) {
+  g.setColour(colour);
   // draw tab
   g.fillRect(Rectangle<int>(0,0,iconsize,iconsize));
   // draw lines left and right
   g.fillRect(Rectangle<int>(iconsize,0,linewidth,getHeight()));
   g.fillRect(Rectangle<int>(getWidth()-linewidth,0,linewidth,getHeight()));
-  attributedString.draw(g, Rectangle<float>(iconsize+margin+linewidth,
-                                          0,
-                                          getWidth()-iconsize-2*(margin+linewidth),
-                                          getHeight()));
+  Rectangle<float> area = Rectangle<float>(iconsize+margin+linewidth,
+                                           0,
+                                           getWidth()-iconsize-2*(margin+linewidth),
+                                           getHeight());
+  drawHighlights(g, text, area);
+  text.draw(g, area);
+}
+
+Array<Rectangle<float>> BarelyMLDisplay::AdmonitionBlock::getMatchBounds(const SearchMatch& m, int width) {
+  Array<Rectangle<float>> bounds = text.getRangeBounds(m.range, (float)(width-iconsize-2*(margin+linewidth)));
+  for (auto& r : bounds) { r.translate((float)(iconsize+margin+linewidth), 0.f); }
+  return bounds;
 }
 
 
@@ -948,130 +3863,288 @@ BarelyMLDisplay::TableBlock::TableBlock() {
   viewport.setViewedComponent(&table, false); // we manage the content component
   viewport.setScrollBarsShown(false, false, false, true); // scroll only horizontally
   viewport.setScrollOnDragMode(Viewport::ScrollOnDragMode::nonHover);
+  table.paintId = PaintCache::createId();
+  table.paintVersion = 0;
 }
 
-bool BarelyMLDisplay::TableBlock::isTableLine(const String& line) {
-  return line.startsWith("^") || line.startsWith("|");
-}
-
-void BarelyMLDisplay::TableBlock::parseMarkup(const StringArray& lines, Font font) {
-  // read cells
-  table.cells.clear();
+void BarelyMLDisplay::TableBlock::loadImages(FileSource* fileSource, DrawableCache& cache) {
+  // set up cells (see CellMetrics)
   table.setBMLDisplay(bmlDisplay);
-  for (auto line : lines) {
-    // find all cells in this line
-    OwnedArray<Cell>* row = new OwnedArray<Cell>();
-    while (line.containsAnyOf("^|")) {
-      bool isHeader = line.startsWith("^");
-      line = line.substring(1);                     // remove left delimiter
-      int nextDelimiter = line.indexOfAnyOf("^|");  // find right delimiter
-      if (nextDelimiter>=0) {                       // no delimiter found -> we're done with this line
-        String rawString = line.substring(0, nextDelimiter);
-        // fix delimiter if we have broken apart a link
-        if (rawString.contains("[[") && !rawString.contains("]]") && line.contains("]]")) {
-          int linkEnd = line.indexOf("]]");
-          int idx1 = line.indexOf(linkEnd, "|");
-          int idx2 = line.indexOf(linkEnd, "^");
-          nextDelimiter = linkEnd;
-          if (idx1>=0 && (idx2<0 || idx1<idx2)) { nextDelimiter = idx1; }
-          if (idx2>=0 && (idx1<0 || idx2<idx1)) { nextDelimiter = idx2; }
-          rawString = line.substring(0, nextDelimiter);
-        }
-        line = line.substring(nextDelimiter);         // drop everything up to right delimiter
-        // TODO: use the number of whitespace characters on either side of rawString to determine justification
-        // TODO: implement || -> previous cell spans two columns
-        // check for link
-        String trimmed = rawString.trim();
-        String cellLink;
-        if (trimmed.contains("[[") && trimmed.fromFirstOccurrenceOf("[[", false, false).contains("]]")) {
-          trimmed = consumeLink(trimmed, &cellLink);
-        }
-        // check for image
-        int width = -1;
-        std::unique_ptr<Drawable> drawable;
-        if (trimmed.startsWith("{{") && trimmed.endsWith("}}")) {
-          String filename = trimmed.fromFirstOccurrenceOf("{{", false, false).upToFirstOccurrenceOf("}}", false, false);
-          if (filename.contains("?")) {
-            width = filename.fromFirstOccurrenceOf("?", false, false).getIntValue();
-            filename = filename.upToFirstOccurrenceOf("?", false, false);
-          }
-          if (fileSource) {
-            drawable = fileSource->getDrawableForFilename(filename);
-            if (!drawable) {
-              trimmed += String(" File not found.");
+  table.rowStarts.clearQuick();
+  table.metrics.clearQuick();
+  table.cellImages.clearQuick();
+  table.images.clearQuick();
+  table.highlights.clearQuick();
+  const BarelyMLDocument::BlockNode& node = getNode();
+  int numCells = 0;
+  for (int i=node.firstRow; i<node.firstRow+node.numRows; i++) {
+    numCells += document->rows[(size_t)i].numCells;
+  }
+  table.rowStarts.ensureStorageAllocated(node.numRows+1);
+  table.metrics.ensureStorageAllocated(numCells);
+  table.texts.clear();                      // (the strings are set by applyStyle)
+  table.texts.resize((size_t)numCells);
+  std::unordered_map<int64, int> imageIndex; // images by filename hash
+  for (int i=node.firstRow; i<node.firstRow+node.numRows; i++) {
+    const BarelyMLDocument::Row& r = document->rows[(size_t)i];
+    table.rowStarts.add(table.metrics.size());
+    for (int j=r.firstCell; j<r.firstCell+r.numCells; j++) {
+      const BarelyMLDocument::Cell& c = document->cells[(size_t)j];
+      CellMetrics m = { 0.f, 0.f, -1, c.isHeader };
+      if (!c.image.isEmpty()) {             // image cell: find the image, or load it
+        String filename = document->getText(c.image);
+        auto it = imageIndex.find(filename.hashCode64());
+        int image = it != imageIndex.end() && table.images.getReference(it->second).filename == filename ? it->second : -1;
+        if (image < 0) {
+          TableImage im = { filename, nullptr, false, {} };
+          if (dynamic_cast<AsyncFileSource*>(fileSource)) {
+            // take it from the cache, or load it asynchronously (see requestPendingImages)
+            im.drawable = cache.findDrawable(fileSource, filename);
+            if (!im.drawable) {
+              im.pending = true;
+              pendingImages.addIfNotAlreadyThere(filename);
+            }
+          } else if (fileSource) {
+            im.drawable = cache.getDrawable(fileSource, filename);
+            if (!im.drawable) {
+              im.missingText = " File not found.";
             }
           } else {
-            trimmed += String(" No file source.");
+            im.missingText = " No file source.";
           }
+          image = table.images.size();
+          table.images.add(im);
+          imageIndex[filename.hashCode64()] = image;
         }
-        AttributedString attributedString = parsePureText(trimmed, isHeader?font.boldened():font);
-        TextLayout layout;
-        layout.createLayout(attributedString, 1.0e7f);
-        if (width>0 && drawable && drawable->getDrawableBounds().getWidth()>0.f) {
-          float w = drawable->getDrawableBounds().getWidth();
-          float h = drawable->getDrawableBounds().getHeight();
-          row->add(new Cell {attributedString, std::move(drawable), cellLink, isHeader, (float)width, width*h/w});
-        } else {
-          row->add(new Cell {attributedString, std::move(drawable), cellLink, isHeader, layout.getWidth(), layout.getHeight()});
-        }
+        m.image = table.cellImages.size();
+        table.cellImages.add({ image, {} });
       }
+      table.metrics.add(m);
     }
-    table.cells.add(row);
   }
-  // compute column widths
-  table.columnwidths.clear();
-  for (int i=0; i<table.cells.size(); i++) {
-    OwnedArray<Cell>* row = table.cells[i];
-    for (int j=0; j<row->size(); j++) {
-      if (j<table.columnwidths.size()) {
-        table.columnwidths.set(j, jmax(table.columnwidths[j],(*row)[j]->width));
+  table.rowStarts.add(table.metrics.size());
+}
+
+void BarelyMLDisplay::TableBlock::drawableLoaded(const String& filename, std::shared_ptr<const Drawable> d) {
+  bool changed = false;
+  for (auto& im : table.images) {
+    if (im.pending && im.filename == filename) { // for the cells waiting for this image...
+      im.pending = false;
+      im.drawable = d;                      // ...set it...
+      if (!d) {
+        im.missingText = " File not found.";
+      }
+      changed = true;
+    }
+  }
+  if (changed && style) {
+    applyStyle();                           // ...and measure the table again.
+    heightChanged();
+  }
+}
+
+void BarelyMLDisplay::TableBlock::applyStyle() {
+  Block::applyStyle();
+  table.bg = style->tableBG;
+  table.bgHeader = style->tableBGHeader;
+  table.placeholder = defaultColour.withAlpha(0.1f);
+  table.cellmargin = style->tableMargin;
+  table.cellgap = style->tableGap;
+  table.leftmargin = style->margin;
+  table.rasterizeImages = style->rasterizeImages;
+  table.highlight = style->highlight;
+  table.currentHighlight = style->currentHighlight;
+  // create attributed strings and measure cells
+  const BarelyMLDocument::BlockNode& node = getNode();
+  for (int i=0; i<table.getNumRows(); i++) {
+    const BarelyMLDocument::Row& r = document->rows[(size_t)(node.firstRow+i)];
+    for (int j=0; j<r.numCells; j++) {
+      const BarelyMLDocument::Cell& c = document->cells[(size_t)(r.firstCell+j)];
+      int k = table.rowStarts[i]+j;
+      CellMetrics& m = table.metrics.getReference(k);
+      CachedTextLayout& text = table.texts[(size_t)k];
+      const TableImage* im = table.getImage(k);
+      Font font = m.isHeader?style->font.boldened():style->font;
+      if (im && im->missingText.isNotEmpty()) {
+        // insert message before the trailing newline
+        AttributedString ms = createAttributedString(c.firstRun, c.numRuns-1, font);
+        ms.append(im->missingText, font, defaultColour);
+        ms.append(createAttributedString(c.firstRun+c.numRuns-1, 1, font));
+        text.setText(ms);
       } else {
-        table.columnwidths.set(j, (*row)[j]->width);
+        text.setText(getSharedAttributedString(c.firstRun, c.numRuns, m.isHeader));
+      }
+      if (im && c.imageWidth>0 && im->drawable && im->drawable->getDrawableBounds().getWidth()>0.f) {
+        float w = im->drawable->getDrawableBounds().getWidth();
+        float h = im->drawable->getDrawableBounds().getHeight();
+        m.width = (float)c.imageWidth;
+        m.height = c.imageWidth*h/w;
+      } else if (im && im->pending) {
+        // placeholder while loading (square, as we don't know the aspect ratio yet)
+        m.width = m.height = (float)(c.imageWidth>0 ? c.imageWidth : style->font.getHeight());
+      } else {                          // (measured once for all identical cells)
+        Point<float> size = SharedLayout::getNaturalSize(text.getTextKey(), text.getSharedText(), [&] {
+          Point<float> p;
+          measureText(text.getText(), p.x, p.y);
+          return p;
+        });
+        m.width = size.x;
+        m.height = size.y;
       }
     }
   }
-  // compute row heights
-  table.rowheights.clear();
-  for (int i=0; i<table.cells.size(); i++) {
-    OwnedArray<Cell>* row = table.cells[i];
+  // compute column widths and row heights (in one sweep over the cells)
+  table.columnwidths.clearQuick();
+  table.rowheights.clearQuick();
+  for (int i=0; i<table.getNumRows(); i++) {
     float rowheight = 0;
-    for (int j=0; j<row->size(); j++) {
-      rowheight = jmax(rowheight,(*row)[j]->height);
+    for (int k=table.rowStarts[i]; k<table.rowStarts[i+1]; k++) {
+      const CellMetrics& m = table.metrics.getReference(k);
+      int j = k-table.rowStarts[i];
+      if (j<table.columnwidths.size()) {
+        table.columnwidths.set(j, jmax(table.columnwidths[j], m.width));
+      } else {
+        table.columnwidths.add(m.width);
+      }
+      rowheight = jmax(rowheight, m.height);
     }
-    table.rowheights.set(i, rowheight);
+    table.rowheights.add(rowheight);
   }
+  table.computeOffsets();
   table.setBounds(0, 0, getWidthRequired()+table.leftmargin+table.cellgap, getHeightRequired(0.f));
+  table.paintVersion++;
+  table.repaint();
 }
 
-float BarelyMLDisplay::TableBlock::getWidthRequired() {
-  float width = 0;
-  for (int i=0; i<table.columnwidths.size(); i++) {
-    width += table.columnwidths[i] + 2 * table.cellmargin + table.cellgap;
+void BarelyMLDisplay::TableBlock::measureText(const AttributedString& s, float& width, float& height) {
+  // Measures the natural size of unwrapped text line by line, which is much cheaper than
+  // laying it out (cells are only laid out once, for their column width, when painted).
+  const String& text = s.getText();
+  width = height = 0.f;
+  float lineWidth = 0.f;
+  float lineHeight = 0.f;
+  for (int i=0; i<s.getNumAttributes(); i++) {
+    const AttributedString::Attribute& a = s.getAttribute(i);
+    int start = a.range.getStart();
+    while (start < a.range.getEnd()) {
+      int newline = text.indexOfChar(start, '\n');
+      bool endOfLine = newline >= 0 && newline < a.range.getEnd();
+      int end = endOfLine ? newline : a.range.getEnd();
+      lineWidth += a.font.getStringWidthFloat(text.substring(start, end));
+      lineHeight = jmax(lineHeight, a.font.getHeight());
+      if (endOfLine) {
+        width = jmax(width, lineWidth);
+        height += lineHeight;
+        lineWidth = lineHeight = 0.f;
+        end++;
+      }
+      start = end;
+    }
   }
-  return width - table.cellgap;
+  if (lineWidth > 0.f) {                // last line without newline
+    width = jmax(width, lineWidth);
+    height += lineHeight;
+  }
+  width = std::ceil(width) + 1.f;       // (rounding errors mustn't lead to wrapped lines)
+}
+
+float BarelyMLDisplay::TableBlock::getWidthRequired() {
+  if (table.columnoffsets.isEmpty()) { return 0.f; } // not styled yet
+  return table.columnoffsets.getLast() - table.leftmargin - table.cellgap;
 }
 
 float BarelyMLDisplay::TableBlock::getHeightRequired(float width) {
   // NOTE: We're ignoring width - the idea is that tables can be scrolled horizontally if necessary
-  float height = 0;
-  for (int i=0; i<table.rowheights.size(); i++) {
-    height += table.rowheights[i] + 2 * table.cellmargin + table.cellgap;
+  if (table.rowoffsets.isEmpty()) { return 0.f; }    // not styled yet
+  return table.rowoffsets.getLast() - table.cellgap;
+}
+
+void BarelyMLDisplay::TableBlock::setHighlights(const Array<SearchMatch>& matches, int current) {
+  Block::setHighlights(matches, current);
+  // pass the matches on to their cells (cells are counted row by row, like in table.metrics)
+  table.highlights.clearQuick();
+  for (int i=0; i<matches.size(); i++) {
+    const SearchMatch& m = matches.getReference(i);
+    if (m.cell >= 0 && m.cell < table.metrics.size()) {
+      table.highlights.add({ m.cell, m.range, i == current });
+    }
+  }
+  std::stable_sort(table.highlights.begin(), table.highlights.end(),
+                   [](const CellHighlight& a, const CellHighlight& b) { return a.cell < b.cell; });
+  table.paintVersion++;
+  table.repaint();
+}
+
+Array<Rectangle<float>> BarelyMLDisplay::TableBlock::getMatchBounds(const SearchMatch& m, int) {
+  int c = m.cell;
+  if (c < 0 || c >= table.metrics.size()) { return {}; }
+  auto it = std::upper_bound(table.rowStarts.begin(), table.rowStarts.end(), c);
+  int i = (int)(it - table.rowStarts.begin()) - 1;
+  int j = c - table.rowStarts[i];
+  // (cells are laid out for their column width, see Table::paintCells)
+  Array<Rectangle<float>> bounds = table.texts[(size_t)c].getRangeBounds(m.range, table.columnwidths[j]);
+  for (auto& r : bounds) {
+    r.translate(table.columnoffsets[j]+table.cellmargin - viewport.getViewPositionX(), table.rowoffsets[i]+table.cellmargin);
   }
-  return height-table.cellgap;
+  return bounds;
+}
+
+String BarelyMLDisplay::TableBlock::getCellLink(int row, int column) const {
+  const BarelyMLDocument::Row& r = document->rows[(size_t)(getNode().firstRow+row)];
+  return document->getText(document->cells[(size_t)(r.firstCell+column)].link);
 }
 
 void BarelyMLDisplay::TableBlock::resized() {
   viewport.setBounds(getLocalBounds());
 }
 
+void BarelyMLDisplay::TableBlock::Table::computeOffsets() {
+  // prefix sums of the column widths and row heights (incl. margins and gaps), with one extra
+  // entry at the end for the right/bottom edge of the table (plus one gap)
+  columnoffsets.clearQuick();
+  float x = leftmargin;
+  columnoffsets.add(x);
+  for (auto w : columnwidths) {
+    x += w + 2 * cellmargin + cellgap;
+    columnoffsets.add(x);
+  }
+  rowoffsets.clearQuick();
+  float y = 0.f;
+  rowoffsets.add(y);
+  for (auto h : rowheights) {
+    y += h + 2 * cellmargin + cellgap;
+    rowoffsets.add(y);
+  }
+}
+
+int BarelyMLDisplay::TableBlock::Table::findIndex(const Array<float>& offsets, float pos) {
+  // index of the last offset <= pos (i.e. the column/row at pos), -1 if pos is before the first one
+  auto it = std::upper_bound(offsets.begin(), offsets.end(), pos);
+  return (int)(it - offsets.begin()) - 1;
+}
+
 void BarelyMLDisplay::TableBlock::Table::paint(juce::Graphics& g) {
-  float y = 0.f;    // Y coordinate of cell's top left corner
-  for (int i=0; i<cells.size(); i++) {
-    float x = leftmargin;  // X coordinate of cell's top left corner
-    OwnedArray<Cell>* row = cells[i]; // get current row
-    for (int j=0; j<row->size(); j++) {
-      Cell* c = (*row)[j];            // get current cell
-      if (c->isHeader) {               // if it's a header cell...
+  if (bmlDisplay && bmlDisplay->paintCaching) {
+    bmlDisplay->paintCache.paint(g, paintId, paintVersion, getLocalBounds(), [this](Graphics& tg) { paintCells(tg); });
+  } else {
+    paintCells(g);
+  }
+}
+
+void BarelyMLDisplay::TableBlock::Table::paintCells(juce::Graphics& g) {
+  if (rowoffsets.size() < 2) { return; }
+  // only draw the cells which intersect the clip region
+  Rectangle<int> clip = g.getClipBounds();
+  int firstRow = jmax(0, findIndex(rowoffsets, (float)clip.getY()));
+  int firstColumn = jmax(0, findIndex(columnoffsets, (float)clip.getX()));
+  for (int i=firstRow; i<getNumRows() && rowoffsets[i]<clip.getBottom(); i++) {
+    float y = rowoffsets[i];          // Y coordinate of cell's top left corner
+    int numCells = getNumCells(i);
+    for (int j=firstColumn; j<numCells && columnoffsets[j]<clip.getRight(); j++) {
+      float x = columnoffsets[j];     // X coordinate of cell's top left corner
+      int k = rowStarts[i]+j;         // index of current cell
+      const CellMetrics& m = metrics.getReference(k);
+      if (m.isHeader) {               // if it's a header cell...
         g.setColour(bgHeader);        // ...set header background colour
       } else {                        // otherwise...
         g.setColour(bg);              // ...set regular background colour
@@ -1079,44 +4152,56 @@ void BarelyMLDisplay::TableBlock::Table::paint(juce::Graphics& g) {
       // fill background
       g.fillRect(x, y, columnwidths[j] + 2 * cellmargin, rowheights[i] + 2 * cellmargin);
       Rectangle<float> destArea = Rectangle<float>(x+cellmargin, y+cellmargin, columnwidths[j], rowheights[i]);
-      if (c->drawable) {
+      const TableImage* im = getImage(k);
+      if (im && im->pending) {
+        // draw placeholder
+        g.setColour(placeholder);
+        g.fillRect(destArea);
+      } else if (im && im->drawable) {
         // draw drawable
-        c->drawable->drawWithin(g, destArea, RectanglePlacement::centred, 1.0f);
+        if (rasterizeImages) {
+          cellImages.getReference(m.image).rasterized.draw(g, *im->drawable, destArea);
+        } else {
+          im->drawable->drawWithin(g, destArea, RectanglePlacement::centred, 1.0f);
+        }
       } else {
-        // draw cell text
-        c->s.draw(g, destArea);
+        // draw search highlights and cell text
+        CachedTextLayout& text = texts[(size_t)k];
+        auto h = std::lower_bound(highlights.begin(), highlights.end(), k,
+                                  [](const CellHighlight& a, int cell) { return a.cell < cell; });
+        for (; h != highlights.end() && h->cell == k; h++) {
+          g.setColour(h->isCurrent ? currentHighlight : highlight);
+          for (auto& r : text.getRangeBounds(h->range, destArea.getWidth())) {
+            g.fillRect(r + destArea.getPosition());
+          }
+        }
+        text.draw(g, destArea);       // (laid out once for the column width)
       }
-      // move one cell to the right
-      x += columnwidths[j] + 2 * cellmargin + cellgap;
     }
-    // move to next row (note: x will be reset at next loop iteration)
-    y += rowheights[i] + 2 * cellmargin + cellgap;
   }
 }
 
+BarelyMLDisplay::TableBlock::TableImage* BarelyMLDisplay::TableBlock::Table::getImage(int cell) {
+  int i = metrics.getReference(cell).image;
+  return i < 0 ? nullptr : &images.getReference(cellImages.getReference(i).image);
+}
+
 void BarelyMLDisplay::TableBlock::Table::mouseDown(const MouseEvent& event) {
   mouseDownPosition = event.position;     // keep track of position
 }
 
 void BarelyMLDisplay::TableBlock::Table::mouseUp(const MouseEvent& event) {
   String link;
-  // find link for mouseDownPosition
+  // find cell at mouseDownPosition (ignoring the gaps between cells)...
   float mdy = mouseDownPosition.y;
   float mdx = mouseDownPosition.x;
-  float y = 0.f;                    // Y coordinate of row's top edge
-  for (int i=0; i<cells.size(); i++) {
-    if (mdy>=y && mdy<y+rowheights[i] + 2 * cellmargin) {
-      float x = leftmargin;         // X coordinate of cell's left edge
-      for (int j=0; j<cells[i]->size(); j++) {
-        if (mdx>=x && mdx<x+columnwidths[j] + 2 * cellmargin) {
-          link = (*cells[i])[j]->link;
-        }
-        // move one cell to the right
-        x += columnwidths[j] + 2 * cellmargin + cellgap;
-      }
+  int i = findIndex(rowoffsets, mdy);
+  int j = findIndex(columnoffsets, mdx);
+  if (i >= 0 && i < getNumRows() && mdy < rowoffsets[i] + rowheights[i] + 2 * cellmargin &&
+      j >= 0 && j < getNumCells(i) && mdx < columnoffsets[j] + columnwidths[j] + 2 * cellmargin) {
+    if (auto tb = findParentComponentOfClass<TableBlock>()) {
+      link = tb->getCellLink(i, j); // ...and get its link
     }
-    // move to next row
-    y += rowheights[i] + 2 * cellmargin + cellgap;
   }
   if (link.isNotEmpty()) {          // if we have a link...
     float distance = event.position.getDistanceFrom(mouseDownPosition);
@@ -1130,30 +4215,51 @@ void BarelyMLDisplay::TableBlock::Table::mouseUp(const MouseEvent& event) {
 
 
 // MARK: - Image Block
-bool BarelyMLDisplay::ImageBlock::isImageLine(const String& line) {
-  return (line.startsWith("{{") && line.trim().endsWith("}}")) || // either just an image...
-         (line.startsWith("[[") && line.trim().endsWith("]]") &&  // ...or a link around...
-          line.contains("{{") && line.fromFirstOccurrenceOf("{{", false, false).contains("}}")); // ...an image.
-}
 
-void BarelyMLDisplay::ImageBlock::parseImageMarkup(const String& line, FileSource* fileSource) {
-  String filename = line.fromFirstOccurrenceOf("{{", false, false).upToFirstOccurrenceOf("}}", false, false);
-  if (filename.contains("?")) {
-    maxWidth = filename.fromFirstOccurrenceOf("?", false, false).getIntValue();
-    filename = filename.upToFirstOccurrenceOf("?", false, false);
+void BarelyMLDisplay::ImageBlock::loadImages(FileSource* fileSource, DrawableCache& cache) {
+  String filename = document->getText(getNode().image);
+  maxWidth = getNode().imageWidth;
+  missingText.clear();
+  rasterized.clear();
+  drawable.reset();
+  loading = false;
+  if (dynamic_cast<AsyncFileSource*>(fileSource)) {
+    // take it from the cache, or load it asynchronously (see requestPendingImages)
+    drawable = cache.findDrawable(fileSource, filename);
+    if (!drawable) {
+      loading = true;
+      pendingImages.add(filename);
+    }
+    return;
+  } else if (fileSource) {
+    drawable = cache.getDrawable(fileSource, filename);
   } else {
-    maxWidth = -1;
+    missingText = "no file source. ";
   }
-  if (fileSource) {
-    drawable = fileSource->getDrawableForFilename(filename);
-  } else {
-    imageMissingMessage.append("no file source. ", Font(14), defaultColour);
+  if (!drawable) {
+    missingText += filename + " not found.";
   }
+}
+
+void BarelyMLDisplay::ImageBlock::drawableLoaded(const String& filename, std::shared_ptr<const Drawable> d) {
+  if (!loading || filename != document->getText(getNode().image)) { return; }
+  loading = false;
+  drawable = d;
   if (!drawable) {
-    imageMissingMessage.append(filename + " not found.", Font(14), defaultColour);
+    missingText = filename + " not found.";
+  }
+  if (style) {
+    applyStyle();                       // update message...
+    heightChanged();                    // ...and layout
   }
 }
 
+void BarelyMLDisplay::ImageBlock::applyStyle() {
+  Block::applyStyle();
+  imageMissingMessage.clear();
+  imageMissingMessage.append(missingText, Font(14), defaultColour);
+}
+
 float BarelyMLDisplay::ImageBlock::getHeightRequired(float width) {
   if (drawable && drawable->getDrawableBounds().getWidth()>0.f) {
     float w = drawable->getDrawableBounds().getWidth();
@@ -1163,18 +4269,29 @@ float BarelyMLDisplay::ImageBlock::getHeightRequired(float width) {
     } else {
       return width*h/w;
     }
+  } else if (loading && maxWidth>0) {
+    return jmin((float)maxWidth,width);   // square placeholder while loading
   } else {
     return 20.f;
   }
 }
 
-void BarelyMLDisplay::ImageBlock::paint(juce::Graphics& g) {
-  if (drawable) {
+void BarelyMLDisplay::ImageBlock::paintContent(juce::Graphics& g) {
+  if (loading) {
+    // draw placeholder
+    float w = maxWidth>0 ? jmin((float)maxWidth,(float)getWidth()) : (float)getWidth();
+    g.setColour(defaultColour.withAlpha(0.1f));
+    g.fillRect(Rectangle<float>(0, 0, w, (float)getHeight()));
+  } else if (drawable) {
     float w = getWidth();
     if (maxWidth>0) {
       w = jmin((float)maxWidth,w);
     }
-    drawable->drawWithin(g, Rectangle<float>(0, 0, w, getHeight()), RectanglePlacement::centred, 1.0f);
+    if (style->rasterizeImages) {
+      rasterized.draw(g, *drawable, Rectangle<float>(0, 0, w, getHeight()));
+    } else {
+      drawable->drawWithin(g, Rectangle<float>(0, 0, w, getHeight()), RectanglePlacement::centred, 1.0f);
+    }
   } else {
     g.setColour(defaultColour);
     g.drawRect(getLocalBounds());
@@ -1190,48 +4307,97 @@ void BarelyMLDisplay::ImageBlock::resized() {
 
 // MARK: - List Item
 
- bool BarelyMLDisplay::ListItem::isListItem(const String& line) {
-  return (line.indexOf(". ")>0 && line.substring(0, line.indexOf(". ")).trim().containsOnly("0123456789")) || (line.indexOf("- ")>=0 && !line.substring(0, line.indexOf("- ")).containsNonWhitespaceChars());
-}
-
-void BarelyMLDisplay::ListItem::parseItemMarkup(const String& line, Font font, int indentPerSpace, int gap) {
-  this->gap  = gap;
-  label.clear();
-  
-  int dotidx = line.indexOf(". ");                      // find dot+space in line
-  String beforedot = line.substring(0, dotidx);         // find out if before the dot...
-  String lbl = beforedot.trimStart();                   // ...there's only whitespace...
-  if (dotidx>0 && lbl.containsOnly("0123456789")) {     // ...and at least one number.
-    label.append(lbl+".", font, defaultColour);          // create label
-    // parse item text (everything after the dot)
-    attributedString = parsePureText(line.substring(dotidx+2).trimStart(), font);
-    // use number of whitespace characters to determine indent
-    indent = indentPerSpace * (beforedot.length()-lbl.length());
-  } else {                                              // otherwise try unordered list:
-    int hyphenidx = line.indexOf("- ");                 // find hyphen+space in line
-    String beforehyphen = line.substring(0, hyphenidx); // find out if before the hyphen...
-    if (!beforehyphen.containsNonWhitespaceChars()) {   // ...there's only whitespace.
-      // parse item text (everything after the hyphen)
-      attributedString = parsePureText(line.substring(hyphenidx+2).trimStart(), font);
-      // use number of whitespace characters to determine indent
-      indent = indentPerSpace * beforehyphen.length();
-      // create label TODO: have bullet character depend on indent
-      label.append(CharPointer_UTF8("•"), font, defaultColour);
-    } else {  // if everything fails, interpret as regular text without label
-      indent = 0;
-      attributedString = parsePureText(line, font);
-    }
+void BarelyMLDisplay::ListItem::applyStyle() {
+  Block::applyStyle();
+  gap = style->labelGap;
+  indent = style->indentPerSpace * getNode().indent;
+  AttributedString l;
+  if (!getNode().label.isEmpty()) {
+    l.append(document->getText(getNode().label), style->font, defaultColour);
   }
+  label.setText(l);
+  text.setText(getSharedAttributedString(getNode().firstRun, getNode().numRuns));
 }
 
 float BarelyMLDisplay::ListItem::getHeightRequired(float width) {
-  TextLayout layout;
-  layout.createLayout(attributedString, width-indent-gap);
-  return layout.getHeight();
+  return text.getHeight(width-indent-gap);
 }
 
-void BarelyMLDisplay::ListItem::paint(juce::Graphics& g) {
+float BarelyMLDisplay::ListItem::estimateHeightRequired(float width) {
+  return text.estimateHeight(width-indent-gap);
+}
+
+void BarelyMLDisplay::ListItem::paintContent(juce::Graphics& g) {
 //  g.fillAll(Colours::lightgreen);   // clear the background
   label.draw(g, getLocalBounds().withTrimmedLeft(indent).toFloat());
-  attributedString.draw(g, getLocalBounds().withTrimmedLeft(indent+gap).toFloat());
+  drawHighlights(g, text, getLocalBounds().withTrimmedLeft(indent+gap).toFloat());
+  text.draw(g, getLocalBounds().withTrimmedLeft(indent+gap).toFloat());
+}
+
+Array<Rectangle<float>> BarelyMLDisplay::ListItem::getMatchBounds(const SearchMatch& m, int width) {
+  Array<Rectangle<float>> bounds = text.getRangeBounds(m.range, (float)(width-indent-gap));
+  for (auto& r : bounds) { r.translate((float)(indent+gap), 0.f); }
+  return bounds;
 }
+
+//==============================================================================
+
+// MARK: - Unit Tests
+
+#if JUCE_UNIT_TESTS
+
+class BarelyMLBinaryFormatTests : public UnitTest
+{
+public:
+  BarelyMLBinaryFormatTests() : UnitTest("BarelyML Binary Format", "BarelyML") {}
+  
+  void runTest() override {
+    // "Grüße *fett* <c:grün>farbig</c>" (the colour name is the only one, so it's at the end)
+    MemoryBlock valid = BarelyMLDocument::parse(String::fromUTF8("Gr\xc3\xbc\xc3\x9f" "e *fett* <c:gr\xc3\xbcn>farbig</c>")).toBinary();
+    auto find = [&](const char* bytes) {  // offset of the last occurrence of bytes, -1 if none
+      const char* d = static_cast<const char*>(valid.getData());
+      size_t n = std::strlen(bytes);
+      int found = -1;
+      for (size_t i=0; i+n <= valid.getSize(); i++) {
+        if (std::memcmp(d+i, bytes, n) == 0) { found = (int)i; }
+      }
+      return found;
+    };
+    auto readsBack = [](const MemoryBlock& m) { return BarelyMLDocument::fromBinary(m.getData(), m.getSize()) != nullptr; };
+    auto corrupted = [&](int offset, char byte) {
+      MemoryBlock m(valid);
+      static_cast<char*>(m.getData())[offset] = byte;
+      return m;
+    };
+    int text = find("Gr\xc3\xbc");
+    int name = find("gr\xc3\xbcn");       // (after its length, right behind the text arena)
+    
+    beginTest("Valid data");
+    expect(readsBack(valid));
+    expect(text >= 0 && name >= 0);
+    
+    beginTest("Invalid UTF-8 in the text");
+    expect(!readsBack(corrupted(text+3, 'x')));       // (continuation byte missing)
+    expect(!readsBack(corrupted(text+2, '\x80')));    // (continuation byte without lead byte)
+    expect(!readsBack(corrupted(text, '\0')));
+    expect(!readsBack(corrupted(name-5, '\xc3')));    // (sequence truncated at the end of the text)
+    
+    beginTest("Text range splitting a character");
+    MemoryInputStream header(valid.getData(), valid.getSize(), false);
+    header.setPosition(8);
+    int runs = binaryHeaderSize + header.readInt()*binaryBlockSize; // (the runs follow the blocks)
+    expect(!readsBack(corrupted(runs+4, '\x03')));    // (first run "Grüße " -> "Gr" and half an "ü")
+    
+    beginTest("Invalid UTF-8 in a colour name");
+    expect(!readsBack(corrupted(name+3, 'x')));
+    expect(!readsBack(corrupted(name+3, '\xc3')));
+    
+    beginTest("Truncated data");
+    expect(!readsBack(MemoryBlock(valid.getData(), (size_t)name+3))); // (in the colour name's "ü")
+    expect(!readsBack(MemoryBlock(valid.getData(), (size_t)text+3))); // (in the text's "ü")
+  }
+};
+
+static BarelyMLBinaryFormatTests barelyMLBinaryFormatTests;
+
+#endif
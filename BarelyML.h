@@ -117,6 +117,237 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <array>
+#include <atomic>
+
+//==============================================================================
+// BarelyMLDocument is the parsed representation of a BarelyML string. It consists
+// of a few flat arrays (blocks, inline text runs, table rows and cells, colour
+// references) and one text arena which holds all the text as UTF-8. A document
+// doesn't depend on any Component, font or colour palette, so parse() can be used
+// on any thread and the result can be cached and shared.
+class BarelyMLDocument
+{
+public:
+  // MARK: - Parsing
+  // NOTE: With a thread pool, markup of at least minParallelSize bytes (UTF-8) is split at
+  //       block boundaries into chunks, which are parsed concurrently (on the pool and the
+  //       calling thread) and merged in order. The result is the same as without a pool.
+  static constexpr int defaultMinParallelSize = 256 * 1024;
+  static BarelyMLDocument parse(const juce::String& markup, juce::ThreadPool* pool = nullptr, int minParallelSize = defaultMinParallelSize);
+  // same as above, but blocks whose lines are the same as those of a block of previous (e.g. the
+  // markup before an edit) are copied from previous instead of being parsed again (so only the
+  // lines are split into blocks and hashed, and only the changed blocks are parsed)
+  static BarelyMLDocument parse(const juce::String& markup, const BarelyMLDocument& previous, juce::ThreadPool* pool = nullptr, int minParallelSize = defaultMinParallelSize);
+  // same as parse, but returns the document parsed from the same markup before, as long as it's
+  // still in use (documents are immutable, so e.g. all plugin instances showing the same help
+  // text share a single document), thread safe, unchanged blocks are copied from previous (if any)
+  static std::shared_ptr<const BarelyMLDocument> parseShared(const juce::String& markup, juce::ThreadPool* pool = nullptr, int minParallelSize = defaultMinParallelSize,
+                                                             const BarelyMLDocument* previous = nullptr);
+  // parses markup while it arrives, e.g. from a stream (see below)
+  class StreamParser;
+  // adds numBlocks blocks of a separately parsed part, starting at firstBlock (-1 = all of them,
+  // the runs, cells and text of the whole part are copied, even the ones of blocks left out)
+  void append(const BarelyMLDocument& part, int firstBlock = 0, int numBlocks = -1);
+  // adds block index of another document, with only the runs, cells and text it refers to
+  void appendBlock(const BarelyMLDocument& other, int index);
+  
+  // MARK: - Document Model
+  enum BlockType { textBlock, admonitionBlock, imageBlock, tableBlock, listItemBlock };
+  enum AdmonitionType { info, hint, important, caution, warning };
+  enum RunFlags { bold = 1, italic = 2, link = 4 };
+  
+  struct TextRange {                  // UTF-8 bytes in the text arena
+    int start;
+    int length;
+    bool isEmpty() const { return length == 0; }
+  };
+  
+  struct ColourRef {                  // a colour as written in the markup
+    enum Kind { defaultColour, hexColour, namedColour };
+    Kind kind;
+    juce::uint32 argb;                // for hexColour
+    int name;                         // index into colourNames for namedColour
+    int fallback;                     // colour to use if the name is unknown
+  };
+  
+  struct Run {                        // a piece of text with a single style
+    TextRange text;
+    int flags;                        // combination of RunFlags
+    int heading;                      // 0 for regular text, 1-5 for headings
+    int colour;                       // index into colours (0 is the default colour)
+  };
+  
+  struct Cell {                       // a table cell
+    int firstRun, numRuns;
+    TextRange link;                   // link target (empty if none)
+    TextRange image;                  // image filename (empty if none)
+    int imageWidth;                   // width given in the markup, -1 if none
+    bool isHeader;
+  };
+  
+  struct Row {                        // a table row
+    int firstCell, numCells;
+  };
+  
+  struct BlockNode {
+    BlockType type;
+    juce::int64 hash;                 // hash of the block's markup (and type)
+    int firstRun, numRuns;            // text, admonition and list item blocks
+    int firstRow, numRows;            // table blocks
+    TextRange link;                   // link target of the whole block (empty if none)
+    TextRange image;                  // image filename for image blocks
+    int imageWidth;                   // maximum image width, -1 if none
+    AdmonitionType admonition;        // admonition blocks
+    TextRange label;                  // list item label ("1." or a bullet)
+    int indent;                       // number of whitespace characters before a list item
+  };
+  
+  std::vector<BlockNode> blocks;
+  std::vector<Run> runs;
+  std::vector<Row> rows;
+  std::vector<Cell> cells;
+  std::vector<ColourRef> colours;     // colours[0] is always the default colour
+  juce::StringArray colourNames;      // all colour names used in the markup
+  std::vector<char> text;             // text arena (UTF-8)
+  
+  struct ParseTimes {                 // milliseconds spent in parse()
+    double classify;                  // splitting the markup into lines and blocks
+    double blocks;                    // parsing the blocks (inline markup, tables, ...)
+  };
+  ParseTimes parseTimes = { 0.0, 0.0 };
+  
+  // MARK: - Search
+  // NOTE: A SearchIndex keeps the plain text of every block (as displayed, so inline markup like
+  //       *bold* doesn't split matches) in lower case. update() only extracts the text of blocks
+  //       it hasn't seen before (all others are reused by hash), so keeping it up to date while
+  //       the document is edited only costs a hash lookup per unchanged block.
+  struct SearchMatch {
+    int block;                        // index of the block
+    int cell;                         // table cell (counted row by row), -1 for other blocks
+    juce::Range<int> range;           // characters in the block's (or cell's) AttributedString
+  };
+  class SearchIndex {
+  public:
+    void update(const BarelyMLDocument& doc);
+    // all occurrences of text (ignoring case) in the blocks, in document order (at most
+    // maxMatches, -1 = all), but not across cells or blocks
+    juce::Array<SearchMatch> findAll(const juce::String& text, int maxMatches = -1) const;
+    int getNumBlocks() const { return (int)entries.size(); }
+  private:
+    struct Entry {
+      juce::String text;              // plain text of the block in lower case
+      juce::Array<int> cellStarts;    // for tables: start of each cell in text (and the end)
+    };
+    std::vector<std::shared_ptr<const Entry>> entries; // one per block
+    std::unordered_map<juce::int64, std::shared_ptr<const Entry>> entriesByHash;
+  };
+  // plain text of a block, i.e. the text of its AttributedString (or of all table cells, with
+  // the start of every cell and the end of the last one in cellStarts)
+  juce::String getPlainText(int block, juce::Array<int>* cellStarts = nullptr) const;
+  
+  // MARK: - Binary Format
+  // NOTE: toBinary() writes the document model as it is (blocks, runs, the table grid, colours,
+  //       image references and the text arena, little endian), so documentation can be parsed at
+  //       build time and shipped e.g. in BinaryData. fromBinary() reads it back without parsing
+  //       any markup, it only checks that every index is in range and that all text is valid
+  //       UTF-8 (and no text range splits a character). It returns nullptr for truncated or
+  //       corrupt data and for data written by another binaryFormatVersion.
+  static constexpr int binaryFormatVersion = 2; // (2: block hashes count empty lines)
+  juce::MemoryBlock toBinary() const;
+  static std::shared_ptr<const BarelyMLDocument> fromBinary(const void* data, size_t numBytes);
+  static bool isBinary(const void* data, size_t numBytes); // (only checks the header)
+  
+  // MARK: - Utility Methods
+  juce::String getText(TextRange r) const { return juce::String::fromUTF8(text.data()+r.start, r.length); }
+  static juce::Colour parseHexColour(juce::String s, juce::Colour defaultColour);
+  
+  // line classification
+  static bool isListItem(const juce::String& line);
+  static bool isAdmonitionLine(const juce::String& line);
+  static bool isImageLine(const juce::String& line);
+  static bool isTableLine(const juce::String& line);
+  static bool containsLink(const juce::String& line);
+  
+  struct StringHash {                 // for std::unordered_map with juce::String keys
+    size_t operator()(const juce::String& s) const { return (size_t)s.hashCode64(); }
+  };
+  
+private:
+  enum LineKind { listItemLines, admonitionLines, imageLines, tableLines, linkLines, textLines };
+  struct BlockLines {                 // lines of a block, as found by the line classifier
+    LineKind kind;
+    int firstLine, numLines;
+  };
+  static LineKind classifyLine(const juce::String& line);
+  static std::vector<BlockLines> findBlocks(const juce::StringArray& lines, const std::vector<LineKind>& kinds);
+  static juce::int64 hashBlock(const BlockLines& bl, const juce::StringArray& lines); // (the hash parseBlock gives it)
+  static std::vector<int> findUnchangedBlocks(const std::vector<BlockLines>& found, const juce::StringArray& lines, const BarelyMLDocument* previous);
+  void parseBlock(const BlockLines& bl, const juce::StringArray& lines);
+  static BarelyMLDocument parse(const juce::String& markup, const BarelyMLDocument* previous, juce::ThreadPool* pool, int minParallelSize);
+  
+  TextRange addText(const juce::String& s);
+  TextRange addInlineText(const char* start, const char* end);
+  int addColour(ColourRef::Kind kind, juce::uint32 argb, const juce::String& name, int fallback);
+  juce::String consumeLink(juce::String line, TextRange& link, int& linkStart, int& linkEnd);
+  void parseInline(const juce::StringArray& lines, int& firstRun, int& numRuns, int linkStart = -1, int linkEnd = -1);
+  void parseInlineLine(const char* s, int start, int end, int linkStart, int linkEnd, int heading, bool& isBold, bool& isItalic, int& colour);
+  void parseTextBlock(BlockNode& b, const juce::StringArray& lines);
+  void parseLinkBlock(BlockNode& b, const juce::String& line);
+  void parseAdmonition(BlockNode& b, const juce::String& line);
+  void parseImage(BlockNode& b, const juce::String& line);
+  void parseTable(BlockNode& b, const juce::StringArray& lines);
+  void parseListItem(BlockNode& b, const juce::String& line);
+  
+  // interned colour names and colour references (so every tag only looks them up once)
+  std::unordered_map<juce::String, int, StringHash> colourNameIndex;
+  std::unordered_map<juce::int64, int> colourIndex;
+};
+
+//==============================================================================
+// MARK: - Stream Parser
+// NOTE: A StreamParser takes the markup in pieces of any size (e.g. read from a stream) and
+//       parses every block as soon as it's complete. It only keeps the lines of the last block
+//       (which may continue in the next piece) and the incomplete last line, so memory use is
+//       proportional to the document, not to the markup. The result is the same as parsing
+//       all of the markup at once.
+class BarelyMLDocument::StreamParser
+{
+public:
+  StreamParser();
+  
+  void addData(const void* data, size_t numBytes); // (UTF-8, may end in the middle of a line)
+  void finish();                        // parses the rest (call it at the end of the markup)
+  
+  const BarelyMLDocument& getDocument() const { return doc; } // the blocks parsed so far
+  BarelyMLDocument takeDocument() { return std::move(doc); }  // (after finish())
+  juce::int64 getNumBytes() const { return numBytes; }
+  
+  // for logs (see BarelyMLDisplay::appendMarkup): the blocks parsed since the last call (which
+  // are removed from getDocument()), and the blocks finish() would add now (without finishing)
+  BarelyMLDocument takeParsedBlocks();
+  BarelyMLDocument parsePending() const;
+  // closes text blocks after maxLines lines (0 = never), so that the last block stays short
+  void setMaxLinesPerTextBlock(int maxLines) { maxLinesPerTextBlock = maxLines; }
+  
+private:
+  void addLine();                       // adds tail to lines (and classifies it)
+  void parseLines(bool isLastPiece);    // parses the complete blocks in lines
+  // BarelyMLDocument::findBlocks, with text blocks split after maxLinesPerTextBlock lines
+  std::vector<BlockLines> findBlocks(const juce::StringArray& l, const std::vector<LineKind>& k) const;
+  
+  BarelyMLDocument doc;
+  std::string tail;                     // the incomplete last line
+  juce::StringArray lines;              // lines which haven't been parsed yet...
+  std::vector<LineKind> kinds;          // ...and their kinds
+  int minLinesToParse;                  // (grows if a block spans many pieces)
+  int maxLinesPerTextBlock;
+  bool afterCR;                         // the last line ended in "\r" (which may be "\r\n")
+  juce::int64 numBytes;
+};
 
 //==============================================================================
 class BarelyMLDisplay  : public juce::Component
@@ -127,52 +358,361 @@ public:
   
   // MARK: - juce::Component Methods
   void paint (juce::Graphics&) override;
+  void paintOverChildren (juce::Graphics&) override;
   void resized() override;
   
   // MARK: - Parameters
-  void setFont(juce::Font font) { this->font = font; };
-  void setMargin(int m) { margin = m; };
-  void setColours(juce::StringPairArray c) { colours = c; setMarkupString(markupString); };
-  void setBGColour(juce::Colour bg) { this->bg = bg; setMarkupString(markupString); };
-  void setTableColours(juce::Colour bg, juce::Colour bgHeader) { tableBG = bg; tableBGHeader = bgHeader; setMarkupString(markupString); };
-  void setTableMargins(int margin, int gap) { tableMargin = margin; tableGap = gap; setMarkupString(markupString); };
+  // NOTE: Changing parameters doesn't re-parse the markup, it only re-applies the style
+  //       to the existing blocks. Wrap several calls in beginUpdate() and endUpdate() (or
+  //       use a ScopedUpdate object) to apply all of them at once.
+  void setFont(juce::Font font) { style.font = font; style.updateTextHash(); styleChanged(); };
+  void setMargin(int m) { style.margin = m; styleChanged(); };
+  void setColours(juce::StringPairArray c) { style.palette.compile(c); style.updateTextHash(); styleChanged(); };
+  void setBGColour(juce::Colour bg) { style.bg = bg; repaint(); };
+  void setTableColours(juce::Colour bg, juce::Colour bgHeader) { style.tableBG = bg; style.tableBGHeader = bgHeader; styleChanged(); };
+  void setTableMargins(int margin, int gap) { style.tableMargin = margin; style.tableGap = gap; styleChanged(); };
   void setListIndents(int indentPerSpace, int labelGap) {
-    this->indentPerSpace = indentPerSpace;
-    this->labelGap = labelGap;
-    setMarkupString(markupString);
+    style.indentPerSpace = indentPerSpace;
+    style.labelGap = labelGap;
+    styleChanged();
   };
+  // draws images (e.g. SVGs) from a cached bitmap rendered at the destination size and display
+  // scale, instead of re-rendering the drawable on every repaint (off by default)
+  void setRasterizeImages(bool shouldRasterize) { style.rasterizeImages = shouldRasterize; styleChanged(); };
+  void setHighlightColours(juce::Colour match, juce::Colour currentMatch) { style.highlight = match; style.currentHighlight = currentMatch; styleChanged(); };
   void setAdmonitionSizes(int iconsize, int admargin, int adlinewidth) {
-    this->iconsize = iconsize;
-    this->admargin = admargin;
-    this->adlinewidth = adlinewidth;
-    setMarkupString(markupString);
+    style.iconsize = iconsize;
+    style.admargin = admargin;
+    style.adlinewidth = adlinewidth;
+    styleChanged();
+  };
+  
+  // MARK: - Batched Updates
+  void beginUpdate() { updateDepth++; }
+  void endUpdate();
+  
+  class ScopedUpdate {
+  public:
+    ScopedUpdate(BarelyMLDisplay& d) : display(d) { display.beginUpdate(); }
+    ~ScopedUpdate() { display.endUpdate(); }
+  private:
+    BarelyMLDisplay& display;
+    JUCE_DECLARE_NON_COPYABLE (ScopedUpdate)
   };
 
+  // MARK: - Conversion Rules
+  // NOTE: Every format converter is defined by a rule set. Prefix rules rewrite the start of a
+  //       line, inline rules replace delimiters, link rules rewrite links and span rules rewrite
+  //       spans like <c:red>text</c>. The patterns are compiled into two tries (one for the line
+  //       prefixes, one for everything else), so each line is converted in a single scan no
+  //       matter how many rules there are, and the longest matching pattern wins. Custom dialects
+  //       can be supported by adding rules to a copy of one of the built-in rule sets (rules added
+  //       later win over earlier ones with the same pattern), e.g.
+  //         auto rules = BarelyMLDisplay::ConversionRules::fromMarkdown();
+  //         rules.addInlineRule("~~", "");  // drop strikethrough markers
+  //         auto bml = BarelyMLDisplay::convertFromMarkdown(md, rules);
+  class ConversionRules {
+  public:
+    ConversionRules();
+    
+    // replaces from at the start of a line with to, where from may contain "$spaces" (spaces and
+    // tabs, also none, which are copied where to contains "$spaces") and "$digits" (a number),
+    // and to may contain "$number", the item number in the ordered list at listLevel (1...5);
+    // suffix is appended to the line, after dropping any trailing characters in trimTrailing
+    void addPrefixRule(const juce::String& from, const juce::String& to, int listLevel = 0,
+                       const juce::String& suffix = {}, const juce::String& trimTrailing = {});
+    // replaces from anywhere in a line with to
+    void addInlineRule(const juce::String& from, const juce::String& to);
+    // rewrites links like [[address|label]] (open, separator and close) to to (or toWithoutLabel,
+    // if there's no separator), where "$address" is copied as is and "$label" is converted
+    enum LinkFlags {
+      labelFirst = 1,                   // e.g. [label](address)
+      labelRequired = 2,                // not a link without separator (and label)
+      urlOnly = 4                       // only for http://, https:// and mailto: addresses
+    };
+    void addLinkRule(const juce::String& open, const juce::String& separator, const juce::String& close,
+                     const juce::String& to, const juce::String& toWithoutLabel = {}, int flags = 0);
+    // rewrites URLs starting with scheme at the start of a word (up to the next space or tab),
+    // optionally followed by a label in brackets, e.g. https://juce.com[JUCE] (like AsciiDoc)
+    void addBareLinkRule(const juce::String& scheme, const juce::String& to, const juce::String& toWithLabel);
+    // rewrites spans like <c:red>text</c> (open, "$name", separator, text, close) to to, the text
+    // and closeTo, where the span may continue over several lines (if it gets closed)
+    void addSpanRule(const juce::String& open, const juce::String& separator, const juce::String& close,
+                     const juce::String& to, const juce::String& closeTo);
+    
+    // converts text line by line (without any table handling)
+    juce::String convert(const juce::String& text) const;
+    
+    static const ConversionRules& fromMarkdown();
+    static const ConversionRules& toMarkdown();
+    static const ConversionRules& fromDokuWiki();
+    static const ConversionRules& toDokuWiki();
+    static const ConversionRules& fromAsciiDoc();
+    static const ConversionRules& toAsciiDoc();
+    
+    static constexpr int maxListLevels = 5;
+    
+  private:
+    friend class BarelyMLDisplay;
+    enum RuleType { prefixRule, inlineRule, linkRule, bareLinkRule, spanRule, spanCloseRule };
+    struct Rule {
+      RuleType type;
+      juce::String from, to;            // (for links and spans, from is the opening pattern)
+      juce::String separator, close, alternative; // (toWithoutLabel, toWithLabel or closeTo)
+      juce::String suffix, trimTrailing;
+      int listLevel, flags, span;       // (span is the index of the span rule a close rule belongs to)
+    };
+    struct Node {                       // a trie node
+      Node() { next.fill(-1); }
+      std::array<int, 256> next;        // the child for each byte
+      int digits = -1, spaces = -1;     // the children for "$digits" and "$spaces"
+      juce::Array<int> rules;           // the rules ending here (in the order they were added)
+    };
+    struct State;                       // the state of a conversion (see BarelyML.cpp)
+    struct Match;
+    
+    void insert(std::vector<Node>& trie, const juce::String& pattern, int rule, bool wildcards);
+    int matchPrefix(const char* s, const char* e, Match& m) const;
+    void convertLine(State& state, const char* s, const char* e, bool applyPrefixRules) const;
+    void convertText(State& state, const char* s, const char* e, bool atWordStart) const;
+    // (nestedLinks: whether a link's label may be a link itself, only one level deep, so that
+    // lines full of brackets stay linear)
+    int findMatch(State& state, const char* p, const char* e, bool atWordStart, Match& m, bool nestedLinks = true) const;
+    bool match(State& state, int rule, const char* p, const char* patternEnd, const char* e, bool atWordStart, bool nestedLinks, Match& m) const;
+    bool matchLink(State& state, int rule, const char* p, const char* patternEnd, const char* e, bool nestedLinks, Match& m) const;
+    void writeMatch(State& state, int rule, const Match& m) const;
+    void writeTemplate(State& state, const juce::String& t, const Match& m) const;
+    
+    std::vector<Rule> rules;
+    std::vector<Node> prefixes, markers; // the tries (with the roots at index 0)
+  };
+  
   // MARK: - Format Conversion (static methods)
-  static juce::String convertFromMarkdown(juce::String md);
-  static juce::String convertToMarkdown(juce::String bml);
+  static juce::String convertFromMarkdown(juce::String md, const ConversionRules& rules = ConversionRules::fromMarkdown());
+  static juce::String convertToMarkdown(juce::String bml, const ConversionRules& rules = ConversionRules::toMarkdown());
 
-  static juce::String convertFromDokuWiki(juce::String dw);
-  static juce::String convertToDokuWiki(juce::String bml);
+  static juce::String convertFromDokuWiki(juce::String dw, const ConversionRules& rules = ConversionRules::fromDokuWiki());
+  static juce::String convertToDokuWiki(juce::String bml, const ConversionRules& rules = ConversionRules::toDokuWiki());
   
-  static juce::String convertFromAsciiDoc(juce::String ad);
-  static juce::String convertToAsciiDoc(juce::String bml);
+  static juce::String convertFromAsciiDoc(juce::String ad, const ConversionRules& rules = ConversionRules::fromAsciiDoc());
+  static juce::String convertToAsciiDoc(juce::String bml, const ConversionRules& rules = ConversionRules::toAsciiDoc());
 
+  // MARK: - Virtualization
+  // NOTE: In virtualized mode (the default), only the blocks that intersect the visible area
+  //       (plus overscan above and below) are attached to the content component, all other
+  //       blocks are just layout records, so scrolling doesn't get slower with document size.
+  //       Blocks out of view are also only measured when they come into view (until then, their
+  //       height is estimated from their line lengths), so resizing doesn't get slower either.
+  //       Every block remembers its height for the last few widths it was measured at.
+  void setVirtualized(bool shouldBeVirtualized) { virtualized = shouldBeVirtualized; resized(); }
+  bool isVirtualized() const { return virtualized; }
+  void setOverscan(int pixels) { overscan = pixels; updateVisibleBlocks(); }
+  
   // MARK: - Content
+  // NOTE: setMarkupString and setDocument only rebuild the blocks whose markup has changed
+  //       since the last call, all other blocks (and their loaded images) are reused.
+  //       Displays share everything that doesn't depend on their size: documents parsed from
+  //       the same markup (see BarelyMLDocument::parseShared), drawables (all displays use the
+  //       same DrawableCache by default) and the attributed strings of blocks with the same
+  //       markup, font and colours. A display whose style changes gets its own strings, the
+  //       shared ones are never modified. Only text layouts, block bounds and the scroll
+  //       position are kept per display.
   void setMarkupString(juce::String s);
+  void setDocument(std::shared_ptr<const BarelyMLDocument> doc); // e.g. parsed on another thread
+  // parses the markup, loads its images and lays out its text on a background thread, the current
+  // content stays visible until the new one is swapped in. The blocks (Components) are only
+  // created on the message thread then, from what has been prepared. onReady is called on the
+  // message thread too (but not if the request has been superseded by a newer
+  // setMarkupString/setDocument/...Async call).
+  void setMarkupStringAsync(juce::String s, std::function<void()> onReady = nullptr);
+  // reads and parses the markup on a background thread, without keeping a copy of it (e.g. for
+  // very large generated logs). The first blocks are shown as soon as they're parsed, and the
+  // rest of the document while it streams in (blocks out of view are only estimated and laid
+  // out when they scroll into view). onReady is called when the whole stream has been shown.
+  void setMarkupStream(std::unique_ptr<juce::InputStream> stream, std::function<void()> onReady = nullptr);
+  // parses markup of at least minSize bytes on all CPU cores (off by default, smaller markup is
+  // always parsed on a single thread, as it isn't worth the overhead)
+  void setParallelParsing(bool shouldParseInParallel, int minSize = BarelyMLDocument::defaultMinParallelSize);
+  bool isParsingInParallel() const { return parallelParsePool != nullptr; }
+  
+  // pre-parsed documents (see BarelyMLDocument::toBinary), e.g. compiled with BarelyMLCompiler,
+  // setCompiledDocument returns false (and keeps the current content) if the data is invalid
+  static juce::MemoryBlock compile(const juce::String& markup) { return BarelyMLDocument::parse(markup).toBinary(); }
+  bool setCompiledDocument(const void* data, size_t numBytes);
+  
+  std::shared_ptr<const BarelyMLDocument> getDocument() const; // (in log mode, merged when needed)
   void setMarkdownString(juce::String md) { setMarkupString(convertFromMarkdown(md)); }
   void setDokuWikiString(juce::String dw) { setMarkupString(convertFromDokuWiki(dw)); }
   void setAsciiDocString(juce::String ad) { setMarkupString(convertFromDokuWiki(ad)); }
+  
+  // MARK: - Coalesced Updates (e.g. for live previews)
+  // NOTE: setMarkupStringCoalesced only keeps the latest text and shows it at most once every
+  //       minIntervalMs milliseconds, and only after it has been unchanged for debounceMs
+  //       milliseconds (0 = no debounce). Any other content change cancels a pending update.
+  void setMarkupStringCoalesced(juce::String s);
+  void setCoalescingIntervals(int minIntervalMs, int debounceMs) { coalesceInterval = minIntervalMs; coalesceDebounce = debounceMs; }
+  void flushCoalescedUpdate() { if (coalescePending) { applyCoalescedUpdate(); } } // apply pending update now
+  struct UpdateCounters {
+    int requested;                      // number of setMarkupStringCoalesced calls
+    int applied;                        // number of rebuilds done for them
+    int coalesced;                      // number of texts replaced by a newer one before being shown
+  };
+  UpdateCounters getUpdateCounters() const { return updateCounters; }
+  void resetUpdateCounters() { updateCounters = { 0, 0, 0 }; }
+  
+  // MARK: - Log Mode (e.g. for status consoles)
+  // NOTE: appendMarkup continues the markup of the previous appendMarkup calls (below the current
+  //       content, any other content change starts a new log). Only the new lines, and the last
+  //       block they may continue, are parsed and laid out, so an append costs the same no matter
+  //       how long the log is. Text blocks in a log are closed after logLinesPerTextBlock lines
+  //       (which looks almost the same), so the last block stays cheap to update. With a history
+  //       limit, the oldest blocks are dropped in batches (so the log may get up to an eighth
+  //       longer before it's trimmed). If the view is at the bottom, it stays there.
+  void appendMarkup(const juce::String& markup);
+  void setLogHistoryLimit(int maxBlocks, juce::int64 maxTextBytes = 0) { logMaxBlocks = maxBlocks; logMaxBytes = maxTextBytes; trimLog(); } // (0 = no limit)
+  void setLogAutoScroll(bool shouldFollowEnd) { logAutoScroll = shouldFollowEnd; } // (on by default)
+  static constexpr int logLinesPerTextBlock = 32;
+  
+  // MARK: - Statistics
+  // NOTE: Timing the phases is off by default (the counters always run, they're cheap). Times
+  //       are in milliseconds, totals and counters are accumulated since the last resetStats().
+  //       The drawable cache may be shared with other displays, and TextLayouts and shared layout
+  //       lookups are counted for the whole process (i.e. for all displays and renderers).
+  struct PhaseStats {
+    double lastMs, totalMs;             // duration of the last call, and of all calls
+    int calls;
+    void add(double ms) { lastMs = ms; totalMs += ms; calls++; }
+  };
+  struct Stats {
+    PhaseStats classify;                // splitting the markup into lines and blocks
+    PhaseStats parse;                   // parsing the blocks (inline markup, tables, ...)
+    PhaseStats loadImages;              // loading images through the FileSource (and cache)
+    PhaseStats measure;                 // measuring block heights (in resized() and parse jobs)
+    PhaseStats paint;                   // painting the display (incl. the blocks in view)
+    int numBlocks[5];                   // blocks of the current document per BlockType
+    int numTableCells;                  // table cells of the current document
+    int drawableCacheHits, drawableCacheMisses;
+    int heightCacheHits, heightCacheMisses;     // blocks which didn't/did need to be measured again
+    int heightsEstimated;               // blocks out of view which weren't measured (yet)
+    int paintCacheHits, paintCacheMisses;       // tiles which were blitted/had to be painted
+    int textLayoutsCreated;
+    int sharedLayoutHits, sharedLayoutMisses;   // text layouts and cell sizes shared/shaped
+  };
+  void setStatsEnabled(bool shouldTimePhases) { statsEnabled = shouldTimePhases; }
+  bool isStatsEnabled() const { return statsEnabled; }
+  Stats getStats() const;
+  void resetStats();
+
 
+  // MARK: - Search
+  // NOTE: Searches the text as displayed (see BarelyMLDocument::SearchIndex), the index is
+  //       updated on the first search after the document has changed (only for changed blocks).
+  typedef BarelyMLDocument::SearchMatch SearchMatch;
+  juce::Array<SearchMatch> findAll(const juce::String& text, int maxMatches = -1);
+  // highlights matches (of the current document), current is the index of the match highlighted
+  // in the current match colour (-1 for none), see setHighlightColours
+  void setHighlightedMatches(const juce::Array<SearchMatch>& matches, int current = -1);
+  void clearHighlightedMatches() { setHighlightedMatches({}); }
+  // scrolls vertically so that the match is in the middle of the display
+  void scrollToMatch(const SearchMatch& match);
+  
+  // MARK: - Paint Cache
+  // NOTE: Blocks are painted into cached images (in tiles of up to 1024x256 pixels, at the
+  //       display's physical pixel scale), so scrolling only blits images. A tile is painted
+  //       again when the block's content or style, its size or the scale changes. Only the tiles
+  //       in view are painted (so huge tables don't need huge images), and when all tiles exceed
+  //       the byte budget, the least recently drawn ones are removed.
+  void setPaintCaching(bool shouldCache) { paintCaching = shouldCache; paintCache.clear(); repaint(); }
+  bool isPaintCaching() const { return paintCaching; }
+  void setPaintCacheSize(size_t maxBytes) { paintCache.setMaxNumBytes(maxBytes); }
+  size_t getPaintCacheSize() const { return paintCache.getMaxNumBytes(); }
 
+  // MARK: - Headless Layout and Rendering
+  // NOTE: A Renderer (see below) lays out and paints a document without a window, e.g. for
+  //       thumbnails and exports (also on a worker thread, see the notes there).
+  struct Layout {
+    juce::Array<juce::Rectangle<int>> blockBounds; // one rectangle per document block
+    int height;                         // content height (incl. margins)
+  };
+  class Renderer;
+  
   // MARK: - File Handling (for images)
+  // NOTE: with setMarkupStringAsync, getDrawableForFilename is called on a background thread
   class FileSource {
   public:
     virtual ~FileSource() {};
     virtual std::unique_ptr<juce::Drawable> getDrawableForFilename(juce::String filename) = 0;
+    // optional version (e.g. a timestamp) of a file, cached drawables are reloaded when it changes
+    virtual juce::String getVersionForFilename(juce::String) { return {}; }
+    // optional identifier: file sources with the same (non-empty) identifier return the same
+    // files, so they share their cached drawables (e.g. the BinaryData of several plugin instances)
+    virtual juce::String getIdentifier() { return {}; }
   };
   
-  void setFileSource(FileSource* fs) { fileSource = fs; }
+  // NOTE: an AsyncFileSource loads files in the background (e.g. from a bundle or the network),
+  //       images and table cells show a placeholder (sized using the ?width hint) until their
+  //       drawable arrives, then only the affected block is updated
+  class AsyncFileSource : public FileSource {
+  public:
+    // starts loading filename, onLoaded must be called exactly once (from any thread) with the
+    // loaded drawable, or with nullptr if the file can't be loaded
+    virtual void loadDrawableForFilename(juce::String filename, std::function<void(std::unique_ptr<juce::Drawable>)> onLoaded) = 0;
+    // (not used by BarelyMLDisplay for asynchronous file sources)
+    std::unique_ptr<juce::Drawable> getDrawableForFilename(juce::String) override { return nullptr; }
+  };
+  
+  void setFileSource(FileSource* fs) { fileSource = fs; blockGeneration++; } // applies to the next setMarkupString call
+  
+  // MARK: - Drawable Cache
+  // NOTE: Drawables are loaded through a cache, so every file is only decoded once and all blocks
+  //       showing it share the same Drawable. Several displays can share one cache. When the
+  //       (estimated) size of all cached drawables exceeds the byte budget, the least recently
+  //       used ones are removed from the cache (blocks still showing them keep their copy).
+  //       DrawableCache objects must be created with std::make_shared.
+  class DrawableCache : public std::enable_shared_from_this<DrawableCache> {
+  public:
+    DrawableCache (size_t maxBytes = 32*1024*1024) : maxNumBytes(maxBytes), numBytes(0) {}
+    // the cache all displays use by default (created when first needed, thread safe)
+    static std::shared_ptr<DrawableCache> getDefault();
+    // returns the drawable for filename, loads it from fs if it's not cached (thread safe)
+    std::shared_ptr<const juce::Drawable> getDrawable(FileSource* fs, const juce::String& filename);
+    // returns the drawable for filename if it's cached, nullptr otherwise (thread safe)
+    std::shared_ptr<const juce::Drawable> findDrawable(FileSource* fs, const juce::String& filename);
+    // loads the drawable for filename through fs (unless it's cached), onLoaded is called on the
+    // message thread (several requests for the same file only load it once)
+    void loadDrawableAsync(AsyncFileSource* fs, const juce::String& filename, std::function<void(std::shared_ptr<const juce::Drawable>)> onLoaded);
+    int getNumHits() const { return numHits; }     // lookups which found a cached drawable...
+    int getNumMisses() const { return numMisses; } // ...and which didn't
+    void setMaxNumBytes(size_t maxBytes);
+    size_t getMaxNumBytes() const { return maxNumBytes; }
+    size_t getNumBytes() const;
+    int getNumDrawables() const;
+    void clear();
+    static size_t estimateNumBytes(const juce::Drawable& d);
+  private:
+    struct Entry {
+      juce::String key;
+      std::shared_ptr<const juce::Drawable> drawable;
+      size_t numBytes;
+    };
+    static juce::String getKey(FileSource* fs, const juce::String& filename);
+    std::shared_ptr<const juce::Drawable> find(const juce::String& key); // (lock must be held)
+    std::shared_ptr<const juce::Drawable> add(const juce::String& key, std::shared_ptr<const juce::Drawable> d); // (lock must be held)
+    void removeLeastRecentlyUsed();
+    juce::CriticalSection lock;
+    std::list<Entry> entries;           // most recently used first
+    std::unordered_map<juce::String, std::list<Entry>::iterator, BarelyMLDocument::StringHash> index;
+    std::unordered_map<juce::String, std::vector<std::function<void(std::shared_ptr<const juce::Drawable>)>>, BarelyMLDocument::StringHash> pendingLoads;
+    size_t maxNumBytes, numBytes;
+    std::atomic<int> numHits { 0 }, numMisses { 0 };
+  };
+  
+  void setDrawableCache(std::shared_ptr<DrawableCache> cache) { // e.g. shared with other displays
+    drawableCache = cache;
+    drawableCacheHits0 = cache->getNumHits();     // (statistics start counting at the new cache)
+    drawableCacheMisses0 = cache->getNumMisses();
+  }
+  std::shared_ptr<DrawableCache> getDrawableCache() const { return drawableCache; }
   
   // MARK: - URL Handling (for custom link types)
   class URLHandler {
@@ -191,63 +731,282 @@ public:
   }
 
 private:
+  // MARK: - Palette
+  // named colours, compiled into a hash table (documents refer to colours by name, and each block
+  // resolves them once when it's styled, so changing the palette never re-parses the markup)
+  class Palette
+  {
+  public:
+    void compile(const juce::StringPairArray& colours);
+    int indexOf(const juce::String& name) const;  // -1 if the name is unknown
+    juce::Colour operator[](int index) const { return colours[index]; }
+    juce::Colour getColour(const juce::String& name, juce::Colour fallback) const;
+    juce::int64 getHash() const { return hash; } // of the names and values
+  private:
+    juce::Array<juce::Colour> colours;
+    juce::int64 hash = 0;
+    std::unordered_map<juce::String, int, BarelyMLDocument::StringHash> indices;
+  };
+  
+  // MARK: - Style
+  // everything that affects how the blocks look, but not how the markup is parsed
+  struct Style {
+    juce::Font font;                      // default font for regular text
+    Palette palette;                      // colour palette
+    juce::Colour bg;                      // background colour
+    juce::Colour tableBG, tableBGHeader;  // table background colours
+    int tableMargin, tableGap;            // table margins
+    int indentPerSpace, labelGap;         // list item indents
+    int margin;                           // content margin in pixels
+    int iconsize;                         // admonition icon size in pixels
+    int admargin;                         // admonition margin in pixels
+    int adlinewidth;                      // admonition line width in pixels
+    bool rasterizeImages;                 // draw drawables from cached images
+    juce::Colour highlight, currentHighlight; // search match highlights
+    juce::int64 textHash;                 // font and palette (see updateTextHash)
+    void updateTextHash();                // (after changing the font or the palette)
+  };
+  static Style getDefaultStyle();
+  
+  // MARK: - Shared Text
+  // attributed strings shared by all blocks (of all displays and renderers) with the same markup,
+  // font and palette, while they're in use (thread safe)
+  class SharedText
+  {
+  public:
+    struct Key {                        // what a shared string is created from
+      juce::int64 blockHash;            // hash of the block's markup
+      int firstRun, numRuns;            // (relative to the block's first run)
+      bool bold;
+      juce::int64 textHash;             // font and palette (see Style::updateTextHash)
+      bool operator==(const Key& k) const { return blockHash == k.blockHash && firstRun == k.firstRun && numRuns == k.numRuns && bold == k.bold && textHash == k.textHash; }
+      juce::int64 hash() const;
+    };
+    // returns the string for key, calls create if there's none. isSame checks the text of a string
+    // found for key, so that colliding hashes never show another block's text (a string which
+    // doesn't match is created, and not shared)
+    static std::shared_ptr<const juce::AttributedString> get(const Key& key, const std::function<bool(const juce::AttributedString&)>& isSame,
+                                                             const std::function<juce::AttributedString()>& create);
+  };
+  
+  // MARK: - Shared Layouts
+  // text layouts shared by all blocks (of all displays and renderers) with the same text, fonts
+  // and colours at the same width, while they're in use, so e.g. repeated table cells and list
+  // bullets are shaped once (thread safe)
+  class SharedLayout
+  {
+  public:
+    // returns the layout of text for width (key is getKey(text)), creates it if there's none
+    static std::shared_ptr<const juce::TextLayout> get(juce::int64 key, float width, const std::shared_ptr<const juce::AttributedString>& text);
+    // returns the size of unwrapped text (for table cells), calls measure if it isn't known yet
+    // (the most recently used sizes are kept, up to maxNaturalSizes)
+    static juce::Point<float> getNaturalSize(juce::int64 key, const std::shared_ptr<const juce::AttributedString>& text,
+                                             const std::function<juce::Point<float>()>& measure);
+    static constexpr size_t maxNaturalSizes = 16384;
+    // a hash of everything a layout depends on: text, attributes, justification, wrapping, ...
+    static juce::int64 getKey(const juce::AttributedString& text);
+    // whether a and b have the same layout (as the hashes may collide, entries found for a key
+    // are checked with this, and never handed out for a different text)
+    static bool isSameText(const juce::AttributedString& a, const juce::AttributedString& b);
+    static std::atomic<int> numHits, numMisses; // (of all lookups, for statistics)
+  };
+  
+  // MARK: - Cached Text Layout
+  // an AttributedString together with its TextLayout for the last width it was laid out for,
+  // so measuring and painting a block share one layout (and repaints don't re-shape the text),
+  // layouts of identical text are shared (see SharedLayout)
+  class CachedTextLayout
+  {
+  public:
+    CachedTextLayout () { text = std::make_shared<const juce::AttributedString>(); layoutWidth = -1.f; linesCounted = false; keyComputed = false; textKey = 0; }
+    // sets new text (invalidates the layout), e.g. a shared one (see SharedText)
+    void setText(std::shared_ptr<const juce::AttributedString> s) { text = s; layout.reset(); layoutWidth = -1.f; linesCounted = false; keyComputed = false; }
+    void setText(const juce::AttributedString& s) { setText(std::make_shared<const juce::AttributedString>(s)); }
+    const juce::AttributedString& getText() const { return *text; }
+    const std::shared_ptr<const juce::AttributedString>& getSharedText() const { return text; }
+    juce::int64 getTextKey();           // (see SharedLayout::getKey)
+    // returns the layout for the given width (only re-created if the width has changed)
+    const juce::TextLayout& getLayout(float width);
+    float getHeight(float width) { return getLayout(width).getHeight(); }
+    // guesses the height for the given width without laying out the text
+    float estimateHeight(float width);
+    // bounds of the characters in range, laid out for width (one rectangle per line and run)
+    juce::Array<juce::Rectangle<float>> getRangeBounds(juce::Range<int> range, float width);
+    // draws the text within area, laid out for the area's width
+    void draw(juce::Graphics& g, juce::Rectangle<float> area) { getLayout(area.getWidth()).draw(g, area); }
+    static std::atomic<int> numLayoutsCreated; // (by all instances, for statistics)
+  private:
+    std::shared_ptr<const juce::AttributedString> text; // (never nullptr)
+    std::shared_ptr<const juce::TextLayout> layout; // (nullptr until laid out)
+    float layoutWidth;
+    juce::int64 textKey;                // SharedLayout key of text...
+    bool keyComputed;                   // ...if computed yet
+    juce::Array<juce::Point<float>> lines; // estimated width and height of each line (for estimateHeight)
+    bool linesCounted;
+  };
+  
+  // MARK: - Rasterized Drawable
+  // an image of a drawable, rendered at the size and scale it was last drawn at (blitting it is
+  // much faster than drawing e.g. an SVG's paths again)
+  class RasterizedDrawable
+  {
+  public:
+    RasterizedDrawable () { source = nullptr; width = height = 0; scale = 0.f; }
+    // draws d centred within area (the image is only rendered again if the size or scale changed)
+    void draw(juce::Graphics& g, const juce::Drawable& d, juce::Rectangle<float> area);
+    void clear() { image = juce::Image(); source = nullptr; }
+  private:
+    juce::Image image;
+    const juce::Drawable* source;       // drawable the image was rendered from
+    int width, height;                  // image size in physical pixels
+    float scale;                        // physical pixels per logical pixel
+  };
+  
+  // MARK: - Paint Cache
+  // tiles of components painted into images (message thread only), see setPaintCaching
+  class PaintCache
+  {
+  public:
+    PaintCache (size_t maxBytes = 64*1024*1024) : maxNumBytes(maxBytes), numBytes(0), numHits(0), numMisses(0) {}
+    // draws the tiles of the component with the given id (see createId) which intersect the clip
+    // region, painting them with paintFunction first if they're missing or outdated (i.e. were
+    // painted for another version, size or scale), bounds are the component's local bounds
+    void paint(juce::Graphics& g, juce::int64 id, int version, juce::Rectangle<int> bounds,
+               const std::function<void(juce::Graphics&)>& paintFunction);
+    static juce::int64 createId();    // a new id (thread safe, ids are never reused)
+    void setMaxNumBytes(size_t maxBytes);
+    size_t getMaxNumBytes() const { return maxNumBytes; }
+    size_t getNumBytes() const { return numBytes; }
+    int getNumHits() const { return numHits; }     // tiles which were just blitted...
+    int getNumMisses() const { return numMisses; } // ...and which had to be painted
+    void resetCounters() { numHits = numMisses = 0; }
+    void clear();
+    static constexpr int tileWidth = 1024, tileHeight = 256;
+  private:
+    struct Tile {
+      juce::int64 key;                  // component id, row and column
+      int version;
+      juce::Rectangle<int> bounds;      // component bounds the tile was painted for
+      float scale;
+      juce::Image image;
+      size_t numBytes;
+    };
+    void removeLeastRecentlyUsed();
+    std::list<Tile> tiles;              // most recently used first
+    std::unordered_map<juce::int64, std::list<Tile>::iterator> index;
+    size_t maxNumBytes, numBytes;
+    int numHits, numMisses;
+  };
+  
   // MARK: - Blocks
   class Block : public Component
   {
   public:
-    Block ()  { colours = nullptr; defaultColour = juce::Colours::black; }
-    // static utility methods
-    static juce::Colour parseHexColourStatic(juce::String s, juce::Colour defaultColour);
-    static bool containsLink(juce::String line);
-    // Common functionalities for all blocks
-    juce::String consumeLink(juce::String line, juce::String* link = nullptr);
-    virtual void parseMarkup(const juce::StringArray& lines, juce::Font font) {};
+    Block ()  { style = nullptr; nodeIndex = -1; defaultColour = juce::Colours::black; sourceHash = 0; styleGeneration = -1; nextCachedHeight = 0; clearHeightCache(); paintId = PaintCache::createId(); paintVersion = 0; currentHighlight = -1; isInViewRange = false; }
+    // document node shown by this block (reused blocks are moved to the node of the new document)
+    void setNode(std::shared_ptr<const BarelyMLDocument> doc, int index);
+    const BarelyMLDocument::BlockNode& getNode() const { return document->blocks[(size_t)nodeIndex]; }
+    int getNodeIndex() const { return nodeIndex; }
+    virtual void loadImages(FileSource*, DrawableCache&) {}; // for images and tables
+    // starts loading the images loadImages couldn't get synchronously (from an AsyncFileSource)
+    void requestPendingImages(AsyncFileSource* fs, DrawableCache& cache);
+    virtual void drawableLoaded(const juce::String&, std::shared_ptr<const juce::Drawable>) {};
     virtual float getHeightRequired(float width) = 0;
-    void setColours(juce::StringPairArray* c) { 
-      colours = c;
-      defaultColour = parseHexColour((*colours)["default"]);
+    float getCachedHeightRequired(float width);  // same as above, but remembers the last few results
+    bool isHeightCached(float width) const;
+    // a cheap guess of the height (for blocks out of view), by default the exact height, as most
+    // blocks are cheap to measure (only text needs to be laid out)
+    virtual float estimateHeightRequired(float width) { return getCachedHeightRequired(width); }
+    // style handling: applyStyle() recreates everything that depends on the style
+    void setStyle(const Style* s, int generation) {
+      style = s;
+      if (generation != styleGeneration) {
+        styleGeneration = generation;
+        applyStyle();
+        clearHeightCache();
+      }
     };
+    virtual void applyStyle() { defaultColour = style->palette.getColour("default", juce::Colours::black); paintVersion++; };
     virtual bool canExtendBeyondMargin() { return false; }; // for tables
+    // painting: paint() draws paintContent() through the display's paint cache (if enabled)
+    void paint(juce::Graphics& g) override;
+    virtual void paintContent(juce::Graphics&) {};
+    virtual bool isPaintCacheable() { return true; }; // false for blocks which are cheap to draw
+    // search match highlights: the matches in this block (current is an index into matches or -1),
+    // and the bounds of a match (in block coordinates, for a block of the given width)
+    virtual void setHighlights(const juce::Array<SearchMatch>& matches, int current);
+    virtual juce::Array<juce::Rectangle<float>> getMatchBounds(const SearchMatch&, int) { return {}; }
     // mouse handlers for clicking on links
     void mouseDown(const juce::MouseEvent& event) override;
     void mouseUp(const juce::MouseEvent& event) override;
     
     void setBMLDisplay(BarelyMLDisplay* bd) { bmlDisplay = bd; }
+    
+    // hash of the markup the block was created from (used by setDocument to reuse blocks)
+    void setSourceHash(juce::int64 h) { sourceHash = h; }
+    juce::int64 getSourceHash() const { return sourceHash; }
+    const std::shared_ptr<const BarelyMLDocument>& getDocument() const { return document; }
+    bool isInViewRange;                   // (used by updateVisibleBlocks)
+    
+    // the text of runs of doc as a block (of node nodeIndex) with style creates it, without a
+    // block (e.g. for preparing text on a background thread)
+    static juce::AttributedString createAttributedString(const BarelyMLDocument& doc, const Style& style,
+                                                         int firstRun, int numRuns, juce::Font font);
+    static std::shared_ptr<const juce::AttributedString> getSharedAttributedString(const BarelyMLDocument& doc, int nodeIndex, const Style& style,
+                                                                                   int firstRun, int numRuns, bool bold = false);
+    static juce::Colour resolveColour(const BarelyMLDocument& doc, const Style& style, int colour);
 
   protected:
-    juce::AttributedString parsePureText(const juce::StringArray& lines, juce::Font font, bool addNewline = true);
+    juce::AttributedString createAttributedString(int firstRun, int numRuns, juce::Font font);
+    // same as above with the style's font (boldened, if bold), but shared (see SharedText)
+    std::shared_ptr<const juce::AttributedString> getSharedAttributedString(int firstRun, int numRuns, bool bold = false);
+    void heightChanged();                 // e.g. after an image has been loaded
+    void drawHighlights(juce::Graphics& g, CachedTextLayout& t, juce::Rectangle<float> area);
+    juce::Array<juce::Range<int>> highlights; // ranges of the highlighted matches...
+    int currentHighlight;                 // ...and the current one (-1 if none)
+    juce::StringArray pendingImages;      // images waiting to be loaded asynchronously
     juce::Colour defaultColour;
-    juce::Colour currentColour;
-    juce::StringPairArray* colours;
-    juce::Colour parseHexColour(juce::String s);
+    const Style* style;
+    std::shared_ptr<const BarelyMLDocument> document;
+    int nodeIndex;
     BarelyMLDisplay* bmlDisplay;
 
   private:
     juce::String link;
     juce::Point<float> mouseDownPosition;
+    juce::int64 sourceHash;
+    int styleGeneration;
+    juce::int64 paintId;                 // for the paint cache...
+    int paintVersion;                    // ...incremented when the block looks different
+    void clearHeightCache() { for (auto& c : cachedHeights) { c.width = -1.f; } }
+    struct CachedHeight { float width, height; };
+    std::array<CachedHeight, 8> cachedHeights;  // heights for the last widths (oldest replaced first)
+    int nextCachedHeight;
   };
   
   class TextBlock  : public Block
   {
   public:
-    void parseMarkup(const juce::StringArray& lines, juce::Font font) override;
+    void applyStyle() override;
     float getHeightRequired(float width) override;
-    void paint(juce::Graphics&) override;
+    float estimateHeightRequired(float width) override;
+    juce::Array<juce::Rectangle<float>> getMatchBounds(const SearchMatch& m, int width) override;
+    void paintContent(juce::Graphics&) override;
   private:
-    juce::AttributedString attributedString;
+    CachedTextLayout text;
   };
   
   class AdmonitionBlock  : public Block
   {
   public:
-    static bool isAdmonitionLine(const juce::String& line);
-    void parseAdmonitionMarkup(const juce::String& line, juce::Font font, int iconsize, int margin, int linewidth);
+    void applyStyle() override;
     float getHeightRequired(float width) override;
-    void paint(juce::Graphics&) override;
+    float estimateHeightRequired(float width) override;
+    juce::Array<juce::Rectangle<float>> getMatchBounds(const SearchMatch& m, int width) override;
+    void paintContent(juce::Graphics&) override;
   private:
-    juce::AttributedString attributedString;
-    enum ParagraphType { info, hint, important, caution, warning };
-    ParagraphType type;
+    CachedTextLayout text;
+    juce::Colour colour;                // tab and line colour
     int iconsize, margin, linewidth;
   };
   
@@ -255,32 +1014,42 @@ private:
   {
   public:
     TableBlock ();
-    static bool isTableLine(const juce::String& line);
-    void parseMarkup(const juce::StringArray& lines, juce::Font font) override;
+    void loadImages(FileSource* fileSource, DrawableCache& cache) override;
+    void drawableLoaded(const juce::String& filename, std::shared_ptr<const juce::Drawable> d) override;
+    void applyStyle() override;
     float getWidthRequired();
     float getHeightRequired(float width) override;
     void resized() override;
-    void setBGColours(juce::Colour bg, juce::Colour bgHeader) {
-      table.bg = bg;
-      table.bgHeader = bgHeader;
-    }
-    void setMargins(int margin, int gap, int leftmargin) {
-      table.cellmargin = margin;
-      table.cellgap = gap;
-      table.leftmargin = leftmargin;
-    }
     bool canExtendBeyondMargin() override { return true; };
-    void setFileSource(FileSource* fs) { fileSource = fs; };
+    bool isPaintCacheable() override { return false; }; // (the table is cached on its own)
+    void setHighlights(const juce::Array<SearchMatch>& matches, int current) override; // (for the cells)
+    juce::Array<juce::Rectangle<float>> getMatchBounds(const SearchMatch& m, int width) override;
+    static void measureText(const juce::AttributedString& s, float& width, float& height); // (natural size of a cell)
   private:
-    FileSource* fileSource;
-    typedef struct {
-      juce::AttributedString s;
-      std::unique_ptr<juce::Drawable> drawable;
-      juce::String link;
-      bool  isHeader;
-      float width;
-      float height;
-    } Cell;
+    // the table's cells are stored as arrays (cells are counted row by row, like in the document),
+    // with the few image cells and search matches on the side, so measuring and painting large
+    // tables only sweeps over contiguous memory (and cell links and text stay in the document)
+    struct CellMetrics {
+      float width, height;              // natural size of the content
+      int image;                        // index into images, -1 for text cells
+      bool isHeader;
+    };
+    struct TableImage {                 // an image file shown in the table (once per file)
+      juce::String filename;
+      std::shared_ptr<const juce::Drawable> drawable;
+      bool pending;                     // still being loaded
+      juce::String missingText;         // shown if the image couldn't be loaded
+    };
+    struct CellImage {                  // a cell showing an image
+      int image;                        // index into Table::images
+      RasterizedDrawable rasterized;    // (only used with rasterizeImages)
+    };
+    struct CellHighlight {              // a search match in a cell
+      int cell;
+      juce::Range<int> range;
+      bool isCurrent;
+    };
+    juce::String getCellLink(int row, int column) const; // (from the document)
     class InnerViewport : public juce::Viewport {
     public:
       // Override the mouse event methods to forward them to the parent Viewport
@@ -317,12 +1086,29 @@ private:
     };
     class Table : public juce::Component {
     public:
-      void paint(juce::Graphics&) override;
-      juce::OwnedArray<juce::OwnedArray<Cell>> cells;
+      void paint(juce::Graphics&) override;   // paints the cells through the paint cache...
+      void paintCells(juce::Graphics&);       // ...or directly
+      juce::int64 paintId;
+      int paintVersion;                       // incremented when the table looks different
+      juce::Array<int> rowStarts;         // first cell of each row (and one past the last cell)
+      juce::Array<CellMetrics> metrics;   // all cells, row by row
+      std::vector<CachedTextLayout> texts; // text of each cell
+      juce::Array<CellImage> cellImages;  // image cells
+      juce::Array<TableImage> images;     // image files (shared by all cells showing them)
+      juce::Array<CellHighlight> highlights; // search matches (sorted by cell)
+      int getNumRows() const { return juce::jmax(0, rowStarts.size()-1); }
+      int getNumCells(int row) const { return rowStarts[row+1] - rowStarts[row]; }
+      TableImage* getImage(int cell);     // nullptr for text cells
       juce::Array<float> columnwidths;
       juce::Array<float> rowheights;
-      juce::Colour bg, bgHeader;
+      juce::Array<float> columnoffsets;   // left edges of the columns (and right edge of the table)
+      juce::Array<float> rowoffsets;      // top edges of the rows (and bottom edge of the table)
+      void computeOffsets();
+      static int findIndex(const juce::Array<float>& offsets, float pos);
+      juce::Colour bg, bgHeader, placeholder;
+      juce::Colour highlight, currentHighlight;
       int cellmargin, cellgap, leftmargin;
+      bool rasterizeImages;
       void mouseDown(const juce::MouseEvent& event) override;
       void mouseUp(const juce::MouseEvent& event) override;
       void setBMLDisplay(BarelyMLDisplay* bd) { bmlDisplay = bd; }
@@ -337,48 +1123,246 @@ private:
   class ImageBlock : public Block
   {
   public:
-    static bool isImageLine(const juce::String& line);
-    void parseImageMarkup(const juce::String& line, FileSource* fileSource);
+    ImageBlock () { loading = false; maxWidth = 0; }
+    void loadImages(FileSource* fileSource, DrawableCache& cache) override;
+    void drawableLoaded(const juce::String& filename, std::shared_ptr<const juce::Drawable> d) override;
+    void applyStyle() override;
     float getHeightRequired(float width) override;
-    void paint(juce::Graphics&) override;
+    void paintContent(juce::Graphics&) override;
+    bool isPaintCacheable() override { return !style->rasterizeImages; }; // (already an image)
     void resized() override;
   private:
+    bool loading;                       // waiting for the image to be loaded asynchronously
+    juce::String missingText;
     juce::AttributedString imageMissingMessage;
-    std::unique_ptr<juce::Drawable> drawable;
+    std::shared_ptr<const juce::Drawable> drawable;
+    RasterizedDrawable rasterized;      // (only used with rasterizeImages)
     int maxWidth;
   };
   
   class ListItem : public Block
   {
   public:
-    static bool isListItem(const juce::String& line);
-    void parseItemMarkup(const juce::String& line, juce::Font font, int indentPerSpace, int gap);
+    void applyStyle() override;
     float getHeightRequired(float width) override;
-    void paint(juce::Graphics&) override;
+    float estimateHeightRequired(float width) override;
+    juce::Array<juce::Rectangle<float>> getMatchBounds(const SearchMatch& m, int width) override;
+    void paintContent(juce::Graphics&) override;
   private:
-    juce::AttributedString attributedString;
-    juce::AttributedString label;
+    CachedTextLayout text;
+    CachedTextLayout label;
     int indent;
     int gap;
   };
   
+  // MARK: - Content Viewport
+  // tells the display when the visible area has changed (i.e. when blocks need to be attached)
+  class ContentViewport : public juce::Viewport {
+  public:
+    ContentViewport () { bmlDisplay = nullptr; }
+    void setBMLDisplay(BarelyMLDisplay* bd) { bmlDisplay = bd; }
+    void visibleAreaChanged(const juce::Rectangle<int>&) override {
+      if (bmlDisplay && bmlDisplay->virtualized) { bmlDisplay->updateVisibleBlocks(); }
+    }
+  private:
+    BarelyMLDisplay* bmlDisplay;
+  };
+  
+  // MARK: - Update Timer
+  // applies coalesced updates when they're due
+  class UpdateTimer : public juce::Timer {
+  public:
+    UpdateTimer (BarelyMLDisplay& d) : display(d) {}
+    void timerCallback() override { display.coalescedUpdateTimerCallback(); }
+  private:
+    BarelyMLDisplay& display;
+  };
+  juce::uint32 getCoalescedUpdateDueTime() const;
+  void coalescedUpdateTimerCallback();
+  void applyCoalescedUpdate();
+  void cancelCoalescedUpdate();
+  
+  // MARK: - Layout
+  // stacks the blocks, if estimated isn't nullptr, blocks whose height for width isn't cached are
+  // only estimated (and flagged in estimated)
+  static Layout computeLayout(const juce::OwnedArray<Block>& blocks, int width, int margin,
+                              Stats* stats = nullptr, juce::Array<bool>* estimated = nullptr);
+  // same as above, for the blocks from first on (starting at y), appends to bounds and estimated
+  // and returns the bottom of the last block
+  static int layoutBlocks(const juce::OwnedArray<Block>& blocks, int first, int y, int width, int margin,
+                          Stats* stats, juce::Array<juce::Rectangle<int>>& bounds, juce::Array<bool>* estimated);
+  static juce::Rectangle<int> getBlockBounds(Block* b, int y, int height, int width, int margin);
+  
+  // MARK: - Block Creation
+  static Block* createBlockOfType(BarelyMLDocument::BlockType type);
+  Block* createBlock(std::shared_ptr<const BarelyMLDocument> doc, int index); // creates the block for a node of doc
+  static juce::int64 getReuseKey(const BarelyMLDocument::BlockNode& node, int generation);
+  
+  // MARK: - Asynchronous Parsing
+  // document and what the blocks for its new nodes need, prepared on a background thread (no
+  // Components are created there), held until the blocks have been created so that they find
+  // it in the caches (DrawableCache, SharedText and SharedLayout)
+  struct PreparedContent {
+    std::shared_ptr<const BarelyMLDocument> document;
+    std::vector<std::shared_ptr<const juce::Drawable>> drawables;
+    std::vector<std::shared_ptr<const juce::AttributedString>> texts;
+    std::vector<std::shared_ptr<const juce::TextLayout>> layouts;
+    Style style;                        // style snapshot the text was prepared with
+    int styleGeneration, blockGeneration;
+    double loadImagesMs, measureMs;     // time spent loading images and measuring blocks
+  };
+  class ParseJob : public juce::ThreadPoolJob {
+  public:
+    ParseJob(BarelyMLDisplay& d, const juce::String& s, std::function<void()> ready);
+    JobStatus runJob() override;
+  private:
+    juce::String markup;
+    std::shared_ptr<const BarelyMLDocument> previous; // the display's document when the job was created
+    std::shared_ptr<PreparedContent> prepared;
+    std::unordered_map<juce::int64, int> reusableKeys; // reuse keys of the current blocks (and count)
+    FileSource* fileSource;
+    std::shared_ptr<DrawableCache> drawableCache;
+    std::shared_ptr<juce::ThreadPool> parallelParsePool;
+    int minParallelParseSize;
+    bool statsEnabled;
+    float width;
+    int generation;
+    juce::Component::SafePointer<BarelyMLDisplay> display;
+    std::function<void()> onReady;
+  };
+  // reads, parses and shows the markup of a stream (see setMarkupStream)
+  class StreamJob : public juce::ThreadPoolJob {
+  public:
+    StreamJob(BarelyMLDisplay& d, std::unique_ptr<juce::InputStream> s, std::function<void()> ready);
+    JobStatus runJob() override;
+    static constexpr int chunkSize = 64 * 1024; // bytes read at once
+  private:
+    void show(BarelyMLDocument doc, bool isComplete);
+    std::unique_ptr<juce::InputStream> stream;
+    BarelyMLDocument::ParseTimes shownTimes; // parsing time already counted in shown documents
+    int generation;
+    juce::Component::SafePointer<BarelyMLDisplay> display;
+    std::function<void()> onReady;
+  };
+  void showDocument(std::shared_ptr<const BarelyMLDocument> doc, PreparedContent* prepared);
+  
+  // MARK: - Style Updates
+  void styleChanged();                  // re-applies style to all blocks (or defers it)
+  void applyStyleToBlocks();
+  
+  // MARK: - Visible Blocks
+  void updateVisibleBlocks();           // attaches (and lays out) the blocks in view, detaches others
+  void blockHeightChanged();            // lays out the blocks again (without rebuilding them)
+  void clearHighlights();               // removes the search highlights from all blocks
+  // measures the estimated blocks between top and bottom and moves the blocks below them
+  bool measureEstimatedBlocks(int top, int bottom, int& scrollY, int& height);
+  
+  // MARK: - Log Mode
+  void trimLog();                       // drops the oldest blocks beyond the history limits
+  void resetLog();                      // (when the content is replaced)
+  static int getTextSize(const Block* b); // bytes of text in a block (for the history limit)
+  
   // MARK: - Private Variables
-  juce::String markupString;            // current markup string
-  juce::StringPairArray colours;        // colour palette
-  juce::Colour bg;                      // background colour
-  juce::Colour tableBG, tableBGHeader;  // table background colours
-  int tableMargin, tableGap;            // table margins
-  int indentPerSpace, labelGap;         // list item indents
-  juce::Viewport  viewport;             // a viewport to scroll the content
+  Style style;                          // current style
+  int styleGeneration;                  // incremented whenever the style changes
+  ContentViewport viewport;             // a viewport to scroll the content
   juce::Component content;              // a component with the content
   juce::OwnedArray<Block> blocks;       // representation of the document as blocks
-  int margin;                           // content margin in pixels
-  int iconsize;                         // admonition icon size in pixels
-  int admargin;                         // admonition margin in pixels
-  int adlinewidth;                      // admonition line width in pixels
+  juce::Array<juce::Rectangle<int>> blockBounds; // layout of the blocks (in content coordinates)
+  juce::Array<bool> estimatedHeights;   // blocks whose height in blockBounds is only estimated
+  bool virtualized;                     // only attach blocks in view
+  int overscan;                         // attach blocks this far outside of the visible area
+  int blockGeneration;                  // incremented when existing blocks can't be reused
+  int updateDepth;                      // number of nested beginUpdate() calls
+  bool stylePending;                    // style has changed during update
+  bool documentPending;                 // document has been set during update
+  mutable std::shared_ptr<const BarelyMLDocument> document; // current document
+  mutable bool documentOutdated;        // blocks have been appended since document was merged
+  std::shared_ptr<const BarelyMLDocument> pendingDocument; // document set during update
   FileSource* fileSource;               // data source for image files, etc.
+  std::shared_ptr<DrawableCache> drawableCache; // drawables loaded from fileSource
   URLHandler* urlHandler;               // URL handler for custom URLs
-  juce::Font font;                      // default font for regular text
+  int contentGeneration;                // incremented on every content change (cancels async parsing)
+  juce::ThreadPool parsePool;           // background thread for setMarkupStringAsync and setMarkupStream
+  bool keepScrollPosition;              // resized() keeps the absolute (not relative) scroll position
+  std::unique_ptr<BarelyMLDocument::StreamParser> logParser; // markup passed to appendMarkup (if any)
+  int logPendingBlocks;                 // blocks at the end parsed from the unfinished end of the log
+  int logMaxBlocks;                     // history limits (0 = none)...
+  juce::int64 logMaxBytes;
+  juce::int64 logBytes;                 // ...and the text size of all blocks (in log mode)
+  bool logAutoScroll;                   // keep the view at the bottom when appending
+  std::shared_ptr<juce::ThreadPool> parallelParsePool; // threads for parallel parsing (if enabled)
+  int minParallelParseSize;             // markup size (bytes) from which it's parsed in parallel
+  UpdateTimer updateTimer;              // timer for coalesced updates
+  juce::String coalescedMarkup;         // latest text passed to setMarkupStringCoalesced
+  bool coalescePending;                 // coalescedMarkup hasn't been shown yet
+  int coalesceInterval, coalesceDebounce;     // minimum interval and debounce time (ms)
+  juce::uint32 lastCoalescedRequest, lastCoalescedUpdate; // times of last request/rebuild (ms)
+  UpdateCounters updateCounters;
+  bool statsEnabled;                    // time the phases
+  Stats stats;                          // (only the fields which aren't computed by getStats)
+  double paintStart;                    // time paint() was called (ms)
+  int drawableCacheHits0, drawableCacheMisses0, textLayoutsCreated0; // counters at resetStats()
+  int sharedLayoutHits0, sharedLayoutMisses0;
+  PaintCache paintCache;                // painted tiles of the blocks
+  BarelyMLDocument::SearchIndex searchIndex; // plain text of the document (for findAll)
+  bool searchIndexOutdated;             // document has changed since the last findAll
+  juce::Array<int> highlightedBlocks;   // blocks with search highlights
+  bool paintCaching;                    // paint blocks through paintCache
   
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BarelyMLDisplay)
 };
+
+//==============================================================================
+// MARK: - Renderer
+// NOTE: A Renderer has its own blocks, which are never added to a window. They are Components
+//       all the same (their bounds are set and they're painted with paintEntireComponent), and
+//       JUCE doesn't make Components thread safe. So a renderer can be used on a worker thread,
+//       but by one thread at a time and not concurrently with the message thread (e.g. while
+//       holding a MessageManagerLock, or in a command line tool). Blocks and their text layouts
+//       are kept between calls, so rendering e.g. all pages of a document at the same width only
+//       lays it out once. Images are loaded with the file source's getDrawableForFilename,
+//       images of an AsyncFileSource are only shown if they are already cached. Each renderer
+//       has its own drawable cache by default, as drawables mustn't be drawn on several threads
+//       at the same time.
+class BarelyMLDisplay::Renderer
+{
+public:
+  Renderer();                           // default style, no file source
+  Renderer(const BarelyMLDisplay& display); // style, file source and document of display
+  
+  // content (blocks of unchanged markup are reused)
+  void setDocument(std::shared_ptr<const BarelyMLDocument> doc);
+  void setMarkupString(const juce::String& s) { // (only parses the blocks which have changed)
+    setDocument(BarelyMLDocument::parseShared(s, nullptr, BarelyMLDocument::defaultMinParallelSize, document.get()));
+  }
+  std::shared_ptr<const BarelyMLDocument> getDocument() const { return document; }
+  
+  // parameters (the same as the display's)
+  void setFont(juce::Font font) { style.font = font; style.updateTextHash(); styleGeneration++; }
+  void setMargin(int m) { style.margin = m; styleGeneration++; }
+  void setColours(juce::StringPairArray c) { style.palette.compile(c); style.updateTextHash(); styleGeneration++; }
+  void setBGColour(juce::Colour bg) { style.bg = bg; }
+  void setFileSource(FileSource* fs) { fileSource = fs; blocks.clear(); setDocument(document); } // (loads images again)
+  void setDrawableCache(std::shared_ptr<DrawableCache> cache) { drawableCache = cache; }
+  
+  // block bounds and content height for the given width (measured again only if it changed)
+  const Layout& layout(int width);
+  // renders the area clip of the content (the whole content if clip is empty) at the given
+  // width into an image scaled by scale, e.g. 2 for a high resolution thumbnail
+  juce::Image renderToImage(int width, float scale = 1.f, juce::Rectangle<int> clip = {});
+  // paints the area clip of the content at the given width, in content coordinates
+  void render(juce::Graphics& g, int width, juce::Rectangle<int> clip);
+  
+private:
+  Style style;
+  int styleGeneration;                  // incremented whenever the style changes
+  FileSource* fileSource;
+  std::shared_ptr<DrawableCache> drawableCache;
+  std::shared_ptr<const BarelyMLDocument> document;
+  juce::OwnedArray<Block> blocks;       // one block per document node
+  Layout cachedLayout;
+  int layoutWidth, layoutGeneration;    // width and style generation of cachedLayout
+  
+  JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (Renderer)
+};
@@ -0,0 +1,500 @@
+/*******************************************************************************
+ The block below describes the properties of this PIP. A PIP is a short snippet
+ of code that can be read by the Projucer and used to generate a JUCE project.
+
+ BEGIN_JUCE_PIP_METADATA
+
+ name:             BarelyMLBenchmark
+ version:          0.3
+ vendor:           Fritz Menzer
+ website:          https://mnsp.ch
+ description:      Console benchmarks for parsing, layout, painting and format conversion.
+
+ dependencies:     juce_core, juce_data_structures, juce_events, juce_graphics, juce_gui_basics
+ exporters:        LINUX_MAKE, XCODE_MAC, VS2022
+
+ moduleFlags:      JUCE_STRICT_REFCOUNTEDPOINTER=1
+
+ type:             Console
+
+ END_JUCE_PIP_METADATA
+
+ *******************************************************************************/
+
+#pragma once
+
+#include "BarelyML.h"
+#include "BarelyML.cpp" // ugly, but works...
+
+using namespace juce;
+
+//==============================================================================
+namespace BarelyMLBenchmark
+{
+  // The inline tokenizer as it was up to version 0.3 (indexOf/substring loop, one String
+  // copy per token), kept here to compare against the single-pass scanner. parsePureText is
+  // Block::parsePureText of version 0.3 as it was (except for || instead of | in conditions),
+  // the other members stand in for the ones of Block it used.
+  struct LegacyTokenizer
+  {
+    LegacyTokenizer() {
+      palette.set("red", "#A00");        // (the colours used by createFormattedParagraph)
+      palette.set("green", "#0A0");
+      palette.set("linkcolour", "#00A");
+      colours = &palette;
+      defaultColour = parseHexColour((*colours)["default"]);
+    }
+    
+    AttributedString parsePureText(const StringArray& lines, Font font, bool addNewline = true)
+    {
+      AttributedString attributedString;
+      
+      String currentLine;
+      currentColour = defaultColour;
+      
+      bool bold = false;
+      bool italic = false;
+      
+      for (auto line : lines)
+      {
+        line = line.replace("\\\\", "\n");
+        if (line.startsWith("##### "))
+        {
+          attributedString.append(parsePureText(line.substring(6), font.boldened().withHeight(font.getHeight()*1.1f),false));
+        }
+        else if (line.startsWith("#### "))
+        {
+          attributedString.append(parsePureText(line.substring(5), font.boldened().withHeight(font.getHeight()*1.25f),false));
+        }
+        else if (line.startsWith("### "))
+        {
+          attributedString.append(parsePureText(line.substring(4), font.boldened().withHeight(font.getHeight()*1.42f),false));
+        }
+        else if (line.startsWith("## "))
+        {
+          attributedString.append(parsePureText(line.substring(3), font.boldened().withHeight(font.getHeight()*1.7f),false));
+        }
+        else if (line.startsWith("# "))
+        {
+          attributedString.append(parsePureText(line.substring(2), font.boldened().withHeight(font.getHeight()*2.1f),false));
+        }
+        else
+        {
+          while (line.isNotEmpty()) {
+            bool needsNewFont = false;
+            // find first token to interpret
+            int bidx = line.indexOf("*");
+            int iidx = line.indexOf("_");
+            int tidx = line.indexOf("<");
+            Colour nextColour = currentColour;
+            if (bidx > -1 && (bidx < iidx || iidx == -1) && (bidx < tidx || tidx == -1)) {
+              // if the next token is toggling the bold state...
+              // ...first add everything up to the token...
+              attributedString.append(line.substring(0, bidx), font, currentColour);
+              line = line.substring(bidx+1); // ...then drop up to and including the token...
+              bold = !bold;                  // ...toggle the bold status...
+              needsNewFont = true;           // ...and request new font.
+            } else if (iidx > -1 && (iidx < tidx || tidx == -1)) {
+              // if the next token is toggling the italic state...
+              // ...first add everything up to the token...
+              attributedString.append(line.substring(0, iidx), font, currentColour);
+              line = line.substring(iidx+1); // ...then drop up to and including the token...
+              italic = !italic;              // ...toggle the italic status...
+              needsNewFont = true;           // ...and request new font.
+            } else if (tidx > -1) {
+              // if the next token is a tag, first figure out if it is a recognized tag...
+              String tag;
+              bool tagRecognized = false;
+              // find tag end
+              int tidx2 = line.indexOf(tidx, ">");
+              if (tidx2>tidx) {
+                tag = line.substring(tidx+1, tidx2);
+              }
+              if (tag.startsWith("c#")) {
+                // hex colour tag
+                nextColour = parseHexColour(tag.substring(1));
+                tagRecognized = true;
+              } else if (tag.startsWith("c:")) {
+                // named colour tag
+                String name = tag.substring(2);
+                if (colours != nullptr && colours->containsKey(name)) {
+                  nextColour = parseHexColour((*colours)[name]);
+                }
+                tagRecognized = true;
+              } else if (tag.startsWith("/c")) {
+                // end of colour tag
+                nextColour = defaultColour;
+                tagRecognized = true;
+              }
+              if (tagRecognized) {
+                // ...first add everything up to the tag...
+                attributedString.append(line.substring(0, tidx), font, currentColour);
+                // ...then drop up to and including the tag.
+                line = line.substring(tidx2+1);
+              } else {
+                // ...first add everything up to and including the token...
+                attributedString.append(line.substring(0, tidx+1), font, currentColour);
+                // ...then drop it.
+                line = line.substring(tidx+1);
+              }
+            } else {
+              // if no token was found -> add the remaining text...
+              attributedString.append(line, font, currentColour);
+              // ...and clear the line.
+              line.clear();
+            }
+            currentColour = nextColour;
+            if (needsNewFont) {
+              font = font.withStyle(Font::plain);
+              if (bold) { font = font.boldened(); }
+              if (italic) { font = font.italicised(); }
+            }
+          }
+        }
+        
+        if (addNewline) {
+          attributedString.append(" \n", font, defaultColour);
+        }
+      }
+      return attributedString;
+    }
+    
+    Colour parseHexColour(String s) { return BarelyMLDocument::parseHexColour(s, defaultColour); }
+    
+    Colour defaultColour;
+    Colour currentColour;
+    StringPairArray* colours;
+    StringPairArray palette;
+  };
+  
+  inline AttributedString legacyParsePureText(const StringArray& lines, Font font)
+  {
+    LegacyTokenizer tokenizer;
+    return tokenizer.parsePureText(lines, font);
+  }
+
+  // builds the AttributedString for all runs of a parsed document (the same work
+  // BarelyMLDisplay's blocks do, without needing a component)
+  inline AttributedString buildAttributedString(const BarelyMLDocument& doc, Font font)
+  {
+    AttributedString attributedString;
+    for (auto& run : doc.runs) {
+      Font f = font;
+      if (run.flags & BarelyMLDocument::bold) { f = f.boldened(); }
+      if (run.flags & BarelyMLDocument::italic) { f = f.italicised(); }
+      attributedString.append(doc.getText(run.text), f, Colours::black);
+    }
+    return attributedString;
+  }
+
+  // a paragraph with a formatting marker every few characters
+  inline String createFormattedParagraph(int numLines, int markersPerLine)
+  {
+    StringArray lines;
+    for (int l=0; l<numLines; l++) {
+      String line;
+      for (int m=0; m<markersPerLine; m++) {
+        switch (m % 4) {
+          case 0:  line << "*bold* "; break;
+          case 1:  line << "_italic_ "; break;
+          case 2:  line << "<c:red>red</c> "; break;
+          default: line << "<c#0A0>green</c> a < b "; break;
+        }
+      }
+      lines.add(line);
+    }
+    return lines.joinIntoString("\n");
+  }
+
+  // a document of paragraphs which are dense with formatting markers
+  inline String createFormattedDocument(int numParagraphs, int linesPerParagraph, int markersPerLine)
+  {
+    StringArray paragraphs;
+    for (int p=0; p<numParagraphs; p++) {
+      paragraphs.add(createFormattedParagraph(linesPerParagraph, markersPerLine));
+    }
+    return paragraphs.joinIntoString("\n\n");
+  }
+  
+  // ordered and unordered lists, nested up to maxDepth levels
+  inline String createDeepLists(int numItems, int maxDepth)
+  {
+    StringArray lines;
+    for (int i=0; i<numItems; i++) {
+      int depth = i % maxDepth;
+      String indent = String::repeatedString(" ", depth);
+      if ((i / maxDepth) % 2 == 0) {
+        lines.add(indent + "- item " + String(i) + " with *bold* and _italic_ text");
+      } else {
+        lines.add(indent + String(depth+1) + ". item " + String(i) + " with <c:blue>coloured</c> text");
+      }
+    }
+    return lines.joinIntoString("\n");
+  }
+  
+  // a table with a header row and numRows x numColumns cells, containing links and images
+  inline String createTable(int numRows, int numColumns)
+  {
+    StringArray lines;
+    String header = "^";
+    for (int j=0; j<numColumns; j++) {
+      header << " Column " << j << " ^";
+    }
+    lines.add(header);
+    for (int i=0; i<numRows; i++) {
+      String row = "|";
+      for (int j=0; j<numColumns; j++) {
+        switch ((i+j) % 4) {
+          case 0:  row << " [[https://example.com/" << i << "/" << j << "|link " << j << "]] |"; break;
+          case 1:  row << " {{image" << j << ".svg?40}} |"; break;
+          case 2:  row << " *bold* cell " << i << " |"; break;
+          default: row << " plain cell with some more text |"; break;
+        }
+      }
+      lines.add(row);
+    }
+    return lines.joinIntoString("\n");
+  }
+  
+  // a document made of lines with links (every line becomes a block of its own)
+  inline String createLinkLines(int numLines)
+  {
+    StringArray lines;
+    for (int i=0; i<numLines; i++) {
+      lines.add("See [[https://example.com/page" + String(i) + "|page " + String(i) + "]] for *details* on topic " + String(i));
+    }
+    return lines.joinIntoString("\n");
+  }
+  
+  // a bit of everything, the way a help page would use it
+  inline String createMixedDocument(int numSections)
+  {
+    StringArray sections;
+    for (int s=0; s<numSections; s++) {
+      StringArray lines;
+      lines.add("# Section " + String(s));
+      lines.add("## Overview");
+      lines.add(createFormattedParagraph(3, 8));
+      lines.add("");
+      lines.add("INFO: Admonitions can contain *bold* and _italic_ text.");
+      lines.add(createDeepLists(6, 3));
+      lines.add("");
+      lines.add(createTable(3, 3));
+      lines.add("");
+      lines.add("{{diagram" + String(s % 8) + ".svg?200}}");
+      lines.add(createLinkLines(2));
+      lines.add("");
+      sections.add(lines.joinIntoString("\n"));
+    }
+    return sections.joinIntoString("\n");
+  }
+  
+  // draws a rectangle for every image, so that image blocks and cells don't need files
+  class SyntheticFileSource : public BarelyMLDisplay::FileSource
+  {
+  public:
+    std::unique_ptr<Drawable> getDrawableForFilename(String) override {
+      auto d = std::make_unique<DrawableRectangle>();
+      d->setRectangle(Parallelogram<float>(Rectangle<float>(0.f, 0.f, 120.f, 80.f)));
+      d->setFill(Colours::lightblue);
+      return d;
+    }
+  };
+  
+  // runs f at least once and until minSeconds have passed, and returns the average time per call
+  // in microseconds (and the number of calls)
+  template <typename Function>
+  double measureFor(double minSeconds, int& iterations, Function&& f)
+  {
+    auto start = Time::getHighResolutionTicks();
+    auto ticks = start - start;
+    iterations = 0;
+    do {
+      f();
+      iterations++;
+      ticks = Time::getHighResolutionTicks() - start;
+    } while (Time::highResolutionTicksToSeconds(ticks) < minSeconds);
+    return Time::highResolutionTicksToSeconds(ticks) * 1.0e6 / iterations;
+  }
+  
+  // collects timings as JSON objects (and prints them as they come in)
+  class Results
+  {
+  public:
+    Results(double minSecondsPerCase, const String& filterString) : minSeconds(minSecondsPerCase), filter(filterString) {}
+    
+    // times f for the given benchmark and corpus (unless it's filtered out)
+    template <typename Function>
+    void run(const String& benchmark, const String& corpus, int64 bytes, Function&& f)
+    {
+      String name = benchmark + "/" + corpus;
+      if (filter.isNotEmpty() && !name.contains(filter)) { return; }
+      int iterations = 0;
+      double microseconds = measureFor(minSeconds, iterations, f);
+      add(benchmark, corpus, bytes, microseconds, iterations);
+    }
+    
+    void add(const String& benchmark, const String& corpus, int64 bytes, double microseconds, int iterations)
+    {
+      DynamicObject::Ptr result = new DynamicObject();
+      result->setProperty("benchmark", benchmark);
+      result->setProperty("corpus", corpus);
+      result->setProperty("bytes", bytes);
+      result->setProperty("iterations", iterations);
+      result->setProperty("microseconds", microseconds);
+      if (bytes > 0) {
+        result->setProperty("megabytesPerSecond", (double)bytes / microseconds);
+      }
+      results.add(var(result.get()));
+      std::cerr << (benchmark + "/" + corpus).paddedRight(' ', 40) << String(microseconds, 1).paddedLeft(' ', 14) << " us" << std::endl;
+    }
+    
+    String toJSON() const
+    {
+      DynamicObject::Ptr root = new DynamicObject();
+      root->setProperty("library", "BarelyML");
+      root->setProperty("version", "0.3");
+      root->setProperty("juceVersion", SystemStats::getJUCEVersion());
+      root->setProperty("cpu", SystemStats::getCpuModel());
+      root->setProperty("numCpus", SystemStats::getNumCpus());
+      root->setProperty("os", SystemStats::getOperatingSystemName());
+      root->setProperty("time", Time::getCurrentTime().toISO8601(true));
+      root->setProperty("minSecondsPerCase", minSeconds);
+      root->setProperty("results", results);
+      return JSON::toString(var(root.get()));
+    }
+    
+  private:
+    double minSeconds;
+    String filter;
+    Array<var> results;
+  };
+}
+
+//==============================================================================
+// Usage: BarelyMLBenchmark [--scale N] [--min-time seconds] [--filter name] [--output file.json]
+//        --scale multiplies the corpus sizes, --filter only runs benchmarks whose name (e.g.
+//        "parse/tables") contains the given string, results are written to stdout as JSON
+//        unless an output file is given (progress is always reported on stderr).
+int main (int argc, char* argv[])
+{
+  ScopedJuceInitialiser_GUI juce;       // fonts and components need the GUI classes
+  ArgumentList args(argc, argv);
+  int scale = args.containsOption("--scale") ? jmax(1, args.getValueForOption("--scale").getIntValue()) : 1;
+  double minSeconds = args.containsOption("--min-time") ? args.getValueForOption("--min-time").getDoubleValue() : 0.5;
+  BarelyMLBenchmark::Results results(minSeconds, args.getValueForOption("--filter"));
+  
+  Font font(15.0f);
+  
+  // inline tokenizer: legacy vs. single pass
+  for (int markers : { 16, 64, 256, 1024 }) {
+    String paragraph = BarelyMLBenchmark::createFormattedParagraph(8, markers);
+    StringArray lines = StringArray::fromLines(paragraph);
+    int64 bytes = (int64)paragraph.getNumBytesAsUTF8();
+    String corpus = "paragraph-8x" + String(markers);
+    results.run("tokenizer-legacy", corpus, bytes, [&] {
+      auto s = BarelyMLBenchmark::legacyParsePureText(lines, font);
+      ignoreUnused(s);
+    });
+    results.run("tokenizer", corpus, bytes, [&] {
+      auto doc = BarelyMLDocument::parse(paragraph);
+      auto s = BarelyMLBenchmark::buildAttributedString(doc, font);
+      ignoreUnused(s);
+    });
+  }
+  
+  // BarelyML corpora
+  StringPairArray corpora;
+  corpora.set("formatted", BarelyMLBenchmark::createFormattedDocument(200*scale, 4, 32));
+  corpora.set("lists", BarelyMLBenchmark::createDeepLists(5000*scale, 5));
+  corpora.set("tables", BarelyMLBenchmark::createTable(500*scale, 8));
+  corpora.set("links", BarelyMLBenchmark::createLinkLines(5000*scale));
+  corpora.set("mixed", BarelyMLBenchmark::createMixedDocument(200*scale));
+  
+  BarelyMLBenchmark::SyntheticFileSource files;
+  for (auto& corpus : corpora.getAllKeys()) {
+    String markup = corpora[corpus];
+    int64 bytes = (int64)markup.getNumBytesAsUTF8();
+    
+    results.run("parse", corpus, bytes, [&] {
+      auto doc = BarelyMLDocument::parse(markup);
+      ignoreUnused(doc);
+    });
+    results.run("parse-stream", corpus, bytes, [&] {
+      BarelyMLDocument::StreamParser parser; // (in 64 kB chunks, like setMarkupStream)
+      const char* data = markup.toRawUTF8();
+      for (int64 i=0; i<bytes; i+=65536) {
+        parser.addData(data+i, (size_t)jmin((int64)65536, bytes-i));
+      }
+      parser.finish();
+    });
+    MemoryBlock compiled = BarelyMLDisplay::compile(markup);
+    results.run("fromBinary", corpus, bytes, [&] {
+      auto doc = BarelyMLDocument::fromBinary(compiled.getData(), compiled.getSize());
+      ignoreUnused(doc);
+    });
+    
+    BarelyMLDisplay display;
+    display.setFileSource(&files);
+    display.setSize(800, 600);
+    results.run("setMarkupString", corpus, bytes, [&] {
+      display.setFileSource(&files);    // (so that no blocks are reused, but the document is shared)
+      display.setMarkupString(markup);
+    });
+    results.run("parse+setDocument", corpus, bytes, [&] {
+      display.setFileSource(&files);    // (nothing reused, apart from the shared attributed strings)
+      display.setDocument(std::make_shared<const BarelyMLDocument>(BarelyMLDocument::parse(markup)));
+    });
+    results.run("setMarkupString-unchanged", corpus, bytes, [&] {
+      display.setMarkupString(markup);  // (all blocks are reused)
+    });
+    
+    // layout at several widths (cycling through more widths than blocks remember heights for, so
+    // every call measures the blocks in view again)
+    for (int width : { 320, 800, 1600 }) {
+      int offset = 0;
+      results.run("resized-" + String(width), corpus, bytes, [&] {
+        display.setSize(width + offset, 600);
+        offset = (offset+1) % 16;
+      });
+    }
+    
+    // offscreen painting of a page at the top and in the middle (with cached layouts)
+    BarelyMLDisplay::Renderer renderer(display);
+    Image page(Image::ARGB, 800, 600, true, SoftwareImageType());
+    int height = renderer.layout(800).height;
+    results.run("paint-800x600", corpus, 0, [&] {
+      for (int y : { 0, height/2 }) {
+        Graphics g(page);
+        g.setOrigin(0, -y);
+        renderer.render(g, 800, Rectangle<int>(0, y, 800, 600));
+      }
+    });
+    
+    // conversion to the other formats
+    results.run("convertToMarkdown", corpus, bytes, [&] { ignoreUnused(BarelyMLDisplay::convertToMarkdown(markup)); });
+    results.run("convertToDokuWiki", corpus, bytes, [&] { ignoreUnused(BarelyMLDisplay::convertToDokuWiki(markup)); });
+    results.run("convertToAsciiDoc", corpus, bytes, [&] { ignoreUnused(BarelyMLDisplay::convertToAsciiDoc(markup)); });
+  }
+  
+  // conversion from very large Markdown, DokuWiki and AsciiDoc inputs
+  String large = BarelyMLBenchmark::createMixedDocument(2000*scale);
+  String md = BarelyMLDisplay::convertToMarkdown(large);
+  String dw = BarelyMLDisplay::convertToDokuWiki(large);
+  String ad = BarelyMLDisplay::convertToAsciiDoc(large);
+  results.run("convertFromMarkdown", "large", (int64)md.getNumBytesAsUTF8(), [&] { ignoreUnused(BarelyMLDisplay::convertFromMarkdown(md)); });
+  results.run("convertFromDokuWiki", "large", (int64)dw.getNumBytesAsUTF8(), [&] { ignoreUnused(BarelyMLDisplay::convertFromDokuWiki(dw)); });
+  results.run("convertFromAsciiDoc", "large", (int64)ad.getNumBytesAsUTF8(), [&] { ignoreUnused(BarelyMLDisplay::convertFromAsciiDoc(ad)); });
+  
+  String json = results.toJSON();
+  if (args.containsOption("--output")) {
+    File output = File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--output"));
+    if (!output.replaceWithText(json)) {
+      std::cerr << "Can't write " << output.getFullPathName() << std::endl;
+      return 1;
+    }
+  } else {
+    std::cout << json << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ The block below describes the properties of this PIP. A PIP is a short snippet
+ of code that can be read by the Projucer and used to generate a JUCE project.
+
+ BEGIN_JUCE_PIP_METADATA
+
+ name:             BarelyMLCompiler
+ version:          0.3
+ vendor:           Fritz Menzer
+ website:          https://mnsp.ch
+ description:      Compiles markup into pre-parsed documents for BarelyMLDisplay::setCompiledDocument.
+
+ dependencies:     juce_core, juce_data_structures, juce_events, juce_graphics, juce_gui_basics
+ exporters:        LINUX_MAKE, XCODE_MAC, VS2022
+
+ moduleFlags:      JUCE_STRICT_REFCOUNTEDPOINTER=1, JUCE_UNIT_TESTS=1
+
+ type:             Console
+
+ END_JUCE_PIP_METADATA
+
+ *******************************************************************************/
+
+#pragma once
+
+#include "BarelyML.h"
+#include "BarelyML.cpp" // ugly, but works...
+
+using namespace juce;
+
+//==============================================================================
+// usage: BarelyMLCompiler [--markdown|--dokuwiki|--asciidoc] input output
+//        (e.g. as a pre-build step, with the output added to the BinaryData)
+//        BarelyMLCompiler --test runs the unit tests (e.g. of the binary format)
+int main (int argc, char* argv[])
+{
+  ArgumentList args(argc, argv);
+  if (args.removeOptionIfFound("--test")) {
+    UnitTestRunner runner;
+    runner.runTestsInCategory("BarelyML");
+    int failures = 0;
+    for (int i=0; i<runner.getNumResults(); i++) {
+      failures += runner.getResult(i)->failures;
+    }
+    return failures > 0 ? 1 : 0;
+  }
+  bool fromMarkdown = args.removeOptionIfFound("--markdown");
+  bool fromDokuWiki = args.removeOptionIfFound("--dokuwiki");
+  bool fromAsciiDoc = args.removeOptionIfFound("--asciidoc");
+  if (args.size() != 2) {
+    std::cerr << "usage: BarelyMLCompiler [--markdown|--dokuwiki|--asciidoc] input output" << std::endl;
+    return 1;
+  }
+
+  File input = args[0].resolveAsFile();
+  File output = args[1].resolveAsFile();
+  if (!input.existsAsFile()) {
+    std::cerr << "can't read " << input.getFullPathName() << std::endl;
+    return 1;
+  }
+  String markup = input.loadFileAsString();
+  if (fromMarkdown) { markup = BarelyMLDisplay::convertFromMarkdown(markup); }
+  if (fromDokuWiki) { markup = BarelyMLDisplay::convertFromDokuWiki(markup); }
+  if (fromAsciiDoc) { markup = BarelyMLDisplay::convertFromAsciiDoc(markup); }
+
+  MemoryBlock compiled = BarelyMLDisplay::compile(markup);
+  if (!output.replaceWithData(compiled.getData(), compiled.getSize())) {
+    std::cerr << "can't write " << output.getFullPathName() << std::endl;
+    return 1;
+  }
+  std::cout << input.getFileName() << ": " << markup.getNumBytesAsUTF8() << " bytes of markup -> "
+            << compiled.getSize() << " bytes" << std::endl;
+  return 0;
+}
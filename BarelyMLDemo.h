@@ -34,6 +34,61 @@
 
 using namespace juce;
 
+//==============================================================================
+// shows the statistics of a BarelyMLDisplay, updated a few times per second (this overlay
+// shouldn't cover the display, otherwise its repaints show up in the display's paint times)
+class StatsOverlay : public Component, private Timer
+{
+public:
+  StatsOverlay(BarelyMLDisplay& d) : display(d) { setInterceptsMouseClicks(false, false); }
+  
+  void setActive(bool shouldBeActive) {
+    display.setStatsEnabled(shouldBeActive);
+    display.resetStats();
+    setVisible(shouldBeActive);
+    if (shouldBeActive) { startTimerHz(4); } else { stopTimer(); }
+  }
+  
+  void paint(Graphics& g) override {
+    g.setColour(Colours::black.withAlpha(0.75f));
+    g.fillRoundedRectangle(getLocalBounds().toFloat(), 6.f);
+    g.setColour(Colours::white);
+    g.setFont(Font(Font::getDefaultMonospacedFontName(), 12.f, Font::plain));
+    g.drawMultiLineText(text, 8, 18, getWidth()-16);
+  }
+  
+private:
+  void timerCallback() override {
+    BarelyMLDisplay::Stats s = display.getStats();
+    auto phase = [](const String& name, const BarelyMLDisplay::PhaseStats& p) {
+      return name.paddedRight(' ', 12) + String(p.lastMs, 2).paddedLeft(' ', 8) + " ms   total "
+             + String(p.totalMs, 1) + " ms in " + String(p.calls) + " calls\n";
+    };
+    auto rate = [](const String& name, int hits, int misses) {
+      String r = hits+misses > 0 ? String(100.0*hits/(hits+misses), 1) + "%" : String("-");
+      return name.paddedRight(' ', 12) + r.paddedLeft(' ', 8) + " hits   (" + String(hits) + "/" + String(hits+misses) + ")\n";
+    };
+    text = phase("classify", s.classify) + phase("parse", s.parse) + phase("images", s.loadImages)
+         + phase("measure", s.measure) + phase("paint", s.paint)
+         + "blocks      " + String(s.numBlocks[BarelyMLDocument::textBlock]) + " text, "
+         + String(s.numBlocks[BarelyMLDocument::listItemBlock]) + " list, "
+         + String(s.numBlocks[BarelyMLDocument::tableBlock]) + " table ("
+         + String(s.numTableCells) + " cells), "
+         + String(s.numBlocks[BarelyMLDocument::imageBlock]) + " image, "
+         + String(s.numBlocks[BarelyMLDocument::admonitionBlock]) + " admonition\n"
+         + rate("drawables", s.drawableCacheHits, s.drawableCacheMisses)
+         + rate("heights", s.heightCacheHits, s.heightCacheMisses).trimEnd() + ", "
+         + String(s.heightsEstimated) + " estimated\n"
+         + rate("paint tiles", s.paintCacheHits, s.paintCacheMisses)
+         + rate("shaping", s.sharedLayoutHits, s.sharedLayoutMisses)
+         + "TextLayouts " + String(s.textLayoutsCreated).paddedLeft(' ', 8) + " created";
+    repaint();
+  }
+  
+  BarelyMLDisplay& display;
+  String text;
+};
+
 //==============================================================================
 class BarelyMLDemo  : public Component, BarelyMLDisplay::URLHandler, TextEditor::Listener, ComboBox::Listener
 {
@@ -86,6 +141,12 @@ public:
     formatBox.setSelectedId(1);
     formatBox.addListener(this);
     addAndMakeVisible(formatBox);
+    
+    // set up the statistics overlay (hidden until the button is toggled)
+    statsButton.setButtonText("Stats");
+    statsButton.onClick = [this] { statsOverlay.setActive(statsButton.getToggleState()); };
+    addAndMakeVisible(statsButton);
+    addChildComponent(statsOverlay);
 
     setSize (800, 600);
   }
@@ -107,7 +168,7 @@ public:
   // TextEditor::Listener method
   void textEditorTextChanged (TextEditor& editorThatWasChanged) override {
     if (&editorThatWasChanged == &editor) {
-      display.setMarkupString(editor.getText());
+      display.setMarkupStringCoalesced(editor.getText());
     }
     if (&editorThatWasChanged == &importEditor) {
       if (formatBox.getSelectedId() == Markdown_ID) {
@@ -162,7 +223,9 @@ public:
       display.setBounds(v/2+20, 10, v-v/2, h-20);
     }
     formatLabel.setBounds(10, h-34, 120, 24);
-    formatBox.setBounds(140, h-34, display.getX()-150, 24);
+    formatBox.setBounds(140, h-34, display.getX()-230, 24);
+    statsButton.setBounds(display.getX()-80, h-34, 70, 24);
+    statsOverlay.setBounds(editor.getX()+10, editor.getBottom()-185, editor.getWidth()-20, 175);
   }
   
   
@@ -172,6 +235,8 @@ private:
   TextEditor      importEditor;
   Label           formatLabel;
   ComboBox        formatBox;
+  ToggleButton    statsButton;
+  StatsOverlay    statsOverlay { display };
 
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BarelyMLDemo)
 };